@@ -0,0 +1,283 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+
+#include <rdlib/DateTime.h>
+
+#include "CommandRunner.h"
+
+extern char **environ;
+
+CommandRunner::CommandRunner() : AThread(),
+                                 maxrunning(4),
+                                 maxqueued(64),
+                                 running(false)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+CommandRunner::~CommandRunner()
+{
+    Stop();
+}
+
+CommandRunner& CommandRunner::Get()
+{
+    static CommandRunner runner;
+    return runner;
+}
+
+void CommandRunner::Configure(uint_t _maxrunning, uint_t _maxqueued)
+{
+    AThreadLock lock(tlock);
+
+    maxrunning = std::max(_maxrunning, 1U);
+    maxqueued  = std::max(_maxqueued,  1U);
+}
+
+bool CommandRunner::Start()
+{
+    if (!running) running = AThread::Start();
+    return running;
+}
+
+void CommandRunner::Stop()
+{
+    if (running) {
+        // let everything queued run (each command is limited by its timeout)
+        while (true) {
+            STATS _stats = GetStats();
+
+            if (!_stats.queued && !_stats.running) break;
+
+            Sleep(10);
+        }
+
+        AThread::Stop();
+        running = false;
+    }
+}
+
+CommandRunner::STATS CommandRunner::GetStats()
+{
+    AThreadLock lock(tlock);
+    STATS _stats = stats;
+
+    _stats.queued = (uint_t)jobs.size();
+
+    return _stats;
+}
+
+pid_t CommandRunner::Spawn(const AString& cmd)
+{
+    char *argv[] = {(char *)"sh", (char *)"-c", (char *)cmd.str(), NULL};
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t    pid;
+
+    posix_spawnattr_init(&attr);
+
+    // own process group so that a timed out command can be killed along with its children
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    // restore signals handled (or blocked) by imagediff
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    if (posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ) != 0) pid = -1;
+
+    posix_spawnattr_destroy(&attr);
+
+    return pid;
+}
+
+int CommandRunner::Status(int status)
+{
+    if (WIFEXITED(status))   return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 256 + WTERMSIG(status);
+    return Status_NotStarted;
+}
+
+void CommandRunner::Kill(PROCESS& process, uint64_t now)
+{
+    // ask nicely first, then give it two seconds
+    if (!process.terminated) {
+        kill(-process.pid, SIGTERM);
+        process.terminated = true;
+        process.deadline   = now + 2000;
+    }
+    else {
+        kill(-process.pid, SIGKILL);
+        process.deadline   = 0;
+    }
+}
+
+void CommandRunner::Finish(Job *job, int status)
+{
+    job->Finished(status);
+    delete job;
+
+    AThreadLock lock(tlock);
+    if      (status == Status_TimedOut)  stats.timedout++;
+    else if (status == Status_Dropped)   stats.dropped++;
+    else if (status == Status_Coalesced) stats.coalesced++;
+}
+
+void CommandRunner::Add(Job *job)
+{
+    if (!running) {
+        // run on this thread
+        PROCESS process = {job, Spawn(job->cmd), job->timeout ? (uint64_t)ADateTime() + job->timeout : 0, false};
+        int     status;
+
+        if (process.pid > 0) {
+            while (waitpid(process.pid, &status, WNOHANG) == 0) {
+                uint64_t now = (uint64_t)ADateTime();
+
+                if (process.deadline && (now >= process.deadline)) Kill(process, now);
+
+                Sleep(10);
+            }
+
+            Finish(job, process.terminated ? (int)Status_TimedOut : Status(status));
+        }
+        else Finish(job, Status_NotStarted);
+
+        return;
+    }
+
+    Job *oldjob = NULL, *dropped = NULL;
+
+    {
+        AThreadLock lock(tlock);
+
+        if (job->coalesce) {
+            std::deque<Job *>::reverse_iterator it;
+
+            // replace owner's last queued job if it can be coalesced
+            for (it = jobs.rbegin(); (it != jobs.rend()) && ((*it)->owner != job->owner); ++it) ;
+
+            if ((it != jobs.rend()) && (*it)->coalesce) {
+                oldjob = *it;
+                *it    = job;
+                job    = NULL;
+            }
+        }
+
+        if (job) {
+            if (jobs.size() < maxqueued) jobs.push_back(job);
+            else                         dropped = job;
+        }
+    }
+
+    if (oldjob)  Finish(oldjob,  Status_Coalesced);
+    if (dropped) Finish(dropped, Status_Dropped);
+}
+
+bool CommandRunner::StartJobs()
+{
+    std::vector<Job *> failed;
+    bool started = false;
+
+    {
+        AThreadLock lock(tlock);
+        std::vector<const void *> owners;
+        std::deque<Job *>::iterator it;
+        const uint64_t now = (uint64_t)ADateTime();
+        size_t i;
+
+        // owners with a command running cannot start another
+        for (i = 0; i < processes.size(); i++) owners.push_back(processes[i].job->owner);
+
+        for (it = jobs.begin(); (it != jobs.end()) && (processes.size() < maxrunning);) {
+            Job *job = *it;
+
+            // an owner's later jobs wait behind its first
+            if (std::find(owners.begin(), owners.end(), job->owner) == owners.end()) {
+                PROCESS process = {job, Spawn(job->cmd), job->timeout ? now + job->timeout : 0, false};
+
+                owners.push_back(job->owner);
+                it = jobs.erase(it);
+
+                if (process.pid > 0) {
+                    processes.push_back(process);
+                    stats.started++;
+                }
+                else failed.push_back(job);
+
+                started = true;
+            }
+            else ++it;
+        }
+
+        stats.running = (uint_t)processes.size();
+    }
+
+    size_t i;
+    for (i = 0; i < failed.size(); i++) Finish(failed[i], Status_NotStarted);
+
+    return started;
+}
+
+bool CommandRunner::CheckProcesses()
+{
+    const uint64_t now = (uint64_t)ADateTime();
+    bool   finished = false;
+    size_t i;
+
+    for (i = 0; i < processes.size();) {
+        PROCESS& process = processes[i];
+        int   status = 0;
+        pid_t pid    = waitpid(process.pid, &status, WNOHANG);
+
+        if ((pid == process.pid) || ((pid < 0) && (errno == ECHILD))) {
+            Job *job = process.job;
+            int res  = process.terminated ? (int)Status_TimedOut : ((pid == process.pid) ? Status(status) : (int)Status_NotStarted);
+
+            processes.erase(processes.begin() + i);
+            {
+                AThreadLock lock(tlock);
+                stats.running = (uint_t)processes.size();
+            }
+
+            Finish(job, res);
+            finished = true;
+        }
+        else {
+            if (process.deadline && (now >= process.deadline)) Kill(process, now);
+            i++;
+        }
+    }
+
+    return finished;
+}
+
+void *CommandRunner::Run()
+{
+    while (!quitthread) {
+        // reap first so that freed slots can be used straight away
+        bool busy = CheckProcesses();
+
+        busy |= StartJobs();
+
+        if (!busy) Sleep(10);
+    }
+
+    return NULL;
+}
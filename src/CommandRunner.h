@@ -0,0 +1,114 @@
+#ifndef __COMMAND_RUNNER__
+#define __COMMAND_RUNNER__
+
+#include <deque>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <rdlib/strsup.h>
+#include <rdlib/Thread.h>
+#include <rdlib/ThreadLock.h>
+
+/*--------------------------------------------------------------------------------
+ * Runs external commands (through /bin/sh, started with posix_spawn) from a
+ * single thread so that slow commands never hold up the sources
+ *
+ * Commands of one owner start in the order they were added and never overlap,
+ * commands of different owners run concurrently up to a limit
+ *
+ * A coalescing job replaces the owner's last queued job if that is also a
+ * coalescing job which has not started yet (so a stream of identical hooks only
+ * ever has one waiting)
+ *
+ * Commands running longer than their timeout have their process group sent
+ * SIGTERM, then SIGKILL
+ *--------------------------------------------------------------------------------*/
+class CommandRunner : public AThread {
+public:
+    enum {
+        Status_NotStarted = -1,     // could not be spawned
+        Status_TimedOut   = -2,     // killed after timeout
+        Status_Dropped    = -3,     // queue full
+        Status_Coalesced  = -4,     // replaced by a later job
+    };
+
+    class Job {
+    public:
+        Job(const void *_owner, const AString& _cmd, uint32_t _timeout = 0, bool _coalesce = false) :
+            owner(_owner),
+            cmd(_cmd),
+            timeout(_timeout),
+            coalesce(_coalesce) {}
+        virtual ~Job() {}
+
+        // called on the runner's thread when the command has finished:
+        // status is the exit code (0-255), killed by signal (256 + signal) or Status_xxx
+        virtual void Finished(int status) {UNUSED(status);}
+
+    protected:
+        friend class CommandRunner;
+
+        const void *owner;
+        AString    cmd;
+        uint32_t   timeout;         // ms, 0 for none
+        bool       coalesce;
+    };
+
+    typedef struct {
+        uint_t   queued;        // jobs currently queued
+        uint_t   running;       // commands currently running
+        uint_t   started;       // commands started
+        uint_t   coalesced;     // jobs replaced by later jobs
+        uint_t   dropped;       // jobs dropped due to a full queue
+        uint_t   timedout;      // commands killed after their timeout
+    } STATS;
+
+    static CommandRunner& Get();
+
+    void Configure(uint_t _maxrunning, uint_t _maxqueued);
+
+    bool Start();
+    // waits for queued and running commands (up to their timeouts)
+    void Stop();
+
+    // queue job, ownership passes to the runner
+    // (if the runner is not running the command is run on the caller's thread)
+    void Add(Job *job);
+
+    STATS GetStats();
+
+protected:
+    CommandRunner();
+    virtual ~CommandRunner();
+
+    virtual void *Run();
+
+    typedef struct {
+        Job      *job;
+        pid_t    pid;
+        uint64_t deadline;      // ms, 0 for none
+        bool     terminated;    // SIGTERM sent
+    } PROCESS;
+
+    static pid_t Spawn(const AString& cmd);
+    static int   Status(int status);
+    static void  Kill(PROCESS& process, uint64_t now);
+    void Finish(Job *job, int status);
+
+    // start any jobs that can run, returns true if any were
+    bool StartJobs();
+    // reap finished commands and kill timed out ones, returns true if any finished
+    bool CheckProcesses();
+
+protected:
+    AThreadLockObject    tlock;
+    std::deque<Job *>    jobs;
+    std::vector<PROCESS> processes;     // only used by the runner's thread
+    uint_t               maxrunning;
+    uint_t               maxqueued;
+    volatile bool        running;
+    STATS                stats;
+};
+
+#endif
@@ -0,0 +1,309 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <algorithm>
+
+#include <rdlib/DateTime.h>
+#include <rdlib/Recurse.h>
+
+#include "DetectionLog.h"
+
+DetectionLog::DetectionLog() : AThread(),
+                               interval(1000),
+                               running(false)
+{
+}
+
+DetectionLog::~DetectionLog()
+{
+    Stop();
+}
+
+DetectionLog& DetectionLog::Get()
+{
+    static DetectionLog log;
+    return log;
+}
+
+void DetectionLog::Configure(uint32_t _interval)
+{
+    interval = std::max(_interval, (uint32_t)10);
+}
+
+bool DetectionLog::Start()
+{
+    if (!running) running = AThread::Start();
+    return running;
+}
+
+void DetectionLog::Stop()
+{
+    if (running) {
+        AThread::Stop();
+        running = false;
+    }
+
+    Flush();
+}
+
+void DetectionLog::Add(const AString& filename, const RECORD& record)
+{
+    if (!running) {
+        AThreadLock lock(writelock);
+        std::vector<RECORD> records(1, record);
+
+        Write(filename, records);
+    }
+    else {
+        AThreadLock lock(tlock);
+
+        pending[filename].push_back(record);
+    }
+}
+
+void DetectionLog::Flush()
+{
+    std::map<AString, std::vector<RECORD> > records;
+
+    {
+        AThreadLock lock(tlock);
+        records.swap(pending);
+    }
+
+    AThreadLock lock(writelock);
+    std::map<AString, std::vector<RECORD> >::iterator it;
+    for (it = records.begin(); it != records.end(); ++it) {
+        Write(it->first, it->second);
+    }
+}
+
+bool DetectionLog::SetFilename(char *dst, const AString& src)
+{
+    const size_t len = std::min((size_t)src.len(), (size_t)MaxFilename - 1);
+
+    memcpy(dst, src.str(), len);
+    memset(dst + len, 0, MaxFilename - len);
+
+    return (len == (size_t)src.len());
+}
+
+void DetectionLog::InitHeader(HEADER& header)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IDIFFDL1", sizeof(header.magic));
+    header.recordsize   = sizeof(RECORD);
+    header.blockrecords = BlockRecords;
+}
+
+bool DetectionLog::ReadIndex(const AString& filename, uint64_t nrecords, std::vector<INDEXENTRY>& index)
+{
+    // the index starts with the number of records it covers, anything that does not
+    // match the data file (missing, or left behind by a crash) is rebuilt from the records
+    const size_t nblocks = (size_t)((nrecords + BlockRecords - 1) / BlockRecords);
+    uint64_t count = 0;
+    int      fd;
+
+    index.resize(nblocks);
+
+    if ((fd = open(filename + ".idx", O_RDONLY | O_CLOEXEC)) >= 0) {
+        bool valid = ((pread(fd, &count, sizeof(count), 0) == (ssize_t)sizeof(count)) &&
+                      (count == nrecords) &&
+                      (pread(fd, index.data(), nblocks * sizeof(index[0]), sizeof(count)) == (ssize_t)(nblocks * sizeof(index[0]))));
+        close(fd);
+
+        if (valid) return true;
+    }
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) >= 0) {
+        std::vector<RECORD> block(BlockRecords);
+        size_t b;
+
+        for (b = 0; b < nblocks; b++) {
+            const size_t n = (size_t)std::min(nrecords - (uint64_t)b * BlockRecords, (uint64_t)BlockRecords);
+            size_t i;
+
+            if (pread(fd, &block[0], n * sizeof(RECORD), sizeof(HEADER) + (off_t)b * BlockRecords * sizeof(RECORD)) != (ssize_t)(n * sizeof(RECORD))) break;
+
+            index[b].mintime = index[b].maxtime = block[0].time;
+            for (i = 1; i < n; i++) {
+                index[b].mintime = std::min(index[b].mintime, block[i].time);
+                index[b].maxtime = std::max(index[b].maxtime, block[i].time);
+            }
+        }
+
+        close(fd);
+
+        // unreadable blocks must not be skipped
+        for (; b < nblocks; b++) {
+            index[b].mintime = 0;
+            index[b].maxtime = ~(uint64_t)0;
+        }
+    }
+
+    return false;
+}
+
+bool DetectionLog::Write(const AString& filename, const std::vector<RECORD>& records)
+{
+    // called with writelock held
+    HEADER header, fileheader;
+    bool   success = false;
+    int    fd;
+
+    if (records.empty()) return true;
+
+    InitHeader(header);
+
+    CreateDirectory(filename.PathPart());
+    if ((fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) >= 0) {
+        off_t size = lseek(fd, 0, SEEK_END);
+
+        if (size < (off_t)sizeof(header)) {
+            if (pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)) size = sizeof(header);
+        }
+        else if ((pread(fd, &fileheader, sizeof(fileheader), 0) != (ssize_t)sizeof(fileheader)) ||
+                 (memcmp(&fileheader, &header, sizeof(header)) != 0)) {
+            fprintf(stderr, "'%s' is not a detection log (or has a different record layout)\n", filename.str());
+            size = 0;
+        }
+
+        if (size >= (off_t)sizeof(header)) {
+            // any partial record left at the end is overwritten
+            const uint64_t nrecords = (uint64_t)(size - sizeof(header)) / sizeof(RECORD);
+            const size_t   len      = records.size() * sizeof(RECORD);
+            std::vector<INDEXENTRY> index;
+            size_t first = 0, i;
+
+            if (ReadIndex(filename, nrecords, index)) first = (size_t)(nrecords / BlockRecords);
+
+            if (pwrite(fd, &records[0], len, sizeof(header) + (off_t)nrecords * sizeof(RECORD)) == (ssize_t)len) {
+                const uint64_t count = nrecords + records.size();
+                int ifd;
+
+                for (i = 0; i < records.size(); i++) {
+                    const uint64_t n = nrecords + i;
+                    const uint64_t t = records[i].time;
+
+                    if ((n % BlockRecords) == 0) {
+                        INDEXENTRY entry = {t, t};
+                        index.push_back(entry);
+                    }
+                    else {
+                        INDEXENTRY& entry = index[n / BlockRecords];
+                        entry.mintime = std::min(entry.mintime, t);
+                        entry.maxtime = std::max(entry.maxtime, t);
+                    }
+                }
+
+                // entries first, then the count that validates them
+                if ((ifd = open(filename + ".idx", O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) >= 0) {
+                    const size_t n = (index.size() - first) * sizeof(index[0]);
+
+                    if (pwrite(ifd, &index[first], n, sizeof(count) + first * sizeof(index[0])) == (ssize_t)n) {
+                        success = (pwrite(ifd, &count, sizeof(count), 0) == (ssize_t)sizeof(count));
+                    }
+
+                    close(ifd);
+                }
+            }
+        }
+
+        close(fd);
+    }
+
+    if (!success) fprintf(stderr, "Failed to write %u records to detection log '%s'\n", (uint_t)records.size(), filename.str());
+
+    return success;
+}
+
+bool DetectionLog::Read(const AString& filename, uint64_t from, uint64_t to, std::vector<RECORD>& records)
+{
+    HEADER header, fileheader;
+    bool   success = false;
+    int    fd;
+
+    InitHeader(header);
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) >= 0) {
+        off_t size = lseek(fd, 0, SEEK_END);
+
+        if ((size >= (off_t)sizeof(header)) &&
+            (pread(fd, &fileheader, sizeof(fileheader), 0) == (ssize_t)sizeof(fileheader)) &&
+            (memcmp(&fileheader, &header, sizeof(header)) == 0)) {
+            const uint64_t nrecords = (uint64_t)(size - sizeof(header)) / sizeof(RECORD);
+            std::vector<INDEXENTRY> index;
+            std::vector<RECORD>     block(BlockRecords);
+            size_t b;
+
+            ReadIndex(filename, nrecords, index);
+
+            success = true;
+            for (b = 0; b < index.size(); b++) {
+                if ((index[b].maxtime >= from) && (index[b].mintime <= to)) {
+                    const size_t n = (size_t)std::min(nrecords - (uint64_t)b * BlockRecords, (uint64_t)BlockRecords);
+                    size_t i;
+
+                    if (pread(fd, &block[0], n * sizeof(RECORD), sizeof(header) + (off_t)b * BlockRecords * sizeof(RECORD)) != (ssize_t)(n * sizeof(RECORD))) {
+                        success = false;
+                        break;
+                    }
+
+                    for (i = 0; i < n; i++) {
+                        if ((block[i].time >= from) && (block[i].time <= to)) records.push_back(block[i]);
+                    }
+                }
+            }
+        }
+        else fprintf(stderr, "'%s' is not a detection log (or has a different record layout)\n", filename.str());
+
+        close(fd);
+    }
+
+    return success;
+}
+
+AString DetectionLog::Format(const RECORD& record)
+{
+    AString str;
+
+    str.printf("%s %u %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le '%s' '%s'",
+               ADateTime(record.time).DateFormat("%Y-%M-%D %h:%m:%s.%S").str(),
+               record.index,
+               record.avg,
+               record.sd,
+               record.fastavg,
+               record.fastsd,
+               record.slowavg,
+               record.slowsd,
+               record.diff,
+               record.level,
+               record.rawlevel,
+               record.threshold,
+               record.logthreshold,
+               AString(record.savefilename,    strnlen(record.savefilename,    MaxFilename)).str(),
+               AString(record.savedetfilename, strnlen(record.savedetfilename, MaxFilename)).str());
+
+    return str;
+}
+
+void *DetectionLog::Run()
+{
+    uint64_t flushdt = (uint64_t)ADateTime() + interval;
+
+    while (!quitthread) {
+        uint64_t now = (uint64_t)ADateTime();
+
+        if (now >= flushdt) {
+            Flush();
+            flushdt = now + interval;
+        }
+
+        Sleep(std::min((uint32_t)(flushdt - now), (uint32_t)100));
+    }
+
+    return NULL;
+}
@@ -0,0 +1,98 @@
+#ifndef __DETECTION_LOG__
+#define __DETECTION_LOG__
+
+#include <map>
+#include <vector>
+
+#include <rdlib/strsup.h>
+#include <rdlib/Thread.h>
+#include <rdlib/ThreadLock.h>
+
+/*--------------------------------------------------------------------------------
+ * Binary detection log
+ *
+ * Fixed size records appended to '<file>' with a time index in '<file>.idx'
+ * holding the earliest and latest time of each block of records so that a
+ * ranged read only touches the blocks that can hold matches (records from
+ * different sources are not strictly in time order so the blocks may overlap)
+ *
+ * Records are queued by any thread and appended in batches by a single thread
+ *--------------------------------------------------------------------------------*/
+class DetectionLog : public AThread {
+public:
+    enum {
+        MaxFilename  = 200,
+        BlockRecords = 64,
+    };
+
+    enum {
+        Flag_NewSequence = 1,   // first detection after a gap (blank line in the text log)
+        Flag_Truncated   = 2,   // a filename was too long for the record
+    };
+
+    typedef struct {
+        uint64_t time;          // ms, as ADateTime
+        uint32_t index;
+        uint32_t flags;
+        double   avg, sd;
+        double   fastavg, fastsd;
+        double   slowavg, slowsd;
+        double   diff, level, rawlevel;
+        double   threshold, logthreshold;
+        char     savefilename[MaxFilename];
+        char     savedetfilename[MaxFilename];
+        uint8_t  reserved[8];
+    } RECORD;
+
+    static DetectionLog& Get();
+
+    void Configure(uint32_t _interval);
+
+    bool Start();
+    void Stop();
+
+    // queue record for file (written immediately if the writer is not running)
+    void Add(const AString& filename, const RECORD& record);
+
+    // write all queued records
+    void Flush();
+
+    // copy filename into a record field, returns false if it had to be truncated
+    static bool SetFilename(char *dst, const AString& src);
+
+    // records with from <= time <= to in file order, returns false if the file could not be read
+    static bool Read(const AString& filename, uint64_t from, uint64_t to, std::vector<RECORD>& records);
+
+    // record as a line of the text detection log (without newline)
+    static AString Format(const RECORD& record);
+
+protected:
+    DetectionLog();
+    virtual ~DetectionLog();
+
+    virtual void *Run();
+
+    typedef struct {
+        uint64_t mintime;
+        uint64_t maxtime;
+    } INDEXENTRY;
+
+    typedef struct {
+        char     magic[8];
+        uint32_t recordsize;
+        uint32_t blockrecords;
+    } HEADER;
+
+    static void InitHeader(HEADER& header);
+    static bool ReadIndex(const AString& filename, uint64_t nrecords, std::vector<INDEXENTRY>& index);
+    static bool Write(const AString& filename, const std::vector<RECORD>& records);
+
+protected:
+    AThreadLockObject                        tlock;
+    AThreadLockObject                        writelock;
+    std::map<AString, std::vector<RECORD> >  pending;
+    uint32_t                                 interval;
+    volatile bool                            running;
+};
+
+#endif
@@ -0,0 +1,408 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "DiffKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIFF_KERNELS_X86 1
+#include <immintrin.h>
+#else
+#define DIFF_KERNELS_X86 0
+#endif
+
+// bit positions of each component within a pixel loaded as a little-endian 32-bit word
+#define RSHIFT (8 * offsetof(AImage::PIXEL, r))
+#define GSHIFT (8 * offsetof(AImage::PIXEL, g))
+#define BSHIFT (8 * offsetof(AImage::PIXEL, b))
+
+static_assert(sizeof(AImage::PIXEL) == 4, "SIMD kernels require 32-bit pixels");
+
+// weights are 8-bit fixed point with 255 = unity, the 1/255 is applied to the final magnitude
+#define WEIGHT_SCALE (1.f / 255.f)
+
+// background model deviations are limited to this (levels) when calculating weights
+#define BACKGROUND_MINSD 0.25f
+
+/*--------------------------------------------------------------------------------
+ * Plain C versions
+ *--------------------------------------------------------------------------------*/
+static inline float Magnitude(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t x,
+                              const float scale[3], const float offset[3], const uint8_t *weight, uint_t weightstride)
+{
+    float r = ((float)((sint_t)pix1[x].r - (sint_t)pix2[x].r)) * scale[0] - offset[0];
+    float g = ((float)((sint_t)pix1[x].g - (sint_t)pix2[x].g)) * scale[1] - offset[1];
+    float b = ((float)((sint_t)pix1[x].b - (sint_t)pix2[x].b)) * scale[2] - offset[2];
+
+    if (weight) {
+        r *= (float)weight[x];
+        g *= (float)weight[x + weightstride];
+        b *= (float)weight[x + 2 * weightstride];
+
+        return sqrtf(r * r + g * g + b * b) * WEIGHT_SCALE;
+    }
+
+    return sqrtf(r * r + g * g + b * b);
+}
+static void RowSums_Scalar(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n, sint_t sums[3])
+{
+    sint_t r = 0, g = 0, b = 0;
+    uint_t x;
+
+    for (x = 0; x < n; x++) {
+        r += (sint_t)pix1[x].r - (sint_t)pix2[x].r;
+        g += (sint_t)pix1[x].g - (sint_t)pix2[x].g;
+        b += (sint_t)pix1[x].b - (sint_t)pix2[x].b;
+    }
+
+    sums[0] = r;
+    sums[1] = g;
+    sums[2] = b;
+}
+
+static void RowMagnitude_Scalar(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n,
+                                const float scale[3], const float offset[3], const uint8_t *weight, uint_t weightstride, float *dst)
+{
+    uint_t x;
+
+    for (x = 0; x < n; x++) dst[x] = Magnitude(pix1, pix2, x, scale, offset, weight, weightstride);
+}
+
+static inline uint8_t BackgroundComponent(uint_t val, uint_t shift, sint_t round, float noise,
+                                          uint16_t& mean, uint16_t& var, float base, uint8_t& weight)
+{
+    const sint_t d  = (sint_t)(val << 8) - (sint_t)mean;                // 8.8
+    const sint_t e  = d >> 4;                                           // 8.4
+    const sint_t sq = std::min((e * e) >> 4, (sint_t)0xffff);           // 12.4
+
+    // both move towards their targets without overshooting so they stay within 16 bits
+    mean   = (uint16_t)((sint_t)mean + ((d + round) >> shift));
+    var    = (uint16_t)((sint_t)var  + ((sq - (sint_t)var + round) >> shift));
+    weight = (uint8_t)lrintf(base * std::min(1.f, noise / std::max(sqrtf((float)var * (1.f / 16.f)), BACKGROUND_MINSD)));
+
+    return (uint8_t)((mean + 128) >> 8);
+}
+
+static void Background(const AImage::PIXEL *pix, uint_t x, uint_t shift, float noise,
+                       uint16_t *mean, uint16_t *var, const uint8_t *base, uint8_t *weight, uint_t stride,
+                       AImage::PIXEL *bg)
+{
+    const sint_t round = shift ? (1 << (shift - 1)) : 0;
+
+    bg[x]   = pix[x];
+    bg[x].r = BackgroundComponent(pix[x].r, shift, round, noise, mean[x],              var[x],              base ? (float)base[x]              : 255.f, weight[x]);
+    bg[x].g = BackgroundComponent(pix[x].g, shift, round, noise, mean[x + stride],     var[x + stride],     base ? (float)base[x + stride]     : 255.f, weight[x + stride]);
+    bg[x].b = BackgroundComponent(pix[x].b, shift, round, noise, mean[x + 2 * stride], var[x + 2 * stride], base ? (float)base[x + 2 * stride] : 255.f, weight[x + 2 * stride]);
+}
+
+static void RowBackground_Scalar(const AImage::PIXEL *pix, uint_t n, uint_t shift, float noise,
+                                 uint16_t *mean, uint16_t *var, const uint8_t *base, uint8_t *weight, uint_t stride,
+                                 AImage::PIXEL *bg)
+{
+    uint_t x;
+
+    for (x = 0; x < n; x++) Background(pix, x, shift, noise, mean, var, base, weight, stride, bg);
+}
+
+#if DIFF_KERNELS_X86
+/*--------------------------------------------------------------------------------
+ * SSE2 versions (4 pixels at a time)
+ *--------------------------------------------------------------------------------*/
+__attribute__((target("sse2")))
+static inline __m128 LoadWeights_SSE2(const uint8_t *weight)
+{
+    // 4 x 8-bit -> 4 x float
+    const __m128i zero = _mm_setzero_si128();
+    int32_t val;
+
+    memcpy(&val, weight, sizeof(val));
+
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(val), zero), zero));
+}
+
+__attribute__((target("sse2")))
+static void RowSums_SSE2(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n, sint_t sums[3])
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i r = _mm_setzero_si128(), g = r, b = r;
+    uint_t  x;
+
+    for (x = 0; (x + 4) <= n; x += 4) {
+        const __m128i v1 = _mm_loadu_si128((const __m128i *)(pix1 + x));
+        const __m128i v2 = _mm_loadu_si128((const __m128i *)(pix2 + x));
+
+        r = _mm_add_epi32(r, _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v1, RSHIFT), mask), _mm_and_si128(_mm_srli_epi32(v2, RSHIFT), mask)));
+        g = _mm_add_epi32(g, _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v1, GSHIFT), mask), _mm_and_si128(_mm_srli_epi32(v2, GSHIFT), mask)));
+        b = _mm_add_epi32(b, _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v1, BSHIFT), mask), _mm_and_si128(_mm_srli_epi32(v2, BSHIFT), mask)));
+    }
+
+    sint_t lanes[4], tail[3];
+
+    RowSums_Scalar(pix1 + x, pix2 + x, n - x, tail);
+
+    _mm_storeu_si128((__m128i *)lanes, r); sums[0] = lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail[0];
+    _mm_storeu_si128((__m128i *)lanes, g); sums[1] = lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail[1];
+    _mm_storeu_si128((__m128i *)lanes, b); sums[2] = lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail[2];
+}
+
+__attribute__((target("sse2")))
+static void RowMagnitude_SSE2(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n,
+                              const float scale[3], const float offset[3], const uint8_t *weight, uint_t weightstride, float *dst)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128  rs = _mm_set1_ps(scale[0]),  gs = _mm_set1_ps(scale[1]),  bs = _mm_set1_ps(scale[2]);
+    const __m128  ro = _mm_set1_ps(offset[0]), go = _mm_set1_ps(offset[1]), bo = _mm_set1_ps(offset[2]);
+    const __m128  ws = _mm_set1_ps(WEIGHT_SCALE);
+    uint_t x;
+
+    for (x = 0; (x + 4) <= n; x += 4) {
+        const __m128i v1 = _mm_loadu_si128((const __m128i *)(pix1 + x));
+        const __m128i v2 = _mm_loadu_si128((const __m128i *)(pix2 + x));
+        __m128 r = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v1, RSHIFT), mask), _mm_and_si128(_mm_srli_epi32(v2, RSHIFT), mask)));
+        __m128 g = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v1, GSHIFT), mask), _mm_and_si128(_mm_srli_epi32(v2, GSHIFT), mask)));
+        __m128 b = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(v1, BSHIFT), mask), _mm_and_si128(_mm_srli_epi32(v2, BSHIFT), mask)));
+
+        r = _mm_sub_ps(_mm_mul_ps(r, rs), ro);
+        g = _mm_sub_ps(_mm_mul_ps(g, gs), go);
+        b = _mm_sub_ps(_mm_mul_ps(b, bs), bo);
+
+        if (weight) {
+            r = _mm_mul_ps(r, LoadWeights_SSE2(weight + x));
+            g = _mm_mul_ps(g, LoadWeights_SSE2(weight + x + weightstride));
+            b = _mm_mul_ps(b, LoadWeights_SSE2(weight + x + 2 * weightstride));
+
+            _mm_storeu_ps(dst + x, _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(g, g)), _mm_mul_ps(b, b))), ws));
+        }
+        else _mm_storeu_ps(dst + x, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r, r), _mm_mul_ps(g, g)), _mm_mul_ps(b, b))));
+    }
+
+    // remaining pixels
+    for (; x < n; x++) dst[x] = Magnitude(pix1, pix2, x, scale, offset, weight, weightstride);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i BackgroundComponent_SSE2(__m128i val, __m128i shift, __m128i round, __m128 noise,
+                                               uint16_t *mean, uint16_t *var, const uint8_t *base, uint8_t *weight)
+{
+    // all arithmetic is done in 32-bit lanes, see BackgroundComponent()
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i max   = _mm_set1_epi32(0xffff);
+    const __m128i bias  = _mm_set1_epi32(0x8000);
+    __m128i m = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)mean), zero);
+    __m128i v = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)var),  zero);
+    const __m128i d  = _mm_sub_epi32(_mm_slli_epi32(val, 8), m);
+    // e fits in the low 16 bits so madd gives e * e without SSE4.1's mullo
+    const __m128i e  = _mm_and_si128(_mm_srai_epi32(d, 4), max);
+    __m128i       sq = _mm_srli_epi32(_mm_madd_epi16(e, e), 4);
+    const __m128i gt = _mm_cmpgt_epi32(sq, max);
+
+    sq = _mm_or_si128(_mm_and_si128(gt, max), _mm_andnot_si128(gt, sq));
+
+    m = _mm_add_epi32(m, _mm_sra_epi32(_mm_add_epi32(d, round), shift));
+    v = _mm_add_epi32(v, _mm_sra_epi32(_mm_add_epi32(_mm_sub_epi32(sq, v), round), shift));
+
+    // SSE2 only has a signed saturating pack so bias values into signed range and back
+    _mm_storel_epi64((__m128i *)mean, _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(m, bias), zero), _mm_set1_epi16((short)0x8000)));
+    _mm_storel_epi64((__m128i *)var,  _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(v, bias), zero), _mm_set1_epi16((short)0x8000)));
+
+    const __m128 sd = _mm_max_ps(_mm_sqrt_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.f / 16.f))), _mm_set1_ps(BACKGROUND_MINSD));
+    const __m128 wt = _mm_mul_ps(base ? LoadWeights_SSE2(base) : _mm_set1_ps(255.f), _mm_min_ps(_mm_set1_ps(1.f), _mm_div_ps(noise, sd)));
+    const int32_t w = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(_mm_cvtps_epi32(wt), zero), zero));
+
+    memcpy(weight, &w, sizeof(w));
+
+    return _mm_srli_epi32(_mm_add_epi32(m, _mm_set1_epi32(128)), 8);
+}
+
+__attribute__((target("sse2")))
+static void RowBackground_SSE2(const AImage::PIXEL *pix, uint_t n, uint_t shift, float noise,
+                               uint16_t *mean, uint16_t *var, const uint8_t *base, uint8_t *weight, uint_t stride,
+                               AImage::PIXEL *bg)
+{
+    const __m128i mask    = _mm_set1_epi32(0xff);
+    const __m128i rgbmask = _mm_set1_epi32((int)((0xffU << RSHIFT) | (0xffU << GSHIFT) | (0xffU << BSHIFT)));
+    const __m128i count   = _mm_cvtsi32_si128((int)shift);
+    const __m128i round   = _mm_set1_epi32(shift ? (1 << (shift - 1)) : 0);
+    const __m128  fnoise  = _mm_set1_ps(noise);
+    uint_t x;
+
+    for (x = 0; (x + 4) <= n; x += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(pix + x));
+        __m128i res = _mm_andnot_si128(rgbmask, v);
+
+        res = _mm_or_si128(res, _mm_slli_epi32(BackgroundComponent_SSE2(_mm_and_si128(_mm_srli_epi32(v, RSHIFT), mask), count, round, fnoise,
+                                                                        mean + x, var + x, base ? base + x : NULL, weight + x), RSHIFT));
+        res = _mm_or_si128(res, _mm_slli_epi32(BackgroundComponent_SSE2(_mm_and_si128(_mm_srli_epi32(v, GSHIFT), mask), count, round, fnoise,
+                                                                        mean + x + stride, var + x + stride, base ? base + x + stride : NULL, weight + x + stride), GSHIFT));
+        res = _mm_or_si128(res, _mm_slli_epi32(BackgroundComponent_SSE2(_mm_and_si128(_mm_srli_epi32(v, BSHIFT), mask), count, round, fnoise,
+                                                                        mean + x + 2 * stride, var + x + 2 * stride, base ? base + x + 2 * stride : NULL, weight + x + 2 * stride), BSHIFT));
+
+        _mm_storeu_si128((__m128i *)(bg + x), res);
+    }
+
+    // remaining pixels
+    for (; x < n; x++) Background(pix, x, shift, noise, mean, var, base, weight, stride, bg);
+}
+
+/*--------------------------------------------------------------------------------
+ * AVX2 versions (8 pixels at a time)
+ *--------------------------------------------------------------------------------*/
+__attribute__((target("avx2")))
+static inline __m256 LoadWeights_AVX2(const uint8_t *weight)
+{
+    // 8 x 8-bit -> 8 x float
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)weight)));
+}
+
+__attribute__((target("avx2")))
+static void RowSums_AVX2(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n, sint_t sums[3])
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    __m256i r = _mm256_setzero_si256(), g = r, b = r;
+    uint_t  x;
+
+    for (x = 0; (x + 8) <= n; x += 8) {
+        const __m256i v1 = _mm256_loadu_si256((const __m256i *)(pix1 + x));
+        const __m256i v2 = _mm256_loadu_si256((const __m256i *)(pix2 + x));
+
+        r = _mm256_add_epi32(r, _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v1, RSHIFT), mask), _mm256_and_si256(_mm256_srli_epi32(v2, RSHIFT), mask)));
+        g = _mm256_add_epi32(g, _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v1, GSHIFT), mask), _mm256_and_si256(_mm256_srli_epi32(v2, GSHIFT), mask)));
+        b = _mm256_add_epi32(b, _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v1, BSHIFT), mask), _mm256_and_si256(_mm256_srli_epi32(v2, BSHIFT), mask)));
+    }
+
+    sint_t lanes[8], tail[3];
+    uint_t i;
+
+    RowSums_Scalar(pix1 + x, pix2 + x, n - x, tail);
+
+    _mm256_storeu_si256((__m256i *)lanes, r); for (i = 0, sums[0] = tail[0]; i < 8; i++) sums[0] += lanes[i];
+    _mm256_storeu_si256((__m256i *)lanes, g); for (i = 0, sums[1] = tail[1]; i < 8; i++) sums[1] += lanes[i];
+    _mm256_storeu_si256((__m256i *)lanes, b); for (i = 0, sums[2] = tail[2]; i < 8; i++) sums[2] += lanes[i];
+}
+
+__attribute__((target("avx2")))
+static void RowMagnitude_AVX2(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n,
+                              const float scale[3], const float offset[3], const uint8_t *weight, uint_t weightstride, float *dst)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256  rs = _mm256_set1_ps(scale[0]),  gs = _mm256_set1_ps(scale[1]),  bs = _mm256_set1_ps(scale[2]);
+    const __m256  ro = _mm256_set1_ps(offset[0]), go = _mm256_set1_ps(offset[1]), bo = _mm256_set1_ps(offset[2]);
+    const __m256  ws = _mm256_set1_ps(WEIGHT_SCALE);
+    uint_t x;
+
+    for (x = 0; (x + 8) <= n; x += 8) {
+        const __m256i v1 = _mm256_loadu_si256((const __m256i *)(pix1 + x));
+        const __m256i v2 = _mm256_loadu_si256((const __m256i *)(pix2 + x));
+        __m256 r = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v1, RSHIFT), mask), _mm256_and_si256(_mm256_srli_epi32(v2, RSHIFT), mask)));
+        __m256 g = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v1, GSHIFT), mask), _mm256_and_si256(_mm256_srli_epi32(v2, GSHIFT), mask)));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v1, BSHIFT), mask), _mm256_and_si256(_mm256_srli_epi32(v2, BSHIFT), mask)));
+
+        r = _mm256_sub_ps(_mm256_mul_ps(r, rs), ro);
+        g = _mm256_sub_ps(_mm256_mul_ps(g, gs), go);
+        b = _mm256_sub_ps(_mm256_mul_ps(b, bs), bo);
+
+        if (weight) {
+            r = _mm256_mul_ps(r, LoadWeights_AVX2(weight + x));
+            g = _mm256_mul_ps(g, LoadWeights_AVX2(weight + x + weightstride));
+            b = _mm256_mul_ps(b, LoadWeights_AVX2(weight + x + 2 * weightstride));
+
+            _mm256_storeu_ps(dst + x, _mm256_mul_ps(_mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, r), _mm256_mul_ps(g, g)), _mm256_mul_ps(b, b))), ws));
+        }
+        else _mm256_storeu_ps(dst + x, _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, r), _mm256_mul_ps(g, g)), _mm256_mul_ps(b, b))));
+    }
+
+    // remaining pixels
+    for (; x < n; x++) dst[x] = Magnitude(pix1, pix2, x, scale, offset, weight, weightstride);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i BackgroundComponent_AVX2(__m256i val, __m128i shift, __m256i round, __m256 noise,
+                                               uint16_t *mean, uint16_t *var, const uint8_t *base, uint8_t *weight)
+{
+    // all arithmetic is done in 32-bit lanes, see BackgroundComponent()
+    const __m256i max = _mm256_set1_epi32(0xffff);
+    __m256i m = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)mean));
+    __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)var));
+    const __m256i d  = _mm256_sub_epi32(_mm256_slli_epi32(val, 8), m);
+    const __m256i e  = _mm256_srai_epi32(d, 4);
+    const __m256i sq = _mm256_min_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(e, e), 4), max);
+
+    m = _mm256_add_epi32(m, _mm256_sra_epi32(_mm256_add_epi32(d, round), shift));
+    v = _mm256_add_epi32(v, _mm256_sra_epi32(_mm256_add_epi32(_mm256_sub_epi32(sq, v), round), shift));
+
+    _mm_storeu_si128((__m128i *)mean, _mm_packus_epi32(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1)));
+    _mm_storeu_si128((__m128i *)var,  _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+
+    const __m256  sd = _mm256_max_ps(_mm256_sqrt_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.f / 16.f))), _mm256_set1_ps(BACKGROUND_MINSD));
+    const __m256  wt = _mm256_mul_ps(base ? LoadWeights_AVX2(base) : _mm256_set1_ps(255.f), _mm256_min_ps(_mm256_set1_ps(1.f), _mm256_div_ps(noise, sd)));
+    const __m256i wi = _mm256_cvtps_epi32(wt);
+
+    _mm_storel_epi64((__m128i *)weight, _mm_packus_epi16(_mm_packs_epi32(_mm256_castsi256_si128(wi), _mm256_extracti128_si256(wi, 1)), _mm_setzero_si128()));
+
+    return _mm256_srli_epi32(_mm256_add_epi32(m, _mm256_set1_epi32(128)), 8);
+}
+
+__attribute__((target("avx2")))
+static void RowBackground_AVX2(const AImage::PIXEL *pix, uint_t n, uint_t shift, float noise,
+                               uint16_t *mean, uint16_t *var, const uint8_t *base, uint8_t *weight, uint_t stride,
+                               AImage::PIXEL *bg)
+{
+    const __m256i mask    = _mm256_set1_epi32(0xff);
+    const __m256i rgbmask = _mm256_set1_epi32((int)((0xffU << RSHIFT) | (0xffU << GSHIFT) | (0xffU << BSHIFT)));
+    const __m128i count   = _mm_cvtsi32_si128((int)shift);
+    const __m256i round   = _mm256_set1_epi32(shift ? (1 << (shift - 1)) : 0);
+    const __m256  fnoise  = _mm256_set1_ps(noise);
+    uint_t x;
+
+    for (x = 0; (x + 8) <= n; x += 8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(pix + x));
+        __m256i res = _mm256_andnot_si256(rgbmask, v);
+
+        res = _mm256_or_si256(res, _mm256_slli_epi32(BackgroundComponent_AVX2(_mm256_and_si256(_mm256_srli_epi32(v, RSHIFT), mask), count, round, fnoise,
+                                                                              mean + x, var + x, base ? base + x : NULL, weight + x), RSHIFT));
+        res = _mm256_or_si256(res, _mm256_slli_epi32(BackgroundComponent_AVX2(_mm256_and_si256(_mm256_srli_epi32(v, GSHIFT), mask), count, round, fnoise,
+                                                                              mean + x + stride, var + x + stride, base ? base + x + stride : NULL, weight + x + stride), GSHIFT));
+        res = _mm256_or_si256(res, _mm256_slli_epi32(BackgroundComponent_AVX2(_mm256_and_si256(_mm256_srli_epi32(v, BSHIFT), mask), count, round, fnoise,
+                                                                              mean + x + 2 * stride, var + x + 2 * stride, base ? base + x + 2 * stride : NULL, weight + x + 2 * stride), BSHIFT));
+
+        _mm256_storeu_si256((__m256i *)(bg + x), res);
+    }
+
+    // remaining pixels
+    for (; x < n; x++) Background(pix, x, shift, noise, mean, var, base, weight, stride, bg);
+}
+#endif
+
+const DiffKernels& DiffKernels::Get(uint_t maxlevel)
+{
+    static const DiffKernels kernels[] = {
+        {"scalar", Level_Scalar, &RowSums_Scalar, &RowMagnitude_Scalar, &RowBackground_Scalar},
+#if DIFF_KERNELS_X86
+        {"sse2",   Level_SSE2,   &RowSums_SSE2,   &RowMagnitude_SSE2,   &RowBackground_SSE2},
+        {"avx2",   Level_AVX2,   &RowSums_AVX2,   &RowMagnitude_AVX2,   &RowBackground_AVX2},
+#endif
+    };
+    uint_t level = Level_Scalar;
+
+#if DIFF_KERNELS_X86
+    __builtin_cpu_init();
+    if      (__builtin_cpu_supports("avx2")) level = Level_AVX2;
+    else if (__builtin_cpu_supports("sse2")) level = Level_SSE2;
+#endif
+
+    return kernels[std::min(level, maxlevel)];
+}
+
+uint_t DiffKernels::ParseLevel(const AString& str)
+{
+    if      (stricmp(str, "scalar") == 0) return Level_Scalar;
+    else if (stricmp(str, "sse2")   == 0) return Level_SSE2;
+    else if (stricmp(str, "avx2")   == 0) return Level_AVX2;
+
+    return Level_Best;
+}
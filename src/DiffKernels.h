@@ -0,0 +1,55 @@
+#ifndef __DIFF_KERNELS__
+#define __DIFF_KERNELS__
+
+#include <rdlib/strsup.h>
+#include <rdlib/BMPImage.h>
+
+/*--------------------------------------------------------------------------------
+ * Low level per-row kernels used by ImageDiffer::FindDifference()
+ *
+ * All kernels work directly on packed AImage::PIXEL data and are selected at
+ * runtime from the best instruction set the CPU supports (AVX2, SSE2 or plain C)
+ *--------------------------------------------------------------------------------*/
+class DiffKernels {
+public:
+    enum {
+        Level_Scalar = 0,
+        Level_SSE2,
+        Level_AVX2,
+
+        Level_Best = ~0U,
+    };
+
+    // return kernels for the best level supported that does not exceed maxlevel
+    static const DiffKernels& Get(uint_t maxlevel = Level_Best);
+
+    // convert setting string ("auto", "avx2", "sse2" or "scalar") into a level
+    static uint_t ParseLevel(const AString& str);
+
+    const char *name;
+    uint_t     level;
+
+    // sum (pix1 - pix2) over n pixels for each of r, g and b (exact, integer)
+    void (*RowSums)(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n, sint_t sums[3]);
+
+    // for each pixel calculate:
+    //   dst[x] = sqrt(sum over c of (((pix1.c - pix2.c) * scale[c] - offset[c]) * weight[c][x] / 255) ^ 2)
+    // where weight is three planes (r, g, b) of 8-bit fixed point values (255 = unity) weightstride
+    // bytes apart or NULL for unity weight (a stride rather than n so that part of a row can be processed)
+    void (*RowMagnitude)(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t n,
+                         const float scale[3], const float offset[3], const uint8_t *weight, uint_t weightstride,
+                         float *dst);
+
+    // update a per-pixel background model with n pixels:
+    //   mean (8.8 fixed point) and var (12.4 fixed point levels^2, saturating) are three planes (r, g, b)
+    //   stride values apart, both move 1/2^shift of the way towards the new value (and its squared
+    //   deviation from the old mean) then:
+    //   bg[x]        = pix[x] with r, g and b replaced by the rounded mean
+    //   weight[c][x] = base[c][x] * min(1, noise / sqrt(var[c][x])) (base NULL for unity weight)
+    // where base and weight are planes of 8-bit fixed point values (255 = unity) the same stride apart
+    void (*RowBackground)(const AImage::PIXEL *pix, uint_t n, uint_t shift, float noise,
+                          uint16_t *mean, uint16_t *var, const uint8_t *base, uint8_t *weight, uint_t stride,
+                          AImage::PIXEL *bg);
+};
+
+#endif
@@ -0,0 +1,166 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <rdlib/DateTime.h>
+
+#include "DifferScheduler.h"
+#include "ImageDiffer.h"
+#include "Tracer.h"
+
+DifferScheduler::DifferScheduler() : running(0),
+                                     sources(0)
+{
+}
+
+DifferScheduler::~DifferScheduler()
+{
+    Stop();
+}
+
+void DifferScheduler::Add(ImageDiffer *differ)
+{
+    std::lock_guard<std::mutex> lock(tlock);
+    // the process stage waits until the capture stage has a frame for it
+    JOB capture = {(uint64_t)ADateTime(), differ, ImageDiffer::Service_Capture};
+    JOB process = {ImageDiffer::Service_Idle, differ, ImageDiffer::Service_Process};
+
+    jobs[capture.stage].push_back(capture);
+    std::push_heap(jobs[capture.stage].begin(), jobs[capture.stage].end(), &JobLater);
+    jobs[process.stage].push_back(process);
+    std::push_heap(jobs[process.stage].begin(), jobs[process.stage].end(), &JobLater);
+    running++;
+    sources++;
+
+    cond[capture.stage].notify_one();
+
+    differ->SetScheduler(this);
+}
+
+void DifferScheduler::Wake(ImageDiffer *differ, uint_t stage)
+{
+    std::lock_guard<std::mutex> lock(tlock);
+
+    WakeJob(differ, stage);
+}
+
+void DifferScheduler::WakeJob(ImageDiffer *differ, uint_t stage)
+{
+    std::vector<JOB>& heap = jobs[stage];
+    uint64_t now = (uint64_t)ADateTime();
+    size_t   i;
+
+    for (i = 0; (i < heap.size()) && (heap[i].differ != differ); i++) ;
+
+    if (i < heap.size()) {
+        if (heap[i].due > now) {
+            heap[i].due = now;
+            std::make_heap(heap.begin(), heap.end(), &JobLater);
+            cond[stage].notify_one();
+        }
+    }
+    else {
+        // job is currently being run, make it due immediately when it is re-queued
+        for (i = 0; (i < woken.size()) && ((woken[i].differ != differ) || (woken[i].stage != stage)); i++) ;
+
+        if (i == woken.size()) {
+            JOB job = {now, differ, stage};
+            woken.push_back(job);
+        }
+    }
+}
+
+bool DifferScheduler::Start(uint_t nthreads, uint_t ncapturethreads)
+{
+    if (!nthreads)        nthreads        = std::max(std::thread::hardware_concurrency(), 1U);
+    if (!ncapturethreads) ncapturethreads = std::max(sources, 1U);
+
+    uint_t n = nthreads + ncapturethreads;
+    while (workers.size() < n) {
+        // capture workers first
+        const uint_t stage = (workers.size() < ncapturethreads) ? ImageDiffer::Service_Capture : ImageDiffer::Service_Process;
+        Worker *worker;
+
+        if ((worker = new Worker(*this, stage)) == NULL) break;
+        workers.push_back(worker);
+        worker->Start();
+    }
+
+    return (workers.size() == n);
+}
+
+void DifferScheduler::Stop()
+{
+    size_t i;
+
+    for (i = 0; i < workers.size(); i++) {
+        delete workers[i];
+    }
+    workers.clear();
+}
+
+void DifferScheduler::RunNext(uint_t stage, uint32_t maxwait)
+{
+    std::vector<JOB>& heap = jobs[stage];
+    uint32_t wait = maxwait;
+    JOB      job;
+
+    {
+        std::unique_lock<std::mutex> lock(tlock);
+        uint64_t now = (uint64_t)ADateTime();
+
+        if (!heap.size() || (heap[0].due > now)) {
+            if (heap.size()) wait = std::min(wait, (uint32_t)(heap[0].due - now));
+
+            // woken early by a job becoming due
+            cond[stage].wait_for(lock, std::chrono::milliseconds(wait));
+            return;
+        }
+
+        std::pop_heap(heap.begin(), heap.end(), &JobLater);
+        job = heap.back();
+        heap.pop_back();
+    }
+
+    // run source stage outside of lock, nobody else can run it since it is not in the queue
+    uint64_t due = job.differ->Service(job.stage, job.due);
+    bool active  = job.differ->IsActive(job.stage);
+
+    std::lock_guard<std::mutex> lock(tlock);
+    size_t i;
+
+    for (i = 0; (i < woken.size()) && ((woken[i].differ != job.differ) || (woken[i].stage != job.stage)); i++) ;
+
+    if (i < woken.size()) {
+        due = std::min(due, (uint64_t)ADateTime());
+        woken.erase(woken.begin() + i);
+    }
+
+    if (active) {
+        job.due = due;
+        heap.push_back(job);
+        std::push_heap(heap.begin(), heap.end(), &JobLater);
+        cond[stage].notify_one();
+    }
+    // let the process stage finish off any frames captured
+    else if (job.stage == ImageDiffer::Service_Capture) WakeJob(job.differ, ImageDiffer::Service_Process);
+    // the process stage is always the last to finish
+    else running--;
+}
+
+void *DifferScheduler::Worker::Run()
+{
+    Tracer::Get().SetThreadName((stage == ImageDiffer::Service_Capture) ? "capture" : "worker");
+
+    while (!quitthread) {
+        // short maximum wait so that newly re-queued jobs are picked up promptly
+        scheduler.RunNext(stage, 10);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef __DIFFER_SCHEDULER__
+#define __DIFFER_SCHEDULER__
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include <rdlib/strsup.h>
+#include <rdlib/Thread.h>
+
+class ImageDiffer;
+
+/*--------------------------------------------------------------------------------
+ * Earliest-deadline-first scheduler that runs every ImageDiffer source on
+ * fixed pools of worker threads instead of one thread per source
+ *
+ * Each source has a capture job and a process job (see ImageDiffer::Service())
+ * so that capturing the next frame overlaps processing the last, each job is
+ * only ever run by one worker at a time, when it completes it is re-queued
+ * with the deadline returned by ImageDiffer::Service()
+ *
+ * Capture only fetches each frame's JPEG data but blocks on the camera (wget,
+ * HTTP fetches, pre-URLs, each for up to 'timeout') so capture jobs have their
+ * own pool (one thread per source by default, mostly asleep) and an unreachable
+ * camera only holds up its own capture, process jobs (which decode the frames
+ * and do all the other CPU work) run on a pool sized to the CPU (one per core
+ * by default)
+ *
+ * A source stops running once both of its jobs are inactive
+ *--------------------------------------------------------------------------------*/
+class DifferScheduler {
+public:
+    DifferScheduler();
+    ~DifferScheduler();
+
+    // add source to schedule (not owned by the scheduler)
+    void Add(ImageDiffer *differ);
+
+    // bring source stage's (ImageDiffer::Service_xxx) next run forward to now (e.g. when a
+    // new frame has arrived)
+    // may be called from any thread
+    void Wake(ImageDiffer *differ, uint_t stage = 0);
+
+    // start nthreads process workers (0 = one per core) and ncapturethreads
+    // capture workers (0 = one per source added so far)
+    bool Start(uint_t nthreads = 0, uint_t ncapturethreads = 0);
+    void Stop();
+
+    uint_t Threads()        const {return (uint_t)workers.size();}
+    uint_t SourcesRunning() const {return running;}
+
+protected:
+    typedef struct {
+        uint64_t    due;
+        ImageDiffer *differ;
+        uint_t      stage;
+    } JOB;
+
+    class Worker : public AThread {
+    public:
+        Worker(DifferScheduler& _scheduler, uint_t _stage) : AThread(),
+                                                             scheduler(_scheduler),
+                                                             stage(_stage) {}
+        virtual ~Worker() {Stop();}
+
+    protected:
+        virtual void *Run();
+
+    protected:
+        DifferScheduler& scheduler;
+        uint_t           stage;
+    };
+    friend class Worker;
+
+    static bool JobLater(const JOB& job1, const JOB& job2) {return (job1.due > job2.due);}
+
+    // must be called with tlock held
+    void WakeJob(ImageDiffer *differ, uint_t stage);
+
+    // run the next due job of stage, sleeping for up to maxwait ms if nothing is due
+    void RunNext(uint_t stage, uint32_t maxwait);
+
+protected:
+    std::mutex              tlock;
+    std::condition_variable cond[2];  // signalled when a job of the stage may have become due earlier
+    std::vector<JOB>      jobs[2];    // heaps ordered by earliest due time, per stage (ImageDiffer::Service_xxx)
+    std::vector<JOB>      woken;      // jobs woken whilst being run
+    std::vector<Worker *> workers;
+    std::atomic<uint_t>   running;
+    uint_t                sources;
+};
+
+#endif
@@ -0,0 +1,523 @@
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <algorithm>
+
+#include "HTTPClient.h"
+
+HTTPClient::HTTPClient() : sock(-1),
+                           connport(0),
+                           rxpos(0),
+                           rxlen(0),
+                           status(0),
+                           connections(0),
+                           aborted(false)
+{
+    rxbuf.resize(65536);
+
+    if (pipe(abortfds) == 0) {
+        fcntl(abortfds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(abortfds[1], F_SETFD, FD_CLOEXEC);
+    }
+    else abortfds[0] = abortfds[1] = -1;
+}
+
+HTTPClient::~HTTPClient()
+{
+    Close();
+
+    if (abortfds[0] >= 0) close(abortfds[0]);
+    if (abortfds[1] >= 0) close(abortfds[1]);
+}
+
+void HTTPClient::Close()
+{
+    if (sock >= 0) {
+        close(sock);
+        sock = -1;
+    }
+
+    connhost = "";
+    connport = 0;
+    rxpos = rxlen = 0;
+}
+
+void HTTPClient::Abort()
+{
+    // the owning thread may be closing or reconnecting the socket so wake it through
+    // the pipe, which is never drained so every later wait fails immediately too
+    if (!aborted.exchange(true) && (abortfds[1] >= 0)) {
+        if (write(abortfds[1], "", 1) < 0) {}
+    }
+}
+
+bool HTTPClient::Wait(int fd, short events, uint64_t deadline)
+{
+    struct pollfd pfds[2] = {{fd, events, 0}, {abortfds[0], POLLIN, 0}};
+    uint64_t now = GetMonotonicTime();
+
+    return (!aborted && (now < deadline) &&
+            (poll(pfds, (abortfds[0] >= 0) ? 2 : 1, (int)(deadline - now)) > 0) &&
+            !pfds[1].revents);
+}
+
+void HTTPClient::SetError(const char *fmt, ...)
+{
+    va_list ap;
+
+    error = "";
+
+    va_start(ap, fmt);
+    error.vprintf(fmt, ap);
+    va_end(ap);
+}
+
+uint64_t HTTPClient::GetMonotonicTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+bool HTTPClient::IsSupported(const AString& url)
+{
+    return (url.PosNoCase("http://") == 0);
+}
+
+bool HTTPClient::ParseURL(const AString& url, URL& parts)
+{
+    static const char *base64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    if (!IsSupported(url)) return false;
+
+    AString rest = url.Mid(7);
+    AString hostpart;
+    int p;
+
+    if ((p = rest.Pos("/")) >= 0) {
+        hostpart   = rest.Left(p);
+        parts.path = rest.Mid(p);
+    }
+    else {
+        hostpart   = rest;
+        parts.path = "/";
+    }
+
+    // user:password@ -> basic authentication
+    parts.auth = "";
+    if ((p = hostpart.Pos("@")) >= 0) {
+        AString        userpass = hostpart.Left(p);
+        const uint8_t  *src     = (const uint8_t *)userpass.str();
+        uint_t         i, n     = userpass.len();
+
+        for (i = 0; i < n; i += 3) {
+            uint32_t val = (uint32_t)src[i] << 16;
+            if ((i + 1) < n) val |= (uint32_t)src[i + 1] << 8;
+            if ((i + 2) < n) val |= (uint32_t)src[i + 2];
+
+            parts.auth += base64[(val >> 18) & 63];
+            parts.auth += base64[(val >> 12) & 63];
+            parts.auth += ((i + 1) < n) ? base64[(val >> 6) & 63] : '=';
+            parts.auth += ((i + 2) < n) ? base64[val & 63]        : '=';
+        }
+
+        hostpart = hostpart.Mid(p + 1);
+    }
+
+    if ((p = hostpart.Pos(":")) >= 0) {
+        parts.host = hostpart.Left(p);
+        parts.port = (uint_t)hostpart.Mid(p + 1);
+    }
+    else {
+        parts.host = hostpart;
+        parts.port = 80;
+    }
+
+    return (parts.host.Valid() && parts.port);
+}
+
+bool HTTPClient::Connect(const URL& url, uint64_t deadline)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    AString portstr = AString("%").Arg(url.port);
+    int     err;
+
+    Close();
+
+    if (aborted) {
+        SetError("Aborted");
+        return false;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((err = getaddrinfo(url.host, portstr, &hints, &res)) != 0) {
+        SetError("Failed to resolve '%s': %s", url.host.str(), gai_strerror(err));
+        return false;
+    }
+
+    for (ai = res; ai && (sock < 0); ai = ai->ai_next) {
+        int s;
+
+        if ((s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) continue;
+
+        // non-blocking so that every operation can be bounded by the deadline
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+
+        if ((connect(s, ai->ai_addr, ai->ai_addrlen) == 0) || (errno == EINPROGRESS)) {
+            int       soerr = 0;
+            socklen_t len   = sizeof(soerr);
+
+            if (Wait(s, POLLOUT, deadline) &&
+                (getsockopt(s, SOL_SOCKET, SO_ERROR, &soerr, &len) == 0) &&
+                (soerr == 0)) {
+                int one = 1;
+
+                setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                sock = s;
+                break;
+            }
+        }
+
+        close(s);
+    }
+
+    freeaddrinfo(res);
+
+    if (sock < 0) {
+        SetError("Failed to connect to '%s:%u'", url.host.str(), url.port);
+        return false;
+    }
+
+    connhost = url.host;
+    connport = url.port;
+    connections++;
+
+    return true;
+}
+
+bool HTTPClient::Send(const AString& str, uint64_t deadline)
+{
+    const char *p = str.str();
+    size_t     n  = str.len();
+
+    while (n) {
+        ssize_t res;
+
+        if (!Wait(sock, POLLOUT, deadline)) {
+            SetError(aborted ? "Aborted" : "Timeout sending request");
+            return false;
+        }
+
+        if ((res = send(sock, p, n, MSG_NOSIGNAL)) < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR)) continue;
+
+            SetError("Failed to send request: %s", strerror(errno));
+            return false;
+        }
+
+        p += res;
+        n -= res;
+    }
+
+    return true;
+}
+
+bool HTTPClient::Fill(uint64_t deadline, bool *closed)
+{
+    // move any unread data to the start of the buffer
+    if (rxpos) {
+        memmove(&rxbuf[0], &rxbuf[rxpos], rxlen - rxpos);
+        rxlen -= rxpos;
+        rxpos  = 0;
+    }
+
+    while (true) {
+        ssize_t res;
+
+        if (!Wait(sock, POLLIN, deadline)) {
+            SetError(aborted ? "Aborted" : "Timeout waiting for response");
+            return false;
+        }
+
+        if ((res = recv(sock, &rxbuf[rxlen], rxbuf.size() - rxlen, 0)) > 0) {
+            rxlen += res;
+            return true;
+        }
+        else if ((res < 0) && ((errno == EAGAIN) || (errno == EINTR))) continue;
+
+        if (closed) *closed = (res == 0);
+
+        if (res == 0) SetError("Connection closed");
+        else          SetError("Failed to receive response: %s", strerror(errno));
+        return false;
+    }
+}
+
+bool HTTPClient::ReadLine(AString& line, uint64_t deadline)
+{
+    while (true) {
+        const uint8_t *start = &rxbuf[rxpos];
+        const uint8_t *end   = (const uint8_t *)memchr(start, '\n', rxlen - rxpos);
+
+        if (end) {
+            size_t len = end - start;
+
+            if (len && (start[len - 1] == '\r')) len--;
+
+            line   = AString((const char *)start, (sint_t)len);
+            rxpos += (end - start) + 1;
+
+            return true;
+        }
+
+        if ((rxpos == 0) && (rxlen == rxbuf.size())) {
+            SetError("Header line too long");
+            return false;
+        }
+
+        if (!Fill(deadline)) return false;
+    }
+}
+
+bool HTTPClient::ReadBody(std::vector<uint8_t>& body, size_t n, uint64_t deadline)
+{
+    size_t pos = body.size();
+
+    body.resize(pos + n);
+
+    while (n) {
+        size_t avail = std::min(rxlen - rxpos, n);
+
+        if (avail) {
+            memcpy(&body[pos], &rxbuf[rxpos], avail);
+            rxpos += avail;
+            pos   += avail;
+            n     -= avail;
+        }
+        else if (!Fill(deadline)) return false;
+    }
+
+    return true;
+}
+
+bool HTTPClient::ReadChunkedBody(std::vector<uint8_t>& body, uint64_t deadline)
+{
+    AString line;
+
+    while (ReadLine(line, deadline)) {
+        size_t n = (size_t)strtoul(line.str(), NULL, 16);
+
+        if (!n) {
+            // skip trailers
+            while (ReadLine(line, deadline) && line.Valid()) ;
+            return line.Empty();
+        }
+
+        if (!ReadBody(body, n, deadline) || !ReadLine(line, deadline)) break;
+    }
+
+    return false;
+}
+
+bool HTTPClient::SendRequest(const URL& url, uint64_t deadline)
+{
+    AString req;
+
+    req.printf("GET %s HTTP/1.1\r\n", url.path.str());
+    if (url.port == 80) req.printf("Host: %s\r\n", url.host.str());
+    else                req.printf("Host: %s:%u\r\n", url.host.str(), url.port);
+    req.printf("User-Agent: imagediff\r\n");
+    req.printf("Connection: keep-alive\r\n");
+    if (url.auth.Valid()) req.printf("Authorization: Basic %s\r\n", url.auth.str());
+    req.printf("\r\n");
+
+    return Send(req, deadline);
+}
+
+bool HTTPClient::ReadResponseHeaders(RESPONSE& response, uint64_t deadline)
+{
+    AString line;
+
+    response.status        = 0;
+    response.contentlength = -1;
+    response.chunked       = false;
+    response.keepalive     = true;
+    response.contenttype   = "";
+
+    if (!ReadLine(line, deadline)) return false;
+
+    // status line: HTTP/1.x <status> <reason>
+    if (line.PosNoCase("HTTP/") != 0) {
+        SetError("Invalid response '%s'", line.str());
+        return false;
+    }
+    response.status    = (uint_t)line.Word(1);
+    response.keepalive = (line.PosNoCase("HTTP/1.0") != 0);
+
+    // headers
+    while (true) {
+        if (!ReadLine(line, deadline)) return false;
+        if (line.Empty()) break;
+
+        int p = line.Pos(":");
+        if (p < 0) continue;
+
+        AString name  = line.Left(p);
+        AString value = line.Mid(p + 1).Words(0);
+
+        if      (stricmp(name, "Content-Length") == 0)    response.contentlength = (sint_t)(uint_t)value;
+        else if (stricmp(name, "Content-Type") == 0)      response.contenttype   = value;
+        else if (stricmp(name, "Transfer-Encoding") == 0) response.chunked       = (value.PosNoCase("chunked") >= 0);
+        else if (stricmp(name, "Connection") == 0) {
+            if      (value.PosNoCase("close")      >= 0) response.keepalive = false;
+            else if (value.PosNoCase("keep-alive") >= 0) response.keepalive = true;
+        }
+    }
+
+    return true;
+}
+
+bool HTTPClient::Request(const URL& url, std::vector<uint8_t>& body, uint64_t deadline, bool& responded)
+{
+    RESPONSE response;
+    bool     closed = false, success;
+
+    responded = false;
+
+    // discard anything left over from a previous response
+    rxpos = rxlen = 0;
+
+    // wait for the first data of the response before parsing so that a connection
+    // that has been closed whilst idle can be detected (and retried)
+    if (!SendRequest(url, deadline) || !Fill(deadline)) {
+        Close();
+        return false;
+    }
+
+    responded = true;
+
+    if (!ReadResponseHeaders(response, deadline)) {
+        Close();
+        return false;
+    }
+
+    status = response.status;
+
+    body.resize(0);
+    if      (response.chunked)            success = ReadChunkedBody(body, deadline);
+    else if (response.contentlength >= 0) success = ReadBody(body, response.contentlength, deadline);
+    else {
+        // no length: body is terminated by the connection closing
+        response.keepalive = false;
+        while (true) {
+            if (rxpos < rxlen) {
+                body.insert(body.end(), rxbuf.begin() + rxpos, rxbuf.begin() + rxlen);
+                rxpos = rxlen;
+            }
+            if (!Fill(deadline, &closed)) break;
+        }
+        success = closed;
+    }
+
+    if (!success || !response.keepalive) Close();
+
+    if (success && (response.status != 200)) {
+        SetError("HTTP status %u", response.status);
+        success = false;
+    }
+
+    return success;
+}
+
+bool HTTPClient::Get(const AString& url, std::vector<uint8_t>& body, uint32_t timeout)
+{
+    const uint64_t deadline = GetMonotonicTime() + timeout;
+    URL  parts;
+    bool responded, success = false;
+
+    error  = "";
+    status = 0;
+    body.resize(0);
+
+    if (!ParseURL(url, parts)) {
+        SetError("Unsupported URL '%s'", url.str());
+        return false;
+    }
+
+    if ((sock >= 0) && (parts.host == connhost) && (parts.port == connport)) {
+        // re-use existing connection, if the server closed it while idle, reconnect and try again
+        if (!(success = Request(parts, body, deadline, responded)) && !responded && (GetMonotonicTime() < deadline)) {
+            success = (Connect(parts, deadline) && Request(parts, body, deadline, responded));
+        }
+    }
+    else success = (Connect(parts, deadline) && Request(parts, body, deadline, responded));
+
+    if (success) error = "";
+
+    return success;
+}
+
+bool HTTPClient::OpenStream(const AString& url, uint32_t timeout, AString& contenttype)
+{
+    const uint64_t deadline = GetMonotonicTime() + timeout;
+    RESPONSE response;
+    URL      parts;
+
+    error = "";
+
+    if (!ParseURL(url, parts)) {
+        SetError("Unsupported URL '%s'", url.str());
+        return false;
+    }
+
+    // always use a fresh connection since it will never be re-used
+    if (!Connect(parts, deadline) || !SendRequest(parts, deadline) || !ReadResponseHeaders(response, deadline)) {
+        Close();
+        return false;
+    }
+
+    if (response.status != 200) {
+        SetError("HTTP status %u", response.status);
+        Close();
+        return false;
+    }
+
+    if (response.chunked) {
+        SetError("Chunked streams not supported");
+        Close();
+        return false;
+    }
+
+    contenttype = response.contenttype;
+
+    return true;
+}
+
+bool HTTPClient::ReadStreamLine(AString& line, uint32_t timeout)
+{
+    return ((sock >= 0) && ReadLine(line, GetMonotonicTime() + timeout));
+}
+
+bool HTTPClient::ReadStreamData(std::vector<uint8_t>& data, size_t n, uint32_t timeout)
+{
+    return ((sock >= 0) && ReadBody(data, n, GetMonotonicTime() + timeout));
+}
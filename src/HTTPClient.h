@@ -0,0 +1,95 @@
+#ifndef __HTTP_CLIENT__
+#define __HTTP_CLIENT__
+
+#include <vector>
+#include <atomic>
+
+#include <rdlib/strsup.h>
+
+/*--------------------------------------------------------------------------------
+ * Minimal blocking HTTP/1.1 client for fetching camera snapshots
+ *
+ * The connection is kept open (keep-alive) between requests to the same host
+ * so that fetching a frame does not need a fork, DNS lookup or TCP handshake
+ *
+ * Only plain http:// URLs are supported (optionally with user:password@ for
+ * basic authentication), use IsSupported() to check a URL
+ *--------------------------------------------------------------------------------*/
+class HTTPClient {
+public:
+    HTTPClient();
+    ~HTTPClient();
+
+    static bool IsSupported(const AString& url);
+
+    // fetch url into body (body capacity is kept between calls)
+    // timeout is for the entire request in ms
+    bool Get(const AString& url, std::vector<uint8_t>& body, uint32_t timeout);
+
+    // open url and read the response headers, the body can then be read incrementally
+    // using ReadStreamLine() and ReadStreamData() (e.g. for multipart MJPEG streams)
+    // timeouts are the maximum time to wait for the operation in ms
+    bool OpenStream(const AString& url, uint32_t timeout, AString& contenttype);
+    bool ReadStreamLine(AString& line, uint32_t timeout);
+    // append n bytes of body to data
+    bool ReadStreamData(std::vector<uint8_t>& data, size_t n, uint32_t timeout);
+
+    void Close();
+
+    // wake up any blocking operation on another thread, it and all later operations fail
+    // (safe to call from any thread, the socket itself is never touched)
+    void Abort();
+
+    const AString& GetError()       const {return error;}
+    // status of the last response (0 if none was received)
+    uint_t         GetStatus()      const {return status;}
+    uint_t         GetConnections() const {return connections;}
+
+protected:
+    typedef struct {
+        AString host;
+        uint_t  port;
+        AString path;
+        AString auth;
+    } URL;
+
+    typedef struct {
+        uint_t  status;
+        sint_t  contentlength;      // -1 if not specified
+        bool    chunked;
+        bool    keepalive;
+        AString contenttype;
+    } RESPONSE;
+
+    static bool     ParseURL(const AString& url, URL& parts);
+    static uint64_t GetMonotonicTime();
+
+    void SetError(const char *fmt, ...);
+
+    // wait for events on fd until deadline, fails on timeout or Abort()
+    bool Wait(int fd, short events, uint64_t deadline);
+
+    bool Connect(const URL& url, uint64_t deadline);
+    bool SendRequest(const URL& url, uint64_t deadline);
+    bool ReadResponseHeaders(RESPONSE& response, uint64_t deadline);
+    bool Request(const URL& url, std::vector<uint8_t>& body, uint64_t deadline, bool& responded);
+    bool Send(const AString& str, uint64_t deadline);
+    bool Fill(uint64_t deadline, bool *closed = NULL);
+    bool ReadLine(AString& line, uint64_t deadline);
+    bool ReadBody(std::vector<uint8_t>& body, size_t n, uint64_t deadline);
+    bool ReadChunkedBody(std::vector<uint8_t>& body, uint64_t deadline);
+
+protected:
+    int                  sock;
+    AString              connhost;
+    uint_t               connport;
+    std::vector<uint8_t> rxbuf;
+    size_t               rxpos, rxlen;
+    AString              error;
+    uint_t               status;
+    uint_t               connections;
+    int                  abortfds[2];       // self-pipe, readable once aborted
+    std::atomic<bool>    aborted;
+};
+
+#endif
@@ -3,47 +3,100 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 
 #include <algorithm>
+#include <thread>
 
 #include <rdlib/Recurse.h>
-#include <rdlib/jpeginfo.h>
 
 #include "ImageDiffer.h"
+#include "DifferScheduler.h"
+#include "DetectionLog.h"
+#include "Tracer.h"
 
-uint_t ImageDiffer::settingschangecount = 0;
-uint_t ImageDiffer::differsrunning = 0;
+std::atomic<uint_t> ImageDiffer::settingschangecount(0);
+bool   ImageDiffer::settingswatched     = false;
 
-ImageDiffer::ImageDiffer(uint_t _index) :
-    AThread(),
+ImageDiffer::ImageDiffer(uint_t _index, bool _replay) :
     index(_index),
+    replay(_replay),
+    stream(NULL),
+    scheduler(NULL),
+    maskwid(0),
+    maskhgt(0),
+    maskarea(0),
+    maskpartial(false),
+    levelsbyactivearea(false),
+    bgframes(0),
+    bgactive(false),
     settingschange(settingschangecount),
     verbose(0),
     imagenumber(0),
     savedimagenumber(0),
     seqno(0),
-    lastdetectionlogged(false)
+    maxlag(0),
+    lagtotal(0),
+    lagcount(0),
+    lagreportdt((uint64_t)ADateTime()),
+    lastdetectionlogged(false),
+    detlogtext(true),
+    detlogbinary(false),
+    benchtimes(NULL)
 {
+    coarseframes = fullframes = 0;
+    prescreenskipped = 0;
+    prescreensaved   = decodetime = 0.0;
+    prescreenbw      = prescreenbh = 0;
+    poolsize         = 0;
+    capturecapacity  = 0;
+    frameallocs      = 0;
+    pipeline         = 0;
+    capturewaiting   = false;
+    processing       = false;
+    captureactive    = true;
+    indetection      = false;
+    frameinterval    = 0.0;
+
     imglist.SetDestructor(&__DeleteImage);
 
-    GetStat("fastavg", fastavg);
-    GetStat("fastsd", fastsd);
-    GetStat("slowavg", slowavg);
-    GetStat("slowsd", slowsd);
+    // a replay must not overwrite the live source's stats
+    if (!replay) {
+        StatsFlusher::Get().Register(&statsblock, index);
+
+        GetStat("fastavg", fastavg);
+        GetStat("fastsd", fastsd);
+        GetStat("slowavg", slowavg);
+        GetStat("slowsd", slowsd);
+    }
 
     Configure();
 
     Log(0, "New differ");
-
-    differsrunning++;
 }
 
 ImageDiffer::~ImageDiffer()
 {
-    Log(0, "Shutting down");
-    remove(tempfile);
+    if (stream) delete stream;
+
+    // wait for any queued saves for this differ
+    ImageWriter::Get().Flush(this);
+
+    if (!replay) StatsFlusher::Get().Unregister(&statsblock);
+
+    // images return to the pool as they are released
+    while (captured.size()) {
+        ReleaseImage(captured.front());
+        captured.pop_front();
+    }
+    imglist.DeleteList();
+
+    size_t i;
+    for (i = 0; i < imagepool.size(); i++) delete imagepool[i];
+    imagepool.clear();
 
-    Stop();
+    Log(0, "Shutting down");
+    if (!replay) remove(tempfile);
 }
 
 void ImageDiffer::Log(uint_t level, const char *fmt, ...)
@@ -58,25 +111,43 @@ void ImageDiffer::Log(uint_t level, const char *fmt, ...)
 
 void ImageDiffer::Log(uint_t level, const char *fmt, va_list ap)
 {
-    static AThreadLockObject loglock;
+    if (!replay) LogTo(GetLogTarget(), level, fmt, ap);
+}
+
+ImageDiffer::LOGTARGET ImageDiffer::GetLogTarget() const
+{
+    LOGTARGET target;
+
+    target.logpath  = logpath;
+    target.index    = index;
+    target.verbose  = verbose;
+    target.verbose2 = verbose2;
+
+    return target;
+}
+
+void ImageDiffer::LogTo(const LOGTARGET& target, uint_t level, const char *fmt, ...)
+{
+    if ((target.verbose >= level) || (target.verbose2 > level)) {
+        va_list ap;
+        va_start(ap, fmt);
+        LogTo(target, level, fmt, ap);
+        va_end(ap);
+    }
+}
+
+void ImageDiffer::LogTo(const LOGTARGET& target, uint_t level, const char *fmt, va_list ap)
+{
     ADateTime dt;
     AString   str;
-    AString   filename = logpath.CatPath(AString("imagediff-%;.txt").Arg(dt.DateFormat("%Y-%M-%D").str()));
-    AStdFile  fp;
 
-    str.printf("%s[%u]: ", dt.DateFormat("%Y-%M-%D %h:%m:%s").str(), index);
+    str.printf("%s[%u]: ", dt.DateFormat("%Y-%M-%D %h:%m:%s").str(), target.index);
     str.vprintf(fmt, ap);
 
-    if (verbose >= level) {
-        AThreadLock lock(loglock);
-        CreateDirectory(filename.PathPart());
-        if (fp.open(filename, "a")) {
-            fp.printf("%s\n", str.str());
-            fp.close();
-        }
-    }
+    // written (to the file for the date at the start of the line) by the background log writer
+    if (target.verbose >= level) LogWriter::Get().Add(target.logpath, str);
 
-    if (verbose2 > level) {
+    if (target.verbose2 > level) {
         printf("%s\n", str.str());
     }
 }
@@ -87,97 +158,113 @@ ImageDiffer::ProtectedSettings& ImageDiffer::GetSettings()
     return _settings;
 }
 
-bool ImageDiffer::SettingExists(const AString& name) const
+SettingsSnapshot::PTR ImageDiffer::GetSnapshot()
 {
-    ProtectedSettings& _settings = GetSettings();
-    AThreadLock        lock(_settings);
-    ASettingsHandler&  settings = _settings.GetSettings();
-    AString            suffix   = AString(":%").Arg(index);
-    return (settings.Exists(name + suffix) || settings.Exists(name));
+    SettingsSnapshot::PTR snapshot = SettingsSnapshot::GetCurrent();
+
+    if (!snapshot) {
+        ProtectedSettings& _settings = GetSettings();
+        AThreadLock        lock(_settings);
+
+        // another thread may have got here first
+        if (!(snapshot = SettingsSnapshot::GetCurrent())) {
+            snapshot.reset(new SettingsSnapshot(_settings.GetSettings(), settingschangecount));
+            SettingsSnapshot::Publish(snapshot);
+        }
+    }
+
+    return snapshot;
 }
 
-AString ImageDiffer::GetSetting(const AString& name, const AString& defval) const
+void ImageDiffer::ReloadSettings()
 {
+    // one read and parse of the settings file for all sources, which pick up
+    // the new snapshot when they reconfigure
     ProtectedSettings& _settings = GetSettings();
     AThreadLock        lock(_settings);
     ASettingsHandler&  settings = _settings.GetSettings();
-    AString            suffix   = AString(":%").Arg(index);
-    AString            str      = settings.Get(name + suffix, settings.Get(name, defval));
-    int p = 0, p1, p2;
 
-    while (((p1 = str.Pos("{", p)) >= 0) && ((p2 = str.Pos("}", p1 + 1)) >= 0)) {
-        AString str1 = str.Left(p1);
-        AString str2 = str.Mid(p1 + 1, p2 - p1 - 1);
-        AString str3 = str.Mid(p2 + 1);
+    // sources poll the count without the lock, so publish the snapshot before bumping it
+    const uint_t generation = settingschangecount + 1;
 
-        if (SettingExists(str2)) {
-            str  = str1 + GetSetting(str2);
-            p    = str.len();
-            str += str3;
-        }
-        else p = p2 + 1;
-    }
+    settings.Read();
+    SettingsSnapshot::Publish(SettingsSnapshot::PTR(new SettingsSnapshot(settings, generation)));
+    settingschangecount = generation;
+}
 
-    return str;
+void ImageDiffer::__SettingsChanged(void *context)
+{
+    UNUSED(context);
+    ReloadSettings();
 }
 
-void ImageDiffer::CheckSettingsUpdate()
+bool ImageDiffer::WatchSettings(bool enable)
 {
-    if (index == 1) {
-        ProtectedSettings& _settings = GetSettings();
-        AThreadLock        lock(_settings);
-        ASettingsHandler&  settings = _settings.GetSettings();
-        if (settings.HasFileChanged()) {
-            settings.Read();
-            settingschangecount++;
+    static SettingsWatcher *watcher = NULL;
+
+    if (enable && !watcher) {
+        watcher = new SettingsWatcher(GetSnapshot()->GetFilename(), &__SettingsChanged);
+        if (!watcher->Start()) {
+            delete watcher;
+            watcher = NULL;
         }
     }
+    else if (!enable && watcher) {
+        delete watcher;
+        watcher = NULL;
+    }
+
+    settingswatched = (watcher != NULL);
+
+    return settingswatched;
 }
 
-AString ImageDiffer::GetGlobalSetting(const AString& name, const AString& defval)
+bool ImageDiffer::SettingExists(const AString& name) const
 {
-    ProtectedSettings& _settings = GetSettings();
-    AThreadLock        lock(_settings);
-    ASettingsHandler&  settings = _settings.GetSettings();
-
-    return settings.Get(name, defval);
+    return sourcesettings->Exists(name);
 }
 
-ImageDiffer::ProtectedSettings& ImageDiffer::GetStats()
+AString ImageDiffer::GetSetting(const AString& name, const AString& defval) const
 {
-    static ProtectedSettings _stats("imagediff-stats", true, 5000);
-    _stats.GetSettings().CheckWrite();
-    return _stats;
+    return sourcesettings->Get(name, defval);
 }
 
-AString ImageDiffer::GetStat(const AString& name)
+void ImageDiffer::CheckSettingsUpdate()
 {
-    ProtectedSettings& _stats = GetStats();
-    AThreadLock        lock(_stats);
-    ASettingsHandler&  stats  = _stats.GetSettings();
-    AString            suffix = AString(":%").Arg(index);
+    // polling is only needed if the settings file cannot be watched
+    if ((index == 1) && !settingswatched) {
+        bool changed;
 
-    return stats.Get(name + suffix);
+        {
+            ProtectedSettings& _settings = GetSettings();
+            AThreadLock        lock(_settings);
+
+            changed = _settings.GetSettings().HasFileChanged();
+        }
+
+        if (changed) ReloadSettings();
+    }
 }
 
-void ImageDiffer::SetStat(const AString& name, double val)
+AString ImageDiffer::GetGlobalSetting(const AString& name, const AString& defval)
 {
-    ProtectedSettings& _stats = GetStats();
-    AThreadLock        lock(_stats);
-    ASettingsHandler&  stats  = _stats.GetSettings();
-    AString            suffix = AString(":%").Arg(index);
+    return GetSnapshot()->GetValue(name, defval);
+}
 
-    stats.Set(name + suffix, AString("%0.16e").Arg(val));
+AString ImageDiffer::GetStat(const AString& name)
+{
+    return StatsFlusher::Get().GetStat(name + AString(":%").Arg(index));
 }
 
-void ImageDiffer::SetStat(const AString& name, uint_t val)
+void ImageDiffer::SetStat(uint_t stat, double val)
 {
-    ProtectedSettings& _stats = GetStats();
-    AThreadLock        lock(_stats);
-    ASettingsHandler&  stats  = _stats.GetSettings();
-    AString            suffix = AString(":%").Arg(index);
+    // lock-free, written to the stats file by the flusher
+    statsblock.Set(stat, val);
+}
 
-    stats.Set(name + suffix, AString("%").Arg(val));
+void ImageDiffer::SetGlobalStat(const AString& name, uint_t val)
+{
+    StatsFlusher::Get().SetStat(name, AString("%").Arg(val));
 }
 
 AString ImageDiffer::CreateWGetCommand(const AString& url)
@@ -213,7 +300,7 @@ AString ImageDiffer::FindFile(const AString& filename) const
 
     AString dirs = GetSetting("filedirs", "");
     if (dirs.Valid()) dirs += ";";
-    dirs += GetSettings().GetSettings().GetFilename().PathPart();
+    dirs += snapshot->GetFilename().PathPart();
 
     uint_t i, n = dirs.CountLines(";");
     for (i = 0; i < n; i++) {
@@ -232,6 +319,11 @@ AString ImageDiffer::FindFile(const AString& filename) const
 
 void ImageDiffer::Configure()
 {
+    // all settings for this configuration come from the latest snapshot, resolved
+    // for this source once
+    snapshot       = GetSnapshot();
+    sourcesettings = snapshot->Resolve(index);
+
     AString indexstr = AString("%").Arg(index);
     verbose       = (uint_t)GetSetting("verbose",      "0");
     verbose2      = (uint_t)GetSetting("verbose2",     "0");
@@ -239,9 +331,25 @@ void ImageDiffer::Configure()
 
     logpath       = GetSetting("loglocation", "/var/log/imagediff");
     name          = GetSetting("name");
-    delay         = (uint_t)(1000.0 * (double)GetSetting("delay", "1"));
+    AString delaystr = GetSetting("delay", "1");
+    delay         = (uint_t)(1000.0 * (double)delaystr);
+
+    // with an adaptive capture interval (maxdelay > mindelay) the interval drops to mindelay
+    // on a detection, halves whilst recent levels are within speedupmargin of threshold and
+    // lengthens towards maxdelay once they are all more than slowdownmargin below it
+    // (margins relative to threshold, in between the interval is left alone)
+    mindelay       = (uint_t)(1000.0 * (double)GetSetting("mindelay", delaystr));
+    maxdelay       = (uint_t)(1000.0 * (double)GetSetting("maxdelay", delaystr));
+    speedupmargin  = (double)GetSetting("speedupmargin",  "0.5");
+    slowdownmargin = (double)GetSetting("slowdownmargin", "0.75");
+    if (maxdelay > mindelay) delay = std::min(std::max((uint_t)delay, mindelay), maxdelay);
+
     wgetargs      = GetSetting("wgetargs");
     cameraurl     = GetSetting("cameraurl");
+    // wget is the default, the built-in HTTP client (http:// URLs only) must be asked for since it
+    // only does basic authentication and does not follow redirects
+    usehttpclient = (HTTPClient::IsSupported(cameraurl) && ((uint_t)GetSetting("httpclient", "0") != 0));
+    streamurl     = GetSetting("streamurl");
     videosrc      = GetSetting("videosrc");
     streamerargs  = GetSetting("streamerargs", "-s 640x480");
     capturecmd    = GetSetting("capturecmd").DeEscapify();
@@ -271,11 +379,17 @@ void ImageDiffer::Configure()
     detstartcmd   = GetSetting("detstartcommand").SearchAndReplace("{index}", indexstr);
     detendcmd     = GetSetting("detendcommand").SearchAndReplace("{index}", indexstr);
     nodetcmd      = GetSetting("nodetcommand").SearchAndReplace("{index}", indexstr);
+    cmdtimeout    = (uint32_t)(1000.0 * (double)GetSetting("commandtimeout", "60"));
     logdetections = ((uint_t)GetSetting("logdetections", "0") != 0);
 
+    // detection log as text, binary ('<detlogfilename>.bin', see detlog) or both
+    AString detlogformat = GetSetting("detlogformat", "text");
+    detlogtext    = ((detlogformat == "text")   || (detlogformat == "both"));
+    detlogbinary  = ((detlogformat == "binary") || (detlogformat == "both"));
+
     sourceimagelist.DeleteAll();
     AString imgdir = GetSetting("imagesourcedir");
-    if (imgdir.Valid()) {
+    if (imgdir.Valid() && !replay) {
         extern AQuitHandler quithandler;
 
         Log(0, "Finding files in '%s'...", imgdir.str());
@@ -283,6 +397,7 @@ void ImageDiffer::Configure()
         Log(0, "Found %u files in '%s'", sourceimagelist.Count(), imgdir.str());
     }
     readingfromimagelist = (sourceimagelist.Count() > 0);
+    captureactive        = true;
 
     fastattcoeff  = (double)GetSetting("fastattcoeff",    "1.0e-1");
     fastdeccoeff  = (double)GetSetting("fastdeccoeff",    "1.5e-1");
@@ -296,17 +411,90 @@ void ImageDiffer::Configure()
     diffgain      = (double)GetSetting("diffmul",         "1.0") / (double)GetSetting("diffdiv", "1.0");
     diffthreshold = (double)GetSetting("diffthreshold",   ".25");
     threshold     = (double)GetSetting("threshold",       "3000.0");
+    // levels are normally relative to the whole frame (masked pixels count as no difference),
+    // optionally to the unmasked area only which raises them for masked sources
+    levelsbyactivearea = ((uint_t)GetSetting("levelsbyactivearea", "0") != 0);
+    detectscale   = JPEGCodec::ParseScale(GetSetting("detectscale", "1"));
+    {
+        AString str = GetSetting("saveoriginal", "0");
+        savemode    = ((stricmp(str, "masked") == 0) ? (uint_t)Save_Masked :
+                       ((uint_t)str != 0)            ? (uint_t)Save_Original :
+                       (uint_t)Save_Reencode);
+    }
     logthreshold  = (double)GetSetting("logthreshold", "{threshold}").SearchAndReplace("{threshold}", GetSetting("threshold", "3000.0"));
+    kernels       = &DiffKernels::Get(DiffKernels::ParseLevel(GetSetting("simd", "auto")));
+
+    // coarse-to-fine: frames whose level (estimated from block means) is well below
+    // both thresholds skip the full resolution difference
+    coarseblock      = (uint_t)GetSetting("coarseblock", "0");
+    coarsemargin     = (double)GetSetting("coarsemargin", "0.5");
+    coarsecalibrate  = std::max((uint_t)GetSetting("coarsecalibrate", "25"), 1U);
+    coarsecountdown  = 0;
+    coarsecalibrated = false;
+
+    // optionally compare frames against a slowly adapting per-pixel mean rather than the
+    // previous frame, pixels that vary a lot (foliage, flicker) are given less weight
+    background    = ((uint_t)GetSetting("background", "0") != 0);
+    // rate is rounded to a power of two so that the update is a shift
+    bgshift       = std::min((uint_t)(log2(std::max((double)GetSetting("backgroundframes", "32"), 1.0)) + .5), 12U);
+    bgnoise       = (float)std::max((double)GetSetting("backgroundnoise", "4"), .5);
+    bgframes      = 0;
+
+    // decodes of frames whose luma blocks (read from the JPEG without decoding) have hardly
+    // changed since the last decoded frame are skipped, the previous frame's pixels are used
+    prescreen          = (double)GetSetting("prescreen", "0");
+    prescreencoefs     = ((uint_t)GetSetting("prescreenac", "0") != 0) ? 3 : 1;
+    prescreenmax       = (uint_t)GetSetting("prescreenmax", "10");
+    prescreencountdown = 0;
+    prescreenref.clear();
+    prescreenactive.clear();
+
+    // released images (with whatever JPEG, pixel and detection image buffers they still
+    // hold) are reused for new frames, pre-detection images have already given up their
+    // pixels (see ProcessImage()) so with predetectionimages > 1 decodes still allocate
+    poolsize      = (uint_t)GetSetting("imagepool", "4");
+
+    // capture of the next frame(s) overlaps processing of the last, frames captured ahead
+    // of processing hold an image each so the pool is enlarged to match
+    pipeline      = (uint_t)GetSetting("pipeline", "1");
+    poolsize     += poolsize ? pipeline : 0;
 
     GetStat("seqno", seqno);
 
     Log(0, "Destination '%s'", imagedir.CatPath(imagefmt).str());
     if (detimgdir.Valid()) Log(0, "Detection files destination '%s'", detimgdir.CatPath(detimgfmt).str());
-    if (detlogfmt.Valid()) Log(0, "Detection log '%s' with threshold %0.1lf", imagedir.CatPath(detlogfmt).str(), logthreshold);
+    if (detlogfmt.Valid() && detlogtext)   Log(0, "Detection log '%s' with threshold %0.1lf", imagedir.CatPath(detlogfmt).str(), logthreshold);
+    if (detlogfmt.Valid() && detlogbinary) Log(0, "Binary detection log '%s.bin' with threshold %0.1lf", imagedir.CatPath(detlogfmt).str(), logthreshold);
 
-    cmd = CreateCaptureCommand();
+    // (re)start stream if necessary
+    if (stream && (readingfromimagelist || (stream->GetURL() != streamurl) || (stream->GetTimeout() != (timeout * 1000)))) {
+        delete stream;
+        stream = NULL;
+    }
+    if (!stream && !readingfromimagelist && !replay && streamurl.Valid() &&
+        ((stream = new MJPEGStream(streamurl, timeout * 1000, &__FrameAvailable, this)) != NULL)) {
+        stream->Start();
+    }
 
-    Log(0, "Capture command '%s'", cmd.str());
+    if (stream) {
+        cmd = "";
+        Log(0, "Capturing from MJPEG stream '%s'", streamurl.str());
+    }
+    else if (usehttpclient) {
+        cmd = "";
+        Log(0, "Capturing from '%s' using built-in HTTP client", cameraurl.str());
+    }
+    else {
+        cmd = CreateCaptureCommand();
+        Log(0, "Capture command '%s'", cmd.str());
+    }
+    Log(0, "Using %s difference kernels", kernels->name);
+    if (detectscale > 1) Log(0, "Detecting at 1/%u resolution", detectscale);
+    if (background)      Log(0, "Background model over %u frames (full weight up to %0.1lf levels deviation)", 1U << bgshift, (double)bgnoise);
+    if (prescreen > 0.0) Log(0, "Skipping decodes of up to %u frames whose blocks change by less than %0.1lf levels (%s)", prescreenmax, prescreen, (prescreencoefs > 1) ? "DC and low AC" : "DC only");
+    if (coarseblock)     Log(0, "Coarse estimates on %ux%u blocks (full difference within %0.0lf%% of threshold and every %u frames)", coarseblock, coarseblock, coarsemargin * 100.0, coarsecalibrate);
+    if      (savemode == Save_Original) Log(0, "Saving original images");
+    else if (savemode == Save_Masked)   Log(0, "Saving original images with masked blocks blanked");
 
     detcount = 0;
 
@@ -314,6 +502,8 @@ void ImageDiffer::Configure()
         AString filename;
 
         maskimage.Delete();
+        detmaskimage.Delete();
+        maskwid = maskhgt = 0;
         filename = GetSetting("maskimage");
         if (filename.Valid()) {
             AString filename2;
@@ -330,6 +520,15 @@ void ImageDiffer::Configure()
             }
         }
 
+        // queued save jobs keep the mask they were created with
+        if (maskimage.Valid()) {
+            AImage *mask = new AImage;
+
+            *mask = maskimage;
+            savemask.reset(mask);
+        }
+        else savemask.reset();
+
         gainimage.Delete();
         filename = GetSetting("gainimage");
         if (filename.Valid()) {
@@ -347,7 +546,6 @@ void ImageDiffer::Configure()
                 Log(0, "Failed to find gain image '%s'", filename.str());
             }
         }
-        gaindata.resize(0);
     }
 
     predetectionimages  = (uint_t)GetSetting("predetectionimages",  "2");
@@ -389,570 +587,2008 @@ void ImageDiffer::Configure()
     }
     else matrix.resize(0);
 
+    ScaleMatrix(detectscale);
+    AnalyseMatrix();
+
     previouslevels.resize(10);
     previouslevelindex = 0;
 
-    if (!readingfromimagelist && cameraurl.Valid()) {
+    if (!readingfromimagelist && !replay && cameraurl.Valid()) {
         AString str;
         uint_t i;
 
         for (i = 1; (str = AString("camerapreurl[%]").Arg(i)).Valid() && SettingExists(str); i++) {
-            AString cmd;
+            AString url = GetSetting(str);
+
+            if (usehttpclient && HTTPClient::IsSupported(url)) {
+                if (httpclient.Get(url, capturedata, timeout * 1000)) {
+                    Log(0, "Fetched '%s' successfully", url.str());
+                }
+            }
+            else {
+                AString cmd;
 
-            cmd.printf("%s -O /dev/null", CreateWGetCommand(GetSetting(str)).str());
+                cmd.printf("%s -O /dev/null", CreateWGetCommand(url).str());
 
-            if (system(cmd) == 0) {
-                Log(0, "Ran '%s' successfully", cmd.str());
+                if (system(cmd) == 0) {
+                    Log(0, "Ran '%s' successfully", cmd.str());
+                }
             }
         }
     }
 }
 
-ImageDiffer::IMAGE *ImageDiffer::CreateImage(const char *filename, const IMAGE *img0)
+void ImageDiffer::ScaleMatrix(uint_t scale)
 {
-    IMAGE *img = NULL;
+    // resample matrix for detection at 1/scale resolution: each element is added into the
+    // element nearest its scaled position so that the overall response is preserved
+    if (matwid && mathgt && (scale > 1)) {
+        const sint_t cx  = (matwid - 1) >> 1, cy = (mathgt - 1) >> 1;
+        const sint_t ncx = (cx + scale / 2) / scale, ncy = (cy + scale / 2) / scale;
+        const uint_t nwid = 2 * ncx + 1, nhgt = 2 * ncy + 1;
+        std::vector<double> newmatrix(nwid * nhgt, 0.0);
+        sint_t mx, my;
+
+        for (my = 0; my < (sint_t)mathgt; my++) {
+            const sint_t oy = my - cy;
+            const sint_t ny = limit((oy < 0) ? -((-oy + (sint_t)scale / 2) / (sint_t)scale) : ((oy + (sint_t)scale / 2) / (sint_t)scale), -ncy, ncy) + ncy;
+
+            for (mx = 0; mx < (sint_t)matwid; mx++) {
+                const sint_t ox = mx - cx;
+                const sint_t nx = limit((ox < 0) ? -((-ox + (sint_t)scale / 2) / (sint_t)scale) : ((ox + (sint_t)scale / 2) / (sint_t)scale), -ncx, ncx) + ncx;
+
+                newmatrix[nx + ny * nwid] += matrix[mx + my * matwid];
+            }
+        }
 
-    if ((img = new IMAGE) != NULL) {
-        JPEG_INFO info;
-        AImage& image = img->image;
+        Log(0, "Matrix scaled from %u x %u to %u x %u for detection", matwid, mathgt, nwid, nhgt);
 
-        if (ReadJPEGInfo(filename, info) && image.LoadJPEG(filename)) {
-            // apply mask immediately
-            image            *= maskimage;
+        matrix.swap(newmatrix);
+        matwid = nwid;
+        mathgt = nhgt;
+    }
+}
 
-            img->filename     = filename;
-            img->rect         = image.GetRect();
-            img->saved        = false;
-            img->logged       = false;
-            img->imagenumber  = imagenumber++;
+void ImageDiffer::AnalyseMatrix()
+{
+    // decide how the matrix can be applied most efficiently:
+    //   constant matrix             -> sliding sums (cost independent of matrix size)
+    //   rank-1 (separable) matrix   -> horizontal then vertical 1D passes
+    //   anything else               -> full 2D convolution, with bounds checks only at the borders
+    const double maxval = matrix.size() ? std::max(fabs(*std::max_element(matrix.begin(), matrix.end())),
+                                                   fabs(*std::min_element(matrix.begin(), matrix.end()))) : 0.0;
+    const double eps    = 1.0e-9 * maxval;
+    uint_t i, x, y, px = 0, py = 0;
+
+    matrixrow.resize(0);
+    matrixcol.resize(0);
+
+    if (!matwid || !mathgt) {
+        matrixtype = Matrix_None;
+        return;
+    }
 
-            if (!img0) {
-                Log(0, "New set of images size %dx%d", img->rect.w, img->rect.h);
+    // constant?
+    for (i = 1; (i < matrix.size()) && (fabs(matrix[i] - matrix[0]) <= eps); i++) ;
+    if (i == matrix.size()) {
+        matrixtype = Matrix_Box;
+    }
+    else {
+        // find largest element to use as pivot
+        for (i = 0; i < matrix.size(); i++) {
+            if (fabs(matrix[i]) == maxval) {
+                px = i % matwid;
+                py = i / matwid;
+                break;
             }
-            else if (img0 && (img0->rect != img->rect)) {
-                Log(0, "Images are different sizes (%dx%d -> %dx%d), deleting image list",
-                    img0->rect.w, img0->rect.h, img->rect.w, img->rect.h);
+        }
 
-                imglist.DeleteList();
+        // matrix[x, y] = col[y] * row[x] where row is the pivot row and col is the pivot column / pivot
+        matrixrow.resize(matwid);
+        matrixcol.resize(mathgt);
+        for (x = 0; x < matwid; x++) matrixrow[x] = matrix[x + py * matwid];
+        for (y = 0; y < mathgt; y++) matrixcol[y] = matrix[px + y * matwid] / matrix[px + py * matwid];
+
+        matrixtype = Matrix_Separable;
+        for (y = 0; (y < mathgt) && (matrixtype == Matrix_Separable); y++) {
+            for (x = 0; x < matwid; x++) {
+                if (fabs(matrixcol[y] * matrixrow[x] - matrix[x + y * matwid]) > eps) {
+                    matrixtype = Matrix_General;
+                    break;
+                }
             }
         }
-        else {
-            Log(0, "Failed to load image '%s'", filename);
-            delete img;
-            img = NULL;
-        }
     }
 
-    return img;
+    static const char *typenames[] = {"none", "general", "separable", "box"};
+    Log(0, "Matrix is %u x %u (%s)", matwid, mathgt, typenames[matrixtype]);
 }
 
-void ImageDiffer::FindDifference(const IMAGE *img1, IMAGE *img2, std::vector<double>& difference)
+void ImageDiffer::ResampleImage(const AImage& src, AImage& dst, uint_t w, uint_t h)
 {
-    const AImage::PIXEL *pix1 = img1->image.GetPixelData();
-    const AImage::PIXEL *pix2 = img2->image.GetPixelData();
-    const ARect& rect = img1->rect;
-    const uint_t w = rect.w, h = rect.h, len = w * h;
-    std::vector<double> data;
-    double  *p;
-    double avg[3];
-    uint_t x, y;
-
-    difference.resize(len);
-    data.resize(len * 3);
-
-    memset(avg, 0, sizeof(avg));
+    // nearest neighbour resample of src into dst of size w x h
+    const AImage::PIXEL *srcptr = src.GetPixelData();
+    const uint_t srcwid = src.GetRect().w;
+    const uint_t srchgt = src.GetRect().h;
 
-    // find difference between the two images and
-    // normalize against average on each line per component
-    for (y = 0, p = &data[0]; y < h; y++) {
-        double yavg[3];
+    if (srcptr && dst.Create(w, h)) {
+        AImage::PIXEL *dstptr = dst.GetPixelData();
+        uint_t x, y;
 
-        // reset average
-        memset(yavg, 0, sizeof(yavg));
+        for (y = 0; y < h; y++) {
+            const uint_t y2 = std::min((y * srchgt + h / 2) / h, srchgt - 1);
 
-        // subtract pixels and update per-component average
-        for (x = 0; x < w; x++, p += 3, pix1++, pix2++) {
-            p[0]     = ((double)pix1->r - (double)pix2->r) * redscale;
-            p[1]     = ((double)pix1->g - (double)pix2->g) * grnscale;
-            p[2]     = ((double)pix1->b - (double)pix2->b) * bluscale;
+            for (x = 0; x < w; x++) {
+                const uint_t x2 = std::min((x * srcwid + w / 2) / w, srcwid - 1);
 
-            yavg[0] += p[0];
-            yavg[1] += p[1];
-            yavg[2] += p[2];
+                *dstptr++ = srcptr[x2 + y2 * srcwid];
+            }
         }
+    }
+}
 
-        yavg[0] /= (double)w;
-        yavg[1] /= (double)w;
-        yavg[2] /= (double)w;
+void ImageDiffer::UpdateMask(uint_t w, uint_t h)
+{
+    // mask is resampled to detection resolution once and compiled into spans of active
+    // pixels (any component non-zero) on each row so that the difference passes never
+    // visit masked pixels, with no mask each row is a single span
+    // the weight map is rebuilt at the same time
+    if ((w == maskwid) && (h == maskhgt)) return;
 
-        // subtract average from each pixel
-        // and update total average
-        p -= 3 * w;
-        for (x = 0; x < w; x++, p += 3) {
-            p[0] -= yavg[0]; avg[0] += p[0];
-            p[1] -= yavg[1]; avg[1] += p[1];
-            p[2] -= yavg[2]; avg[2] += p[2];
-        }
+    const AImage::PIXEL *mask = NULL;
+    uint_t x, y;
+
+    if (maskimage.Valid()) {
+        ResampleImage(maskimage, detmaskimage, w, h);
+        mask = detmaskimage.GetPixelData();
     }
 
-    avg[0] /= (double)len;
-    avg[1] /= (double)len;
-    avg[2] /= (double)len;
+    maskspans.clear();
+    maskrows.resize(h + 1);
+    maskarea    = 0;
+    maskpartial = false;
 
-    // update gaindata array from gainimage - gaindata array is same size as the incoming images
-    // whatever the size of the original gainimage is
-    // an invalid gainimage results in a single value (white) used throughout gaindata
-    {
-        const uint_t gainwid = gainimage.GetRect().w;
-        const uint_t gainhgt = gainimage.GetRect().h;
-        uint_t i = 0, n = w * h * 3;
-
-        // resize and recalculate gaindata array if necessary
-        if (n != gaindata.size()) {
-            static const AImage::PIXEL white = {255, 255, 255, 0};
-            const AImage::PIXEL *gainptr = gainimage.GetPixelData() ? gainimage.GetPixelData() : &white;
-
-            gaindata.resize(n);
-
-            for (y = 0; y < h; y++) {
-                // convert detection y into gainimage y
-                const uint_t y2 = (y * gainhgt + h / 2) / h;
-
-                for (x = 0; x < w; x++) {
-                    // convert detection x into gainimage x
-                    const uint_t x2 = (x * gainwid + w / 2) / w;
-                    // get ptr to pixel data
-                    const AImage::PIXEL *p = gainptr + x2 + y2 * gainwid;
-
-                    // convert pixel into RGB doubleing point values 0-1
-                    gaindata[i++] = (double)p->r / 255.f;
-                    gaindata[i++] = (double)p->g / 255.f;
-                    gaindata[i++] = (double)p->b / 255.f;
+    for (y = 0; y < h; y++) {
+        maskrows[y] = (uint_t)maskspans.size();
+
+        if (mask) {
+            const AImage::PIXEL *p = mask + y * w;
+
+            for (x = 0; x < w;) {
+                MASKSPAN span;
+
+                // skip masked pixels
+                for (; (x < w) && !(p[x].r | p[x].g | p[x].b); x++) ;
+                if (x == w) break;
+
+                // find end of active pixels, noting any that are not fully on
+                for (span.x1 = x; (x < w) && (p[x].r | p[x].g | p[x].b); x++) {
+                    maskpartial |= ((p[x].r & p[x].g & p[x].b) != 255);
                 }
+                span.x2 = x;
+
+                maskspans.push_back(span);
+                maskarea += span.x2 - span.x1;
             }
         }
-    }
+        else {
+            MASKSPAN span = {0, w};
 
-    // subtract overall average from pixel data, scale by gain image and
-    // calculate modulus
-    double *p2, *p3;
-    for (y = 0, p = &data[0], p2 = &data[0], p3 = &gaindata[0]; y < h; y++) {
-        for (x = 0; x < w; x++, p += 3, p2++, p3 += 3) {
-            p[0] -= avg[0];
-            p[1] -= avg[1];
-            p[2] -= avg[2];
-            p[0] *= p3[0];
-            p[1] *= p3[1];
-            p[2] *= p3[2];
-            p2[0] = sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+            maskspans.push_back(span);
+            maskarea += w;
         }
     }
 
-    // find average and SD of resultant difference data with matrix applied
-    double avg2 = 0.0, sd2 = 0.0;
-    double maxdifference = 0.0;
-    uint_t mx, my, cx = (matwid - 1) >> 1, cy = (mathgt - 1) >> 1;
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            double val = 0.0;
+    maskrows[h] = (uint_t)maskspans.size();
+    maskwid     = w;
+    maskhgt     = h;
 
-            // apply matrix to data
-            if (matwid && mathgt) {
-                for (my = 0; my < mathgt; my++) {
-                    if (((y + my) >= cy) && ((y + my) < (h + cy))) {
-                        for (mx = 0; mx < matwid; mx++) {
-                            if (((x + mx) >= cx) && ((x + mx) < (w + cx))) {
-                                val += matrix[mx + my * matwid] * data[(x + mx - cx) + (y + my - cy) * w];
-                            }
-                            //else debug("x: ((%u + %u) >= %u) && ((%u + %u) < (%u + %u)) failed\n", x, mx, cx, x, mx, w, cx);
-                        }
-                    }
-                    //else debug("y: ((%u + %u) >= %u) && ((%u + %u) < (%u + %u)) failed\n", y, my, cy, y, my, h, cy);
-                }
-            }
-            // or just use original if no matrix
-            else val = data[x + y * w];
+    // gain is combined with the mask at the same time
+    UpdateWeightData(w, h);
 
-            val *= diffgain;
+    if (mask) Log(1, "Mask covers %0.1lf%% of %ux%u image in %u spans",
+                  100.0 * (double)(w * h - maskarea) / (double)std::max(w * h, (uint_t)1), w, h, (uint_t)maskspans.size());
+}
 
-            // store result in difference array
-            difference[x + y * w] = val;
+double ImageDiffer::GetLevelArea(uint_t w, uint_t h) const
+{
+    return (double)std::max(levelsbyactivearea ? maskarea : (w * h), (uint_t)1);
+}
 
-            // find maximum difference
-            maxdifference = std::max(maxdifference, val);
-        }
-    }
+void ImageDiffer::ApplyMask(AImage& image)
+{
+    const ARect& rect = image.GetRect();
+    const uint_t w = rect.w, h = rect.h;
 
-    double rawlevel = 0.0;
-    double thres    = diffthreshold * maxdifference;
-    uint_t n = 0;
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            double val = difference[x + y * w];
+    UpdateMask(w, h);
 
-            rawlevel += val;
-            if (val >= thres) {
-                // update average and SD
-                avg2 += val;
-                sd2  += val * val;
-                n++;
+    if (maskimage.Valid()) {
+        // scale pixels only if the mask has values other than fully on or off,
+        // otherwise just blank the gaps between spans
+        if (maskpartial) image *= detmaskimage;
+        else {
+            AImage::PIXEL *pix = image.GetPixelData();
+            uint_t y;
+
+            for (y = 0; y < h; y++, pix += w) {
+                const MASKSPAN *span = &maskspans[maskrows[y]], *end = &maskspans[maskrows[y + 1]];
+                uint_t x = 0;
+
+                for (; span < end; x = span->x2, span++) memset(pix + x, 0, (span->x1 - x) * sizeof(*pix));
+                memset(pix + x, 0, (w - x) * sizeof(*pix));
             }
         }
     }
-
-    // calculate final average and SD
-    avg2 /= (double)n;
-    sd2   = sqrt(sd2 / (double)n - avg2 * avg2);
-
-    img2->avg      = avg2;
-    img2->sd       = sd2;
-    img2->rawlevel = rawlevel / (double)len;
-    img2->diff     = 0.0;
 }
 
-void ImageDiffer::CalcLevel(IMAGE *img2, double avg, double sd, std::vector<double>& difference)
+void ImageDiffer::ClearMaskGaps(float *dst, uint_t w, uint_t y) const
 {
-    // calculate minimum level based on average and SD values, individual levels must exceed this
-    const uint_t len = img2->rect.w * img2->rect.h;
-    double diff = avgfactor * avg + sdfactor * sd, level = 0.0, rawlevel = 0.0;
-    uint_t i;
-
-    // find level = sum of levels above minimum level
-    for (i = 0; i < len; i++) {
-        rawlevel += difference[i];
-        difference[i] = std::max(difference[i] - diff, 0.0);
-        level += difference[i];
-    }
-
-    // divide by area of image and multiply up to make values arbitarily scaled
-    rawlevel /= (double)len;
-    level     = level * 1000.0 / (double)len;
+    // zero values of row y that are not in any span
+    const MASKSPAN *span = &maskspans[maskrows[y]], *end = &maskspans[maskrows[y + 1]];
+    uint_t x = 0;
 
-    img2->diff     = diff;
-    img2->level    = level;
-    img2->rawlevel = rawlevel;
+    for (; span < end; x = span->x2, span++) std::fill(dst + x, dst + span->x1, 0.f);
+    std::fill(dst + x, dst + w, 0.f);
 }
 
-void ImageDiffer::CreateDetectionImage(const IMAGE *img1, IMAGE *img2, const std::vector<double>& difference)
+ImageDiffer::IMAGE *ImageDiffer::NewImage()
 {
-    const ARect& rect = img2->rect;
+    IMAGE *img = NULL;
 
-    // create detection image, if detection image directory valid
-    if (img2->detimage.Create(rect.w, rect.h)) {
-        const AImage::PIXEL *pixel1 = img1->image.GetPixelData();
-        const AImage::PIXEL *pixel2 = img2->image.GetPixelData();
-        AImage::PIXEL *pixel = img2->detimage.GetPixelData();
-        const uint_t  len    = rect.w * rect.h;
-        uint_t i;
+    {
+        AThreadLock lock(poollock);
 
-        // use individual level from above and scale and max RGB values from original images
-        for (i = 0; i < len; i++, pixel++, pixel1++, pixel2++) {
-            pixel->r = (uint8_t)limit((double)std::max(pixel1->r, pixel2->r) * difference[i] / 255.0, 0.0, 255.0);
-            pixel->g = (uint8_t)limit((double)std::max(pixel1->g, pixel2->g) * difference[i] / 255.0, 0.0, 255.0);
-            pixel->b = (uint8_t)limit((double)std::max(pixel1->b, pixel2->b) * difference[i] / 255.0, 0.0, 255.0);
+        if (imagepool.size()) {
+            img = imagepool.back();
+            imagepool.pop_back();
         }
     }
+
+    if (!img && ((img = new IMAGE) != NULL)) {
+        img->owner = this;
+        CountFrameAlloc();
+    }
+
+    return img;
 }
 
-void ImageDiffer::Process(const ADateTime& dt)
+void ImageDiffer::RecycleImage(IMAGE *img)
 {
-    AListNode *node;
-    AString imgfile;
-
-    if (readingfromimagelist && ((node = sourceimagelist.Pop()) != NULL)) {
-        AString *str = AString::Cast(node);
+    // called from whichever thread released the image last
+    AThreadLock lock(poollock);
 
-        if (str) {
-            imgfile = *str;
-            Log(2, "Using image '%s'", imgfile.str());
-        }
+    if (imagepool.size() < poolsize) imagepool.push_back(img);
+    else delete img;
+}
 
-        delete node;
-    }
-    else if (cmd.Valid() && (system(cmd) == 0)) {
-        imgfile = tempfile;
+bool ImageDiffer::PrescreenImage(const std::vector<uint8_t>& jpeg)
+{
+    // compare the dequantised luma DC (and optionally lowest AC) coefficients of each 8x8 block
+    // with those of the last decoded frame, if no unmasked block has changed by prescreen levels
+    // (RMS over the coefficients, DC is 8 x the block's mean) the frame need not be decoded
+    // frames are always decoded during detections and after prescreenmax skipped frames
+    if (prescreen <= 0.0) return false;
+
+    if (indetection) {
+        // a new reference is taken once the detection is over
+        prescreenref.clear();
+        return false;
     }
 
-    if (imgfile.Valid()) {
-        IMAGE *img;
+    const uint64_t t0 = GetMonotonicTimeNS();
+    uint_t bw = 0, bh = 0;
+    bool   skip = false;
 
-        if ((img = CreateImage(imgfile, (const IMAGE *)imglist[imglist.Count() - 1])) != NULL) {
-            img->dt = dt;
+    const size_t coefcapacity = prescreennew.capacity();
+    if (!JPEGCodec::ReadLumaCoefficients(jpeg, prescreencoefs, prescreennew, bw, bh)) prescreennew.clear();
+    if (prescreennew.capacity() != coefcapacity) CountFrameAlloc();
 
-            imglist.Add(img);
+    if (prescreencountdown && (bw == prescreenbw) && (bh == prescreenbh) && (prescreenref.size() == prescreennew.size())) {
+        const uint_t  n     = prescreencoefs;
+        const int64_t maxsum = (int64_t)(prescreen * prescreen * 64.0 * (double)n);
+        const sint_t  *p1   = &prescreenref[0], *p2 = &prescreennew[0];
+        uint_t i, j;
 
-            // strip unneeded images off start of image list
-            // need to keep at least 2 and at least predetectionimages+1 images
-            while ((imglist.Count() > 2) && (imglist.Count() > (predetectionimages + 1))) {
-                delete (IMAGE *)imglist[0];
-                imglist.Pop();
-            }
+        if (prescreenactive.size() != (bw * bh)) {
+            // blocks entirely masked out are ignored
+            prescreenactive.assign(bw * bh, 1);
 
-            // if there are enough images to compare
-            if (imglist.Count() >= 2) {
-                const IMAGE *img1 = (const IMAGE *)imglist[imglist.Count() - 2];
-                IMAGE *img2       = (IMAGE       *)imglist[imglist.Count() - 1];
-                std::vector<double> difference;
+            if (maskimage.Valid()) {
+                const AImage::PIXEL *mask = maskimage.GetPixelData();
+                const uint_t mw = maskimage.GetRect().w, mh = maskimage.GetRect().h;
+                uint_t bx, by, x, y;
 
-                // find difference between images
-                FindDifference(img1, img2, difference);
+                for (by = 0; by < bh; by++) {
+                    const uint_t y1 = by * mh / bh, y2 = std::max((by + 1) * mh / bh, y1 + 1);
 
-                // filter values
-                if (img2->avg >= fastavg) fastavg += (img2->avg - fastavg) * fastattcoeff;
-                else                      fastavg += (img2->avg - fastavg) * fastdeccoeff;
-                if (img2->sd  >= fastsd)  fastsd  += (img2->sd  - fastsd) * fastattcoeff;
-                else                      fastsd  += (img2->sd  - fastsd) * fastdeccoeff;
-                if (img2->avg >= slowavg) slowavg += (img2->avg - slowavg) * slowattcoeff;
-                else                      slowavg += (img2->avg - slowavg) * slowdeccoeff;
-                if (img2->sd  >= slowsd)  slowsd  += (img2->sd  - slowsd) * slowattcoeff;
-                else                      slowsd  += (img2->sd  - slowsd) * slowdeccoeff;
-                slowavg = std::min(slowavg, fastavg);
-                slowsd  = std::min(slowsd,  fastsd);
-
-                img2->fastavg = fastavg;
-                img2->fastsd  = fastsd;
-                img2->slowavg = slowavg;
-                img2->slowsd  = slowsd;
-
-                // store values in settings handler
-                SetStat("fastavg", fastavg);
-                SetStat("fastsd",  fastsd);
-                SetStat("slowavg", slowavg);
-                SetStat("slowsd",  slowsd);
-
-                //CalcLevel(img2, std::max(fastavg - slowavg, 0.0), slowsd, difference);
-
-                img2->level = fastavg - avgfactor * slowavg - sdfactor * slowsd;
-
-                const double& level = img2->level;
-                Log(1, "Level = %0.1lf, (rawlevel = %0.1lf, this frame = %0.3lf/%0.3lf, fast = %0.3lf/%0.3lf, slow = %0.3lf/%0.3lf, diff = %0.3lf)",
-                    level,
-                    img2->rawlevel,
-                    img2->avg,
-                    img2->sd,
-                    fastavg,
-                    fastsd,
-                    slowavg,
-                    slowsd,
-                    img2->diff);
-
-                SetStat("level", level);
-
-                previouslevels[previouslevelindex] = level;
-                if ((++previouslevelindex) == previouslevels.size()) previouslevelindex = 0;
-
-                if (detimgdir.Valid()) CreateDetectionImage(img1, img2, difference);
-
-                // should image(s) be saved?
-                if ((level >= threshold) || forcesavecount) {
-                    uint_t i;
-
-                    // save predetectionimages plus current image from image list (if they have not already been saved)
-
-                    // calculate starting position in list
-                    if (imglist.Count() >= (predetectionimages + 1)) i = imglist.Count() - (predetectionimages + 1);
-                    else                                             i = 0;
-
-                    // save any unsaved images, including latest
-                    for (; i < imglist.Count(); i++) {
-                        SaveImage((IMAGE *)imglist[i]);
-                        if (logdetections || (logthreshold <= threshold)) {
-                            LogDetection((IMAGE *)imglist[i]);
+                    for (bx = 0; bx < bw; bx++) {
+                        const uint_t x1 = bx * mw / bw, x2 = std::max((bx + 1) * mw / bw, x1 + 1);
+                        bool active = false;
+
+                        for (y = y1; !active && (y < y2); y++) {
+                            for (x = x1; !active && (x < x2); x++) active = (mask[x + y * mw].r | mask[x + y * mw].g | mask[x + y * mw].b) != 0;
                         }
-                    }
 
-                    // if a detection has been found, force the next postdetectionimages to be saved
-                    if      (level >= threshold) forcesavecount = postdetectionimages;
-                    // else decrement forcesavecount
-                    else if (forcesavecount)     forcesavecount--;
+                        prescreenactive[bx + by * bw] = active;
+                    }
+                }
+            }
+        }
+
+        for (i = 0, skip = true; skip && (i < (bw * bh)); i++, p1 += n, p2 += n) {
+            if (prescreenactive[i]) {
+                int64_t sum = 0;
+
+                for (j = 0; j < n; j++) {
+                    const int64_t d = p2[j] - p1[j];
+                    sum += d * d;
+                }
+
+                skip = (sum < maxsum);
+            }
+        }
+    }
+
+    const double t = (double)(GetMonotonicTimeNS() - t0) * 1.0e-6;
+
+    if (skip) {
+        prescreencountdown--;
+        prescreensaved += decodetime - t;
+        SetStat(StatsBlock::Stat_PrescreenSkipped, ++prescreenskipped);
+    }
+    else {
+        // this frame will be decoded and becomes the reference
+        prescreenref.swap(prescreennew);
+        prescreenbw        = bw;
+        prescreenbh        = bh;
+        prescreencountdown = prescreenmax;
+        prescreensaved    -= t;
+    }
+
+    SetStat(StatsBlock::Stat_PrescreenSaved, prescreensaved);
+
+    return skip;
+}
+
+ImageDiffer::IMAGE *ImageDiffer::CaptureImage(const char *filename)
+{
+    // read into the capture buffer so that file sources reuse buffers too
+    if (!JPEGCodec::ReadFile(filename, capturedata)) {
+        Log(0, "Failed to read image '%s'", filename);
+        return NULL;
+    }
+
+    return CaptureImage(capturedata, filename);
+}
+
+ImageDiffer::IMAGE *ImageDiffer::CaptureImage(std::vector<uint8_t>& data, const char *filename)
+{
+    IMAGE *img = NULL;
+
+    if ((img = NewImage()) != NULL) {
+        // a capture buffer that has grown since it was handed back has been re-allocated
+        if (data.capacity() > capturecapacity) CountFrameAlloc();
+
+        // take over JPEG data (without copying), it is decoded by FinishImage() and kept
+        // for saving, the caller gets the (recycled) image's old buffer back
+        img->jpeg.swap(data);
+        capturecapacity = data.capacity();
+
+        img->filename        = filename;
+        img->savefilename    = "";
+        img->savedetfilename = "";
+        img->prescreened     = false;
+        img->detimagevalid   = false;
+        img->saved           = false;
+        img->logged          = false;
+        img->refs            = 1;
+    }
+
+    return img;
+}
+
+bool ImageDiffer::DecodeImage(IMAGE *img)
+{
+    TraceSpan           span("decode", index);
+    AImage&             image  = img->image;
+    const AImage::PIXEL *pixel = image.GetPixelData();
+
+    // a static frame is not decoded, it takes the pixels of the previous frame in FinishImage()
+    if ((img->prescreened = PrescreenImage(img->jpeg)) == false) {
+        const bool timed = (benchtimes || (prescreen > 0.0));
+        uint64_t   t0    = timed ? GetMonotonicTimeNS() : 0;
+
+        // decode at detection resolution, using libjpeg's DCT scaling for reduced resolutions
+        const size_t linecapacity = decodeline.capacity();
+
+        if (!JPEGCodec::Decode(img->jpeg, image, detectscale, decodeline)) {
+            Log(0, "Failed to load image '%s'", img->filename.str());
+            return false;
+        }
+
+        img->scale = detectscale;
+
+        if (timed) {
+            uint64_t t1 = GetMonotonicTimeNS();
+
+            if (benchtimes) benchtimes->t[Stage_Decode] += t1 - t0;
+
+            // average cost of a decode, which is what a skipped decode saves
+            const double t = (double)(t1 - t0) * 1.0e-6;
+            decodetime = (decodetime > 0.0) ? (decodetime + (t - decodetime) * .1) : t;
+        }
+
+        // pixels are only re-allocated if the size has changed
+        if (image.GetPixelData() != pixel) CountFrameAlloc();
+        if (decodeline.capacity() != linecapacity) CountFrameAlloc();
+    }
+
+    return true;
+}
+
+bool ImageDiffer::FinishImage(IMAGE *img, const IMAGE *img0)
+{
+    if (!DecodeImage(img)) return false;
+
+    AImage&             image  = img->image;
+    const AImage::PIXEL *pixel = image.GetPixelData();
+
+    if (img->prescreened && (!img0 || !img0->image.Valid())) {
+        // previous frame has gone (e.g. re-configuration), decode after all
+        if (!JPEGCodec::Decode(img->jpeg, image, detectscale, decodeline)) {
+            Log(0, "Failed to load image '%s'", img->filename.str());
+            return false;
+        }
+
+        img->scale       = detectscale;
+        img->prescreened = false;
+    }
+
+    if (img->prescreened) {
+        // static frame: take the (already masked) pixels of the previous frame
+        if (img0->blocks.size() > img->blocks.capacity()) CountFrameAlloc();
+        image       = img0->image;
+        img->scale  = img0->scale;
+        img->blocks = img0->blocks;
+    }
+    else {
+        uint64_t t0 = benchtimes ? GetMonotonicTimeNS() : 0;
+
+        ApplyMask(image);
+
+        if (benchtimes) benchtimes->t[Stage_Mask] += GetMonotonicTimeNS() - t0;
+    }
+
+    if (image.GetPixelData() != pixel) CountFrameAlloc();
+
+    img->rect = image.GetRect();
+
+    if (!img0) {
+        Log(0, "New set of images size %dx%d", img->rect.w, img->rect.h);
+    }
+    else if (img0->rect != img->rect) {
+        Log(0, "Images are different sizes (%dx%d -> %dx%d), deleting image list",
+            img0->rect.w, img0->rect.h, img->rect.w, img->rect.h);
+
+        imglist.DeleteList();
+    }
+
+    // only frames that could be decoded are numbered so gaps are frames that were not saved
+    img->imagenumber = imagenumber++;
+
+    return true;
+}
+
+ImageDiffer::IMAGE *ImageDiffer::CreateImage(const char *filename, const IMAGE *img0)
+{
+    IMAGE *img;
+
+    if (((img = CaptureImage(filename)) != NULL) && !FinishImage(img, img0)) {
+        RecycleImage(img);
+        img = NULL;
+    }
+
+    return img;
+}
+
+ImageDiffer::IMAGE *ImageDiffer::CreateImage(std::vector<uint8_t>& data, const char *filename, const IMAGE *img0)
+{
+    IMAGE *img;
+
+    if (((img = CaptureImage(data, filename)) != NULL) && !FinishImage(img, img0)) {
+        RecycleImage(img);
+        img = NULL;
+    }
+
+    return img;
+}
+
+void ImageDiffer::UpdateWeightData(uint_t w, uint_t h)
+{
+    // build weightdata array from gainimage and the mask - weightdata array is same size as the
+    // incoming images whatever the size of the original gainimage is
+    // weightdata is stored as three planes (r, g, b) of w 8-bit fixed point values (255 = unity)
+    // per row so that the difference kernels can stream it directly, the gain image is 8-bit
+    // so this is exact
+    // masked pixels have zero weight
+    // an invalid gainimage results in an empty weightdata array (unity gain)
+    const AImage::PIXEL *gainptr = gainimage.GetPixelData();
+    const AImage::PIXEL *mask    = maskimage.Valid() ? detmaskimage.GetPixelData() : NULL;
+    const uint_t gainwid = gainimage.GetRect().w;
+    const uint_t gainhgt = gainimage.GetRect().h;
+    uint_t x, y;
+
+    weightdata.resize(gainptr ? w * h * 3 : 0);
+
+    for (y = 0; (y < h) && gainptr; y++) {
+        // convert detection y into gainimage y
+        const uint_t y2 = std::min((y * gainhgt + h / 2) / h, gainhgt - 1);
+        uint8_t *p = &weightdata[y * w * 3];
+
+        for (x = 0; x < w; x++) {
+            // convert detection x into gainimage x
+            const uint_t x2 = std::min((x * gainwid + w / 2) / w, gainwid - 1);
+            // get ptr to pixel data
+            const AImage::PIXEL *p2 = gainptr + x2 + y2 * gainwid;
+            const bool active = !mask || (mask[x + y * w].r | mask[x + y * w].g | mask[x + y * w].b);
+
+            p[x]         = active ? p2->r : 0;
+            p[x + w]     = active ? p2->g : 0;
+            p[x + w * 2] = active ? p2->b : 0;
+        }
+    }
+}
+
+void ImageDiffer::CalcMagnitudeRow(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t w, uint_t y, float *dst)
+{
+    const float    fscale[3] = {(float)redscale, (float)grnscale, (float)bluscale};
+    const std::vector<uint8_t>& weights = bgactive ? bgweightdata : weightdata;
+    const uint8_t  *weight   = weights.size() ? &weights[y * w * 3] : NULL;
+    const MASKSPAN *span1    = &maskspans[maskrows[y]], *span2 = &maskspans[maskrows[y + 1]], *span;
+    sint_t sums[3] = {0, 0, 0};
+    uint_t n = 0;
+
+    pix1 += y * w;
+    pix2 += y * w;
+
+    // masked pixels have zero magnitude
+    ClearMaskGaps(dst, w, y);
+
+    // find average difference on the active part of the line per component (exact from integer sums)
+    for (span = span1; span < span2; span++) {
+        sint_t spansums[3];
+
+        kernels->RowSums(pix1 + span->x1, pix2 + span->x1, span->x2 - span->x1, spansums);
+        sums[0] += spansums[0];
+        sums[1] += spansums[1];
+        sums[2] += spansums[2];
+        n       += span->x2 - span->x1;
+    }
+
+    if (!n) return;
+
+    // once each line has had its own average subtracted the overall average is,
+    // by definition, zero so there's no need for a separate pass over the image to find it
+    const float offset[3] = {
+        (float)((double)sums[0] * redscale / (double)n),
+        (float)((double)sums[1] * grnscale / (double)n),
+        (float)((double)sums[2] * bluscale / (double)n),
+    };
+
+    // subtract line average from pixel differences, scale by gain image and calculate modulus
+    for (span = span1; span < span2; span++) {
+        kernels->RowMagnitude(pix1 + span->x1, pix2 + span->x1, span->x2 - span->x1,
+                              fscale, offset,
+                              weight ? weight + span->x1 : NULL, w,
+                              dst + span->x1);
+    }
+}
+
+void ImageDiffer::CalcInputRow(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t w, uint_t y)
+{
+    // calculate row y of magnitudes and prepare it for the matrix:
+    // general matrices use the magnitudes directly, separable matrices need the horizontal
+    // pass applied and box matrices need the horizontal sliding sum
+    const uint_t nrows = mathgt + 1;
+    const sint_t cx    = (matwid - 1) >> 1;
+    float        *dst  = &magrows[(y % nrows) * w];
+    sint_t x, mx;
+
+    if (matrixtype == Matrix_General) {
+        CalcMagnitudeRow(pix1, pix2, w, y, dst);
+        return;
+    }
+
+    float *src = &magrows[nrows * w];
+    CalcMagnitudeRow(pix1, pix2, w, y, src);
+
+    if (matrixtype == Matrix_Separable) {
+        const MASKSPAN *span = &maskspans[maskrows[y]], *end = &maskspans[maskrows[y + 1]];
+        sint_t x2 = 0;
+
+        // the horizontal pass can only be non-zero within (matwid - 1) of a span
+        std::fill(dst, dst + w, 0.f);
+        for (; span < end; span++) {
+            const sint_t x1 = std::max(std::max((sint_t)span->x1 - (sint_t)matwid + 1 + cx, (sint_t)0), x2);
+
+            x2 = std::min((sint_t)span->x2 + cx, (sint_t)w);
+            for (x = x1; x < x2; x++) {
+                const sint_t mx1 = std::max(cx - x, 0);
+                const sint_t mx2 = std::min((sint_t)w + cx - x, (sint_t)matwid);
+                double val = 0.0;
+
+                for (mx = mx1; mx < mx2; mx++) val += matrixrow[mx] * (double)src[x + mx - cx];
+
+                dst[x] = (float)val;
+            }
+        }
+    }
+    else {
+        // sliding sum of matwid values centred on x
+        double sum = 0.0;
+
+        for (x = 0; x < std::min(cx, (sint_t)w); x++) sum += src[x];
+        for (x = 0; x < (sint_t)w; x++) {
+            if ((x + cx) < (sint_t)w) sum += src[x + cx];
+            if ((x - cx - 1) >= 0)    sum -= src[x - cx - 1];
+            dst[x] = (float)sum;
+        }
+
+        // add row to column sums
+        for (x = 0; x < (sint_t)w; x++) matrixcolsum[x] += dst[x];
+    }
+}
+
+void ImageDiffer::ApplyMatrixRow(uint_t w, uint_t h, uint_t y, float *dst)
+{
+    // produce output row y from the prepared input rows in magrows,
+    // input rows outside the image are treated as zero as are pixels off either side
+    // only pixels in the spans of row y are produced, the rest are zero
+    const uint_t nrows = mathgt + 1;
+    const uint_t cx = (matwid - 1) >> 1, cy = (mathgt - 1) >> 1;
+    const uint_t my1 = (y < cy) ? cy - y : 0;
+    const uint_t my2 = std::min(h + cy - y, mathgt);
+    const MASKSPAN *span1 = &maskspans[maskrows[y]], *span2 = &maskspans[maskrows[y + 1]], *span;
+    uint_t x, mx, my;
+
+    ClearMaskGaps(dst, w, y);
+
+    switch (matrixtype) {
+        case Matrix_Box: {
+            const double val = matrix[0] * diffgain;
+
+            // remove row that has dropped out of the window
+            if (y > cy) {
+                const float *row = &magrows[((y - cy - 1) % nrows) * w];
+                for (x = 0; x < w; x++) matrixcolsum[x] -= row[x];
+            }
+
+            for (span = span1; span < span2; span++) {
+                for (x = span->x1; x < span->x2; x++) dst[x] = (float)(matrixcolsum[x] * val);
+            }
+            break;
+        }
+
+        case Matrix_Separable: {
+            double *acc = &matrixacc[0];
+
+            for (span = span1; span < span2; span++) {
+                std::fill(acc + span->x1, acc + span->x2, 0.0);
+                for (my = my1; my < my2; my++) {
+                    const float  *row = &magrows[((y + my - cy) % nrows) * w];
+                    const double coef = matrixcol[my];
+
+                    for (x = span->x1; x < span->x2; x++) acc[x] += coef * (double)row[x];
                 }
 
-                if (level >= threshold) {
-                    // start if detection?
-                    if (!detcount && detstartcmd.Valid()) {
-                        AString cmd = detstartcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level));
-                        if (system(cmd) != 0) {
-                            Log(0, "Detection start command '%s' failed", cmd.str());
-                        }
-                    }
+                for (x = span->x1; x < span->x2; x++) dst[x] = (float)(acc[x] * diffgain);
+            }
+            break;
+        }
+
+        default: {
+            double *acc = &matrixacc[0];
+
+            for (span = span1; span < span2; span++) {
+                std::fill(acc + span->x1, acc + span->x2, 0.0);
+                for (my = my1; my < my2; my++) {
+                    const float *row = &magrows[((y + my - cy) % nrows) * w];
+
+                    for (mx = 0; mx < matwid; mx++) {
+                        const double coef = matrix[mx + my * matwid];
+
+                        if (coef == 0.0) continue;
+
+                        // only those taps that are inside the image
+                        const uint_t x1  = std::max(span->x1, SUBZ(cx, mx));
+                        const uint_t x2  = std::min(span->x2, SUBZ(w + cx, mx));
+                        const float  *src = row + mx - cx;
+                        for (x = x1; x < x2; x++) acc[x] += coef * (double)src[x];
+                    }
+                }
+
+                for (x = span->x1; x < span->x2; x++) dst[x] = (float)(acc[x] * diffgain);
+            }
+            break;
+        }
+    }
+}
+
+void ImageDiffer::FindDifference(const IMAGE *img1, IMAGE *img2, std::vector<float>& difference)
+{
+    const AImage::PIXEL *pix1 = img1->image.GetPixelData();
+    const AImage::PIXEL *pix2 = img2->image.GetPixelData();
+    const ARect& rect = img1->rect;
+    const uint_t w = rect.w, h = rect.h, len = w * h;
+    const uint_t cy = (mathgt - 1) >> 1;
+    double maxdifference = 0.0, rawlevel = 0.0;
+    uint_t x, y, nextrow = 0;
+
+    // the only frame sized buffer is the (float) difference array,
+    // everything else works on a window of rows of magnitudes that stays in cache
+    ResizeBuffer(difference, len);
+    ResizeBuffer(rowmax, h);
+    if (matrixtype != Matrix_None) {
+        // window of prepared rows, one extra row for box matrices and a scratch row
+        ResizeBuffer(magrows, (mathgt + 2) * w);
+        ResizeBuffer(matrixacc, w);
+        AssignBuffer(matrixcolsum, w, 0.0);
+    }
+
+    UpdateMask(w, h);
+
+    // stage times are only taken (per row) when benchmarking
+    uint64_t t = benchtimes ? GetMonotonicTimeNS() : 0;
+
+    // single pass: calculate magnitude rows as they are needed by the matrix,
+    // apply matrix and gain and accumulate maximum and total as each output row is produced
+    for (y = 0; y < h; y++) {
+        const MASKSPAN *span1 = &maskspans[maskrows[y]], *span2 = &maskspans[maskrows[y + 1]], *span;
+        float  *dst  = &difference[y * w];
+        double rowsum = 0.0;
+        float  rmax   = 0.f;
+
+        if (matrixtype != Matrix_None) {
+            // calculate rows required for this output row
+            for (; (nextrow < h) && (nextrow <= (y + cy)); nextrow++) {
+                CalcInputRow(pix1, pix2, w, nextrow);
+            }
+
+            if (benchtimes) BenchStage(Stage_Diff, t);
+
+            // apply matrix and gain to data
+            ApplyMatrixRow(w, h, y, dst);
+
+            if (benchtimes) BenchStage(Stage_Matrix, t);
+        }
+        // or just use original if no matrix
+        else {
+            CalcMagnitudeRow(pix1, pix2, w, y, dst);
+
+            if (diffgain != 1.0) {
+                const float gain = (float)diffgain;
+                for (span = span1; span < span2; span++) {
+                    for (x = span->x1; x < span->x2; x++) dst[x] *= gain;
+                }
+            }
+
+            if (benchtimes) BenchStage(Stage_Diff, t);
+        }
+
+        // find maximum difference and total for this row
+        for (span = span1; span < span2; span++) {
+            for (x = span->x1; x < span->x2; x++) {
+                rowsum += dst[x];
+                rmax    = std::max(rmax, dst[x]);
+            }
+        }
+
+        rowmax[y]     = rmax;
+        rawlevel     += rowsum;
+        maxdifference = std::max(maxdifference, (double)rmax);
+
+        if (benchtimes) BenchStage(Stage_Stats, t);
+    }
+
+    // find average and SD of values above threshold (relative to the maximum)
+    // rows that do not reach the threshold are skipped entirely
+    double avg2 = 0.0, sd2 = 0.0;
+    double thres = diffthreshold * maxdifference;
+    uint_t n = 0;
+    for (y = 0; y < h; y++) {
+        if ((double)rowmax[y] >= thres) {
+            const MASKSPAN *span = &maskspans[maskrows[y]], *end = &maskspans[maskrows[y + 1]];
+            const float *src = &difference[y * w];
+
+            for (; span < end; span++) {
+                for (x = span->x1; x < span->x2; x++) {
+                    double val = src[x];
+
+                    if (val >= thres) {
+                        // update average and SD
+                        avg2 += val;
+                        sd2  += val * val;
+                        n++;
+                    }
+                }
+            }
+        }
+    }
+
+    // calculate final average and SD
+    avg2 /= (double)n;
+    sd2   = sqrt(sd2 / (double)n - avg2 * avg2);
+
+    img2->avg      = avg2;
+    img2->sd       = sd2;
+    img2->rawlevel = rawlevel / GetLevelArea(w, h);
+    img2->diff     = 0.0;
+
+    if (benchtimes) BenchStage(Stage_Stats, t);
+}
+
+/*--------------------------------------------------------------------------------
+ * Original all double-precision version of FindDifference(), kept as
+ * the reference against which the kernel based version is verified
+ *--------------------------------------------------------------------------------*/
+void ImageDiffer::FindDifferenceReference(const IMAGE *img1, IMAGE *img2, std::vector<double>& difference)
+{
+    const AImage::PIXEL *pix1 = img1->image.GetPixelData();
+    const AImage::PIXEL *pix2 = img2->image.GetPixelData();
+    const ARect& rect = img1->rect;
+    const uint_t w = rect.w, h = rect.h, len = w * h;
+    std::vector<double> data;
+    std::vector<bool>   active;
+    double  *p;
+    double avg[3];
+    uint_t x, y, area = 0;
+
+    difference.resize(len);
+    data.resize(len * 3);
+
+    memset(avg, 0, sizeof(avg));
+
+    // masked pixels (all components zero in the mask) are excluded from everything,
+    // found directly from the resampled mask so that this is independent of the spans
+    UpdateMask(w, h);
+    active.assign(len, true);
+    if (maskimage.Valid()) {
+        const AImage::PIXEL *mask = detmaskimage.GetPixelData();
+
+        for (x = 0; x < len; x++) active[x] = ((mask[x].r | mask[x].g | mask[x].b) != 0);
+    }
+
+    // find difference between the two images and
+    // normalize against average on each line per component
+    for (y = 0, p = &data[0]; y < h; y++) {
+        double yavg[3];
+        uint_t yn = 0;
+
+        // reset average
+        memset(yavg, 0, sizeof(yavg));
+
+        // subtract pixels and update per-component average
+        for (x = 0; x < w; x++, p += 3, pix1++, pix2++) {
+            if (!active[x + y * w]) {
+                p[0] = p[1] = p[2] = 0.0;
+                continue;
+            }
+
+            p[0]     = ((double)pix1->r - (double)pix2->r) * redscale;
+            p[1]     = ((double)pix1->g - (double)pix2->g) * grnscale;
+            p[2]     = ((double)pix1->b - (double)pix2->b) * bluscale;
+
+            yavg[0] += p[0];
+            yavg[1] += p[1];
+            yavg[2] += p[2];
+            yn++;
+        }
+
+        if (yn) {
+            yavg[0] /= (double)yn;
+            yavg[1] /= (double)yn;
+            yavg[2] /= (double)yn;
+        }
+
+        // subtract average from each pixel
+        // and update total average
+        p -= 3 * w;
+        for (x = 0; x < w; x++, p += 3) {
+            if (!active[x + y * w]) continue;
+
+            p[0] -= yavg[0]; avg[0] += p[0];
+            p[1] -= yavg[1]; avg[1] += p[1];
+            p[2] -= yavg[2]; avg[2] += p[2];
+        }
+
+        area += yn;
+    }
+
+    if (area) {
+        avg[0] /= (double)area;
+        avg[1] /= (double)area;
+        avg[2] /= (double)area;
+    }
+
+    // subtract overall average from pixel data, scale by gain image and
+    // calculate modulus
+    // (gain is looked up directly from gainimage so that this is independent of weightdata)
+    static const AImage::PIXEL white = {255, 255, 255, 0};
+    const AImage::PIXEL *gainptr = gainimage.GetPixelData() ? gainimage.GetPixelData() : &white;
+    const uint_t gainwid = gainimage.GetRect().w;
+    const uint_t gainhgt = gainimage.GetRect().h;
+    double *p2;
+    for (y = 0, p = &data[0], p2 = &data[0]; y < h; y++) {
+        const uint_t y2 = std::min((y * gainhgt + h / 2) / h, gainhgt - 1);
+
+        for (x = 0; x < w; x++, p += 3, p2++) {
+            const uint_t x2 = std::min((x * gainwid + w / 2) / w, gainwid - 1);
+            const AImage::PIXEL *p3 = gainptr + x2 + y2 * gainwid;
+
+            if (!active[x + y * w]) {
+                p2[0] = 0.0;
+                continue;
+            }
+
+            p[0] -= avg[0];
+            p[1] -= avg[1];
+            p[2] -= avg[2];
+            p[0] *= (double)p3->r / 255.f;
+            p[1] *= (double)p3->g / 255.f;
+            p[2] *= (double)p3->b / 255.f;
+            p2[0] = sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        }
+    }
+
+    // find average and SD of resultant difference data with matrix applied
+    double avg2 = 0.0, sd2 = 0.0;
+    double maxdifference = 0.0;
+    uint_t mx, my, cx = (matwid - 1) >> 1, cy = (mathgt - 1) >> 1;
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            double val = 0.0;
+
+            if (!active[x + y * w]) {
+                difference[x + y * w] = 0.0;
+                continue;
+            }
+
+            // apply matrix to data
+            if (matwid && mathgt) {
+                for (my = 0; my < mathgt; my++) {
+                    if (((y + my) >= cy) && ((y + my) < (h + cy))) {
+                        for (mx = 0; mx < matwid; mx++) {
+                            if (((x + mx) >= cx) && ((x + mx) < (w + cx))) {
+                                val += matrix[mx + my * matwid] * data[(x + mx - cx) + (y + my - cy) * w];
+                            }
+                            //else debug("x: ((%u + %u) >= %u) && ((%u + %u) < (%u + %u)) failed\n", x, mx, cx, x, mx, w, cx);
+                        }
+                    }
+                    //else debug("y: ((%u + %u) >= %u) && ((%u + %u) < (%u + %u)) failed\n", y, my, cy, y, my, h, cy);
+                }
+            }
+            // or just use original if no matrix
+            else val = data[x + y * w];
+
+            val *= diffgain;
+
+            // store result in difference array
+            difference[x + y * w] = val;
+
+            // find maximum difference
+            maxdifference = std::max(maxdifference, val);
+        }
+    }
+
+    double rawlevel = 0.0;
+    double thres    = diffthreshold * maxdifference;
+    uint_t n = 0;
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            double val = difference[x + y * w];
+
+            if (!active[x + y * w]) continue;
+
+            rawlevel += val;
+            if (val >= thres) {
+                // update average and SD
+                avg2 += val;
+                sd2  += val * val;
+                n++;
+            }
+        }
+    }
+
+    // calculate final average and SD
+    avg2 /= (double)n;
+    sd2   = sqrt(sd2 / (double)n - avg2 * avg2);
+
+    img2->avg      = avg2;
+    img2->sd       = sd2;
+    img2->rawlevel = rawlevel / GetLevelArea(w, h);
+    img2->diff     = 0.0;
+}
+
+void ImageDiffer::CalcLevel(IMAGE *img2, double avg, double sd, std::vector<float>& difference)
+{
+    // calculate minimum level based on average and SD values, individual levels must exceed this
+    // (masked pixels are already zero so only the spans need to be visited)
+    const uint_t w = img2->rect.w, h = img2->rect.h;
+    double diff = avgfactor * avg + sdfactor * sd, level = 0.0, rawlevel = 0.0;
+    uint_t x, y;
+
+    // find level = sum of levels above minimum level
+    for (y = 0; y < h; y++) {
+        const MASKSPAN *span = &maskspans[maskrows[y]], *end = &maskspans[maskrows[y + 1]];
+        float *p = &difference[y * w];
+
+        for (; span < end; span++) {
+            for (x = span->x1; x < span->x2; x++) {
+                rawlevel += p[x];
+                p[x] = (float)std::max((double)p[x] - diff, 0.0);
+                level += p[x];
+            }
+        }
+    }
+
+    // divide by area of image and multiply up to make values arbitarily scaled
+    const double area = GetLevelArea(w, h);
+    rawlevel /= area;
+    level     = level * 1000.0 / area;
+
+    img2->diff     = diff;
+    img2->level    = level;
+    img2->rawlevel = rawlevel;
+}
+
+void ImageDiffer::CreateDetectionImage(const IMAGE *img1, IMAGE *img2, const std::vector<float>& difference)
+{
+    const ARect&        rect  = img2->rect;
+    const AImage::PIXEL *prev = img2->detimage.GetPixelData();
+
+    // create detection image (only re-allocated if the size has changed)
+    if (((img2->detimage.GetRect().w == rect.w) && (img2->detimage.GetRect().h == rect.h) && prev) ||
+        img2->detimage.Create(rect.w, rect.h)) {
+        const AImage::PIXEL *pixel1 = img1->image.GetPixelData();
+        const AImage::PIXEL *pixel2 = img2->image.GetPixelData();
+        AImage::PIXEL *pixel = img2->detimage.GetPixelData();
+        const uint_t  w = rect.w, h = rect.h;
+        uint_t x, y;
+
+        if (pixel != prev) CountFrameAlloc();
+        img2->detimagevalid = true;
+
+        // use individual level from above and scale and max RGB values from original images,
+        // masked pixels are black
+        for (y = 0; y < h; y++) {
+            const MASKSPAN *span = &maskspans[maskrows[y]], *end = &maskspans[maskrows[y + 1]];
+            const uint_t   row   = y * w;
+
+            for (x = 0; span < end; x = span->x2, span++) {
+                for (; x < span->x1; x++) pixel[row + x].r = pixel[row + x].g = pixel[row + x].b = 0;
+
+                for (; x < span->x2; x++) {
+                    const uint_t i = row + x;
+                    const double d = difference[i];
+
+                    pixel[i].r = (uint8_t)limit((double)std::max(pixel1[i].r, pixel2[i].r) * d / 255.0, 0.0, 255.0);
+                    pixel[i].g = (uint8_t)limit((double)std::max(pixel1[i].g, pixel2[i].g) * d / 255.0, 0.0, 255.0);
+                    pixel[i].b = (uint8_t)limit((double)std::max(pixel1[i].b, pixel2[i].b) * d / 255.0, 0.0, 255.0);
+                }
+            }
+
+            for (; x < w; x++) pixel[row + x].r = pixel[row + x].g = pixel[row + x].b = 0;
+        }
+    }
+}
+
+void ImageDiffer::__FrameAvailable(void *context)
+{
+    ImageDiffer *differ = (ImageDiffer *)context;
+
+    if (differ->scheduler) differ->scheduler->Wake(differ);
+}
+
+ImageDiffer::IMAGE *ImageDiffer::Capture(const ADateTime& dt)
+{
+    AListNode *node;
+    AString   imgfile;
+    ADateTime imgdt = dt;
+    IMAGE     *img = NULL;
+    bool      fetched = false;
+    TraceSpan capturespan("capture", index);
+
+    if (readingfromimagelist && ((node = sourceimagelist.Pop()) != NULL)) {
+        AString *str = AString::Cast(node);
+
+        if (str) {
+            imgfile = *str;
+            Log(2, "Using image '%s'", imgfile.str());
+        }
+
+        delete node;
+    }
+    else if (stream) {
+        AString error;
+
+        if (stream->GetError(error)) Log(0, "Stream '%s': %s", streamurl.str(), error.str());
+
+        // take latest frame (older frames are dropped by the stream if processing falls behind)
+        if (!stream->GetFrame(capturedata, imgdt)) return NULL;
+
+        imgfile = streamurl;
+        fetched = true;
+
+        SetStat(StatsBlock::Stat_StreamFrames,  stream->GetFrameCount());
+        SetStat(StatsBlock::Stat_StreamDropped, stream->GetDroppedCount());
+    }
+    else if (usehttpclient) {
+        // fetch straight into memory over a persistent connection
+        if ((fetched = httpclient.Get(cameraurl, capturedata, timeout * 1000)) == true) {
+            imgfile = cameraurl;
+        }
+        else if ((httpclient.GetStatus() == 401) || ((httpclient.GetStatus() >= 300) && (httpclient.GetStatus() < 400))) {
+            // the camera wants something the client cannot do (digest authentication, redirects)
+            Log(0, "Built-in HTTP client cannot fetch '%s' (%s), using wget instead", cameraurl.str(), httpclient.GetError().str());
+            httpclient.Close();
+            usehttpclient = false;
+            cmd = CreateCaptureCommand();
+            Log(0, "Capture command '%s'", cmd.str());
+
+            if (cmd.Valid() && (system(cmd) == 0)) imgfile = tempfile;
+        }
+    }
+    else if (cmd.Valid() && (system(cmd) == 0)) {
+        imgfile = tempfile;
+    }
+
+    capturespan.End();
+
+    if (imgfile.Valid()) {
+        // only the JPEG data is taken here, it is decoded by the process stage
+        if ((img = (fetched ? CaptureImage(capturedata, imgfile) : CaptureImage(imgfile))) != NULL) {
+            img->dt = imgdt;
+        }
+    }
+    else if (usehttpclient) Log(0, "Failed to fetch image from '%s': %s", cameraurl.str(), httpclient.GetError().str());
+    else Log(0, "Failed to fetch image using '%s'", cmd.str());
+
+    return img;
+}
+
+void ImageDiffer::ProcessImage(IMAGE *img)
+{
+    const IMAGE *img0 = (const IMAGE *)imglist[imglist.Count() - 1];
+
+    if (!FinishImage(img, img0)) {
+        RecycleImage(img);
+        return;
+    }
+
+    imglist.Add(img);
+
+    // strip unneeded images off start of image list
+    // need to keep at least 2 and at least predetectionimages+1 images
+    while ((imglist.Count() > 2) && (imglist.Count() > (predetectionimages + 1))) {
+        ReleaseImage((IMAGE *)imglist[0]);
+        imglist.Pop();
+    }
+
+    // only the last two images need decoded pixels (for the difference), older
+    // pre-detection images keep just their JPEG data and are decoded again if saved
+    // (unless a queued save is still using them)
+    {
+        uint_t i;
+
+        for (i = 0; (i + 2) < imglist.Count(); i++) {
+            IMAGE *oldimg = (IMAGE *)imglist[i];
+
+            if ((oldimg->refs == 1) && oldimg->image.Valid()) oldimg->image.Delete();
+        }
+    }
+
+    // if there are enough images to compare
+    if (imglist.Count() >= 2) {
+        const IMAGE *img1 = (const IMAGE *)imglist[imglist.Count() - 2];
+        IMAGE *img2       = (IMAGE       *)imglist[imglist.Count() - 1];
+        // reference is the background model (once started) or the previous frame
+        const IMAGE *ref  = BackgroundReady(img2) ? &bgframe : img1;
+
+        TraceSpan diffspan("diff", index);
+        double    coarseavg = 0.0, coarsesd = 0.0;
+        bool      coarse = false, full = !img2->prescreened;
+
+        if (img2->prescreened) {
+            // decode was skipped because nothing has changed, the level is left to settle
+            img2->avg      = slowavg;
+            img2->sd       = slowsd;
+            img2->rawlevel = 0.0;
+            img2->diff     = 0.0;
+        }
+
+        // estimate level from block means first, the full difference is only needed if
+        // the estimate is close to either threshold, in a detection or for calibration
+        // (the model has no block means so it always uses the full difference)
+        if (full && coarseblock && (ref == img1)) {
+            CalcBlockMeans(img2);
+
+            coarse = CoarseDifference(img1, img2, coarseavg, coarsesd);
+            if (coarse && coarsecalibrated && coarsecountdown && !forcesavecount && !detcount) {
+                const double avg = coarseavg * coarseavgratio, sd = coarsesd * coarsesdratio;
+                const double minthreshold = std::min(threshold, logthreshold);
+                double fa = fastavg, fs = fastsd, sa = slowavg, ss = slowsd;
+
+                FilterLevels(avg, sd, fa, fs, sa, ss);
+
+                if ((fa - avgfactor * sa - sdfactor * ss) < (minthreshold - coarsemargin * fabs(minthreshold))) {
+                    img2->avg      = avg;
+                    img2->sd       = sd;
+                    img2->rawlevel = 0.0;
+                    img2->diff     = 0.0;
+                    full = false;
+                }
+            }
+        }
+
+        // find difference between images
+        if (full) {
+            bgactive = (ref == &bgframe);
+            FindDifference(ref, img2, difference);
+            bgactive = false;
+
+            // track how the full difference relates to the coarse estimate
+            if (coarse && (coarseavg > 0.0) && (coarsesd > 0.0)) {
+                if (coarsecalibrated) {
+                    coarseavgratio += (img2->avg / coarseavg - coarseavgratio) * .1;
+                    coarsesdratio  += (img2->sd  / coarsesd  - coarsesdratio)  * .1;
+                }
+                else {
+                    coarseavgratio   = img2->avg / coarseavg;
+                    coarsesdratio    = img2->sd  / coarsesd;
+                    coarsecalibrated = true;
+                }
+            }
+
+            coarsecountdown = coarsecalibrate;
+            if (coarseblock) SetStat(StatsBlock::Stat_FullFrames, ++fullframes);
+        }
+        else if (!img2->prescreened) {
+            coarsecountdown--;
+            SetStat(StatsBlock::Stat_CoarseFrames, ++coarseframes);
+        }
+        diffspan.End();
+
+        // filter values
+        FilterLevels(img2->avg, img2->sd, fastavg, fastsd, slowavg, slowsd);
+
+        img2->fastavg = fastavg;
+        img2->fastsd  = fastsd;
+        img2->slowavg = slowavg;
+        img2->slowsd  = slowsd;
+
+        // store values in settings handler
+        SetStat(StatsBlock::Stat_FastAvg, fastavg);
+        SetStat(StatsBlock::Stat_FastSD,  fastsd);
+        SetStat(StatsBlock::Stat_SlowAvg, slowavg);
+        SetStat(StatsBlock::Stat_SlowSD,  slowsd);
+
+        //CalcLevel(img2, std::max(fastavg - slowavg, 0.0), slowsd, difference);
+
+        img2->level = fastavg - avgfactor * slowavg - sdfactor * slowsd;
+
+        const double& level = img2->level;
+        Log(1, "Level = %0.1lf, (rawlevel = %0.1lf, this frame = %0.3lf/%0.3lf, fast = %0.3lf/%0.3lf, slow = %0.3lf/%0.3lf, diff = %0.3lf)",
+            level,
+            img2->rawlevel,
+            img2->avg,
+            img2->sd,
+            fastavg,
+            fastsd,
+            slowavg,
+            slowsd,
+            img2->diff);
+
+        SetStat(StatsBlock::Stat_Level, level);
+
+        previouslevels[previouslevelindex] = level;
+        if ((++previouslevelindex) == previouslevels.size()) previouslevelindex = 0;
+
+        if (maxdelay > mindelay) UpdateDelay(level);
+
+        // effective frame rate from the capture times
+        const double interval = (double)SUBZ((uint64_t)img2->dt, (uint64_t)img1->dt);
+        frameinterval = (frameinterval > 0.0) ? (frameinterval + (interval - frameinterval) * .1) : interval;
+        if (frameinterval > 0.0) SetStat(StatsBlock::Stat_FPS, 1000.0 / frameinterval);
+
+        if (detimgdir.Valid() && full) {
+            TraceSpan span("detimage", index);
+            CreateDetectionImage(ref, img2, difference);
+        }
+
+        if (background && !img2->prescreened) {
+            TraceSpan span("background", index);
+            UpdateBackground(img2);
+        }
+
+        // should image(s) be saved?
+        if ((level >= threshold) || forcesavecount) {
+            TraceSpan span("save", index);
+            uint_t i;
+
+            // save predetectionimages plus current image from image list (if they have not already been saved)
+
+            // calculate starting position in list
+            if (imglist.Count() >= (predetectionimages + 1)) i = imglist.Count() - (predetectionimages + 1);
+            else                                             i = 0;
+
+            // save any unsaved images, including latest
+            for (; i < imglist.Count(); i++) {
+                SaveImage((IMAGE *)imglist[i]);
+                if (logdetections || (logthreshold <= threshold)) {
+                    LogDetection((IMAGE *)imglist[i]);
+                }
+            }
+
+            // if a detection has been found, force the next postdetectionimages to be saved
+            if      (level >= threshold) forcesavecount = postdetectionimages;
+            // else decrement forcesavecount
+            else if (forcesavecount)     forcesavecount--;
+        }
+
+        TraceSpan commandspan("commands", index);
+        if (level >= threshold) {
+            // start if detection?
+            if (!detcount && detstartcmd.Valid()) {
+                RunCommand(detstartcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level)), "Detection start command");
+            }
+
+            // increment detection count
+            detcount++;
+
+            // run detection command
+            if (detcmd.Valid()) {
+                RunCommand(detcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level)).SearchAndReplace("{detcount}", AString("%").Arg(detcount)), "Detection command");
+            }
+        }
+        else {
+            // if there's been some detections, run detection end command
+            if (detcount && detendcmd.Valid()) {
+                RunCommand(detendcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level)).SearchAndReplace("{detcount}", AString("%").Arg(detcount)), "Detection end command");
+            }
+
+            // reset detection count
+            detcount = 0;
+
+            // if not a detection, run non-detection command (only the latest is kept if they back up)
+            if (nodetcmd.Valid()) {
+                RunCommand(nodetcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level)), "No-detection command", true);
+            }
+        }
+        commandspan.End();
+
+        // save detection data
+        if (level >= logthreshold) {
+            LogDetection(img2);
+        }
+
+        lastdetectionlogged = img2->logged;
+    }
+
+    // the capture stage decodes every frame during detections
+    indetection = (forcesavecount || detcount);
+}
+
+void ImageDiffer::ProcessCaptured()
+{
+    AThreadLock lock(processlock);
+
+    while (true) {
+        IMAGE *img = NULL;
+        bool  wake = false;
+
+        {
+            AThreadLock plock(pipelock);
+
+            if (captured.size()) {
+                img  = captured.front();
+                captured.pop_front();
+                processing = true;
+
+                // there is room in the pipeline again
+                wake = (pipeline && capturewaiting);
+                if (wake) capturewaiting = false;
+            }
+        }
+
+        if (!img) break;
+
+        if (wake) scheduler->Wake(this, Service_Capture);
+
+        ProcessImage(img);
+
+        {
+            AThreadLock plock(pipelock);
+
+            processing = false;
+
+            // without a pipeline capture waits for the frame to be finished
+            wake = (!pipeline && capturewaiting);
+            if (wake) capturewaiting = false;
+        }
+
+        if (wake) scheduler->Wake(this, Service_Capture);
+    }
+}
+
+void ImageDiffer::SaveImage(IMAGE *img)
+{
+    // only save image(s) if not already done so
+    if (!img->saved) {
+        const ADateTime& dt = img->dt;  // filenames are made up date and time when image was created
+
+        // detect if any images *haven't* been saved
+        if ((img->imagenumber - savedimagenumber) > 1) {
+            // images not saved -> increment sequence number
+            seqno = (seqno + 1) % 1000000000;
+            SetStat(StatsBlock::Stat_SeqNo, seqno);
+            Log(0, "New sequence %09u", seqno);
+        }
+
+        // generate sequence number string for filenames
+        AString seqstr = AString("%09").Arg(seqno);
+
+        // save detection image, if possible
+        if (detimgdir.Valid() && detimgfmt.Valid() && img->detimagevalid) {
+            img->savedetfilename = detimgdir.CatPath(dt.DateFormat(detimgfmt).SearchAndReplace("{seq}", seqstr) + ".jpg");
+        }
+
+        // save main image
+        img->savefilename = imagedir.CatPath(dt.DateFormat(imagefmt).SearchAndReplace("{seq}", seqstr) + ".jpg");
+
+        Log(1, "Saving detection image in '%s'", img->savefilename.str());
+
+        // encoding and writing is done by the shared background writer
+        ImageWriter& writer = ImageWriter::Get();
+        if (!writer.Add(new SaveJob(*this, img))) {
+            Log(0, "Image writer queue full, image dropped");
+        }
+
+        // mark as saved
+        img->saved = true;
+
+        // update last saved image number
+        savedimagenumber = img->imagenumber;
+
+        ImageWriter::STATS stats = writer.GetStats();
+        SetGlobalStat("writerqueued",     stats.queued);
+        SetGlobalStat("writermaxqueued",  stats.maxqueued);
+        SetGlobalStat("writerwritten",    stats.written);
+        SetGlobalStat("writerdropped",    stats.dropped);
+        SetGlobalStat("writersync",       stats.sync);
+        SetGlobalStat("writerlatency",    stats.avglatency);
+        SetGlobalStat("writermaxlatency", stats.maxlatency);
+    }
+}
+
+ImageDiffer::SaveJob::SaveJob(ImageDiffer& _differ, IMAGE *_img) : ImageWriter::Job(&_differ),
+                                                                    differ(_differ),
+                                                                    img(_img),
+                                                                    logtarget(_differ.GetLogTarget()),
+                                                                    savemode(_differ.savemode),
+                                                                    quality(95)
+{
+    img->refs++;
 
-                    // increment detection count
-                    detcount++;
+    // mask at full resolution is needed if the image has to be decoded again (detection
+    // was done at reduced resolution or the decoded image has been released) or if the
+    // original is to be masked, it is shared rather than copied
+    if ((savemode == Save_Masked) ||
+        ((savemode == Save_Reencode) && ((img->scale > 1) || img->prescreened || !img->image.Valid()))) mask = differ.savemask;
+}
 
-                    // run detection command
-                    if (detcmd.Valid()) {
-                        AString cmd = detcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level)).SearchAndReplace("{detcount}", AString("%").Arg(detcount));
-                        if (system(cmd) != 0) {
-                            Log(0, "Detection command '%s' failed", cmd.str());
-                        }
-                    }
-                }
-                else {
-                    // if there's been some detections, run detection end command
-                    if (detcount && detendcmd.Valid()) {
-                        AString cmd = detendcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level)).SearchAndReplace("{detcount}", AString("%").Arg(detcount));
-                        if (system(cmd) != 0) {
-                            Log(0, "Detection end command '%s' failed", cmd.str());
-                        }
-                    }
+ImageDiffer::SaveJob::~SaveJob()
+{
+    ReleaseImage(img);
+}
 
-                    // reset detection count
-                    detcount = 0;
+ImageDiffer::CommandJob::CommandJob(const ImageDiffer& differ, const AString& _cmd, const char *_desc, bool _coalesce) :
+    CommandRunner::Job(&differ, _cmd, differ.cmdtimeout, _coalesce),
+    logtarget(differ.GetLogTarget()),
+    desc(_desc)
+{
+}
 
-                    // if not a detection, run non-detection command
-                    if (nodetcmd.Valid()) {
-                        AString cmd = nodetcmd.SearchAndReplace("{level}", AString("%0.4").Arg(level));
-                        if (system(cmd) != 0) {
-                            Log(0, "No-detection command '%s' failed", cmd.str());
-                        }
-                    }
-                }
+void ImageDiffer::CommandJob::Finished(int status)
+{
+    switch (status) {
+        case 0:
+        case CommandRunner::Status_Coalesced:
+            break;
+
+        case CommandRunner::Status_NotStarted:
+            LogTo(logtarget, 0, "%s '%s' could not be started", desc, cmd.str());
+            break;
+
+        case CommandRunner::Status_TimedOut:
+            LogTo(logtarget, 0, "%s '%s' timed out after %0.1lfs", desc, cmd.str(), (double)timeout / 1000.0);
+            break;
+
+        case CommandRunner::Status_Dropped:
+            LogTo(logtarget, 0, "%s '%s' dropped, command queue full", desc, cmd.str());
+            break;
+
+        default:
+            if (status > 255) LogTo(logtarget, 0, "%s '%s' failed (signal %d)", desc, cmd.str(), status - 256);
+            else              LogTo(logtarget, 0, "%s '%s' failed (exit code %d)", desc, cmd.str(), status);
+            break;
+    }
+}
 
-                // save detection data
-                if (level >= logthreshold) {
-                    LogDetection(img2);
-                }
+void ImageDiffer::RunCommand(const AString& cmd, const char *desc, bool coalesce)
+{
+    CommandJob *job;
+
+    if ((job = new CommandJob(*this, cmd, desc, coalesce)) != NULL) {
+        CommandRunner::Get().Add(job);
+    }
+}
+
+void ImageDiffer::SaveJob::Write(ImageWriter& writer)
+{
+    const TAG tags[] = {
+        {AImage::TAG_JPEG_QUALITY, quality},
+        {TAG_DONE, 0},
+    };
+    TraceSpan span("write", logtarget.index);
+
+    // save detection image, if possible
+    if (img->savedetfilename.Valid()) {
+        const AString& filename = img->savedetfilename;
+        AString dir = filename.PathPart();
+
+        if (!writer.MakeDirectory(dir)) {
+            LogTo(logtarget, 0, "Failed to create directory '%s'", dir.str());
+        }
+
+        img->detimage.SaveJPEG(filename, tags);
+    }
 
-                lastdetectionlogged = img2->logged;
+    // save main image
+    const AString& filename = img->savefilename;
+    AString dir = filename.PathPart();
+
+    if (!writer.MakeDirectory(dir)) {
+        LogTo(logtarget, 0, "Failed to create directory '%s'", dir.str());
+    }
+
+    // the differ's buffers are used for masking and decoding
+    AThreadLock lock(differ.savelock);
+    const std::vector<uint8_t> *original = NULL;
+
+    if (savemode == Save_Original) original = &img->jpeg;
+    else if (savemode == Save_Masked) {
+        // blank masked blocks of the original data, fall back to re-encoding if not possible
+        std::vector<uint8_t>& data = differ.savedata;
+        const size_t capacity = data.capacity();
+
+        if (!mask) original = &img->jpeg;
+        else if (JPEGCodec::MaskBlocks(img->jpeg, *mask, data)) original = &data;
+        else LogTo(logtarget, 1, "Unable to mask original data for '%s', re-encoding", filename.str());
+
+        if (data.capacity() != capacity) differ.CountFrameAlloc();
+    }
+
+    if (original) {
+        // write original data verbatim: no encode and no generational loss
+        if (!JPEGCodec::WriteFile(filename, *original)) {
+            LogTo(logtarget, 0, "Failed to save detection image in '%s'", filename.str());
+        }
+    }
+    else if ((img->scale > 1) || img->prescreened || !img->image.Valid()) {
+        // detection was done at reduced resolution, the image was never decoded or decoded image has been released,
+        // decode and mask full resolution image
+        AImage&              image    = differ.saveimage;
+        const AImage::PIXEL  *pixel   = image.GetPixelData();
+        const size_t         capacity = differ.saveline.capacity();
+
+        if (JPEGCodec::Decode(img->jpeg, image, 1, differ.saveline)) {
+            if (image.GetPixelData() != pixel) differ.CountFrameAlloc();
+            if (differ.saveline.capacity() != capacity) differ.CountFrameAlloc();
+
+            if (mask) image *= *mask;
+
+            if (!image.SaveJPEG(filename, tags)) {
+                LogTo(logtarget, 0, "Failed to save detection image in '%s'", filename.str());
             }
         }
+        else LogTo(logtarget, 0, "Failed to decode full resolution image for '%s'", filename.str());
+    }
+    else if (!img->image.SaveJPEG(filename, tags)) {
+        LogTo(logtarget, 0, "Failed to save detection image in '%s'", filename.str());
     }
-    else Log(0, "Failed to fetch image using '%s'", cmd.str());
 }
 
-void ImageDiffer::SaveImage(IMAGE *img)
+void ImageDiffer::LogDetection(IMAGE *img)
 {
-    // only save image(s) if not already done so
-    if (!img->saved) {
-        const ADateTime& dt = img->dt;  // filenames are made up date and time when image was created
-        const TAG tags[] = {
-            {AImage::TAG_JPEG_QUALITY, 95},
-            {TAG_DONE, 0},
-        };
-        FILE_INFO info;
+    if (detlogfmt.Valid() && !img->logged) {
+        AString filename = imagedir.CatPath(img->dt.DateFormat(detlogfmt));
+
+        if (detlogtext) {
+            static AThreadLockObject tlock;
+            AStdFile    fp;
+            AThreadLock lock(tlock);
+
+            CreateDirectory(filename.PathPart());
+            if (fp.open(filename, "a")) {
+                if (!lastdetectionlogged) fp.printf("\n");
+
+                fp.printf("%s %u %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le '%s' '%s'\n",
+                          /*  1,2 */ img->dt.DateFormat("%Y-%M-%D %h:%m:%s.%S").str(),
+                          /*  3 */ index,
+                          /*  4 */ img->avg,
+                          /*  5 */ img->sd,
+                          /*  6 */ img->fastavg,
+                          /*  7 */ img->fastsd,
+                          /*  8 */ img->slowavg,
+                          /*  9 */ img->slowsd,
+                          /* 10 */ img->diff,
+                          /* 11 */ img->level,
+                          /* 12 */ img->rawlevel,
+                          /* 13 */ threshold,
+                          /* 14 */ logthreshold,
+                          /* 15 */ img->savefilename.str(),
+                          /* 16 */ img->savedetfilename.str());
+                fp.close();
+            }
+            else if (!detlogbinary) return;
+        }
 
-        // detect if any images *haven't* been saved
-        if ((img->imagenumber - savedimagenumber) > 1) {
-            // images not saved -> increment sequence number
-            seqno = (seqno + 1) % 1000000000;
-            SetStat("seqno", seqno);
-            Log(0, "New sequence %09u", seqno);
+        if (detlogbinary) {
+            // same fields as the text log, written in batches by the shared writer
+            DetectionLog::RECORD record;
+
+            memset(&record, 0, sizeof(record));
+            record.time         = (uint64_t)img->dt;
+            record.index        = index;
+            record.flags        = lastdetectionlogged ? 0 : DetectionLog::Flag_NewSequence;
+            record.avg          = img->avg;
+            record.sd           = img->sd;
+            record.fastavg      = img->fastavg;
+            record.fastsd       = img->fastsd;
+            record.slowavg      = img->slowavg;
+            record.slowsd       = img->slowsd;
+            record.diff         = img->diff;
+            record.level        = img->level;
+            record.rawlevel     = img->rawlevel;
+            record.threshold    = threshold;
+            record.logthreshold = logthreshold;
+            if (!DetectionLog::SetFilename(record.savefilename,    img->savefilename) |
+                !DetectionLog::SetFilename(record.savedetfilename, img->savedetfilename)) {
+                record.flags |= DetectionLog::Flag_Truncated;
+            }
+
+            DetectionLog::Get().Add(filename + ".bin", record);
         }
 
-        // generate sequence number string for filenames
-        AString seqstr = AString("%09").Arg(seqno);
+        lastdetectionlogged = true;
+        img->logged = true;
+    }
+}
 
-        // save detection image, if possible
-        if (detimgdir.Valid() && detimgfmt.Valid() && img->detimage.Valid()) {
-            AString& filename = img->savedetfilename;
+void ImageDiffer::UpdateLag(uint32_t lag)
+{
+    // lag is reported as a stat every frame and summarised in the log once a minute
+    // (if it has been significant)
+    static const uint32_t reportinterval = 60000;
+    uint64_t now = (uint64_t)ADateTime();
 
-            filename = detimgdir.CatPath(dt.DateFormat(detimgfmt).SearchAndReplace("{seq}", seqstr) + ".jpg");
+    SetStat(StatsBlock::Stat_Lag, lag);
 
-            AString dir = filename.PathPart();
-            if (!GetFileInfo(dir, &info) && !CreateDirectory(dir)) {
-                Log(0, "Failed to create directory '%s'", dir.str());
-            }
+    maxlag    = std::max(maxlag, lag);
+    lagtotal += lag;
+    lagcount++;
 
-            img->detimage.SaveJPEG(filename, tags);
+    if (now >= (lagreportdt + reportinterval)) {
+        SetStat(StatsBlock::Stat_MaxLag, maxlag);
+
+        if (maxlag >= (2 * delay)) {
+            Log(0, "Lag over last %us: average %ums, maximum %ums over %u frames",
+                (uint_t)((now - lagreportdt) / 1000), (uint_t)(lagtotal / std::max(lagcount, 1U)), maxlag, lagcount);
         }
 
-        // save main image
-        AString& filename = img->savefilename;
+        maxlag      = 0;
+        lagtotal    = 0;
+        lagcount    = 0;
+        lagreportdt = now;
+    }
+}
 
-        filename = imagedir.CatPath(dt.DateFormat(imagefmt).SearchAndReplace("{seq}", seqstr) + ".jpg");
+void ImageDiffer::UpdateDelay(double level)
+{
+    // peak of the recent levels (including this one) gives the hysteresis
+    const double peak     = *std::max_element(previouslevels.begin(), previouslevels.end());
+    const uint_t olddelay = delay;
+    uint_t       newdelay = olddelay;
 
-        AString dir = filename.PathPart();
-        if (!GetFileInfo(dir, &info) && !CreateDirectory(dir)) {
-            Log(0, "Failed to create directory '%s'", dir.str());
+    if      ((level >= threshold) || forcesavecount)                  newdelay = mindelay;
+    else if (peak >= (threshold - speedupmargin  * fabs(threshold))) newdelay = std::max(olddelay / 2, mindelay);
+    else if (peak <  (threshold - slowdownmargin * fabs(threshold))) newdelay = std::min(olddelay + std::max(olddelay / 4, 1U), maxdelay);
+
+    if (newdelay != olddelay) {
+        delay = newdelay;
+        Log(1, "Capture interval %ums", newdelay);
+
+        // don't wait out the longer interval before the next capture
+        if ((newdelay < olddelay) && scheduler) scheduler->Wake(this, Service_Capture);
+    }
+}
+
+uint64_t ImageDiffer::Service(uint_t stage, uint64_t due)
+{
+    if (stage == Service_Process) {
+        TraceSpan span("process", index);
+
+        ProcessCaptured();
+
+        // until the capture stage has another frame
+        return Service_Idle;
+    }
+
+    TraceSpan span("service", index);
+
+    {
+        AThreadLock lock(pipelock);
+
+        // the rate is limited by the slower stage, the process stage wakes capture once it
+        // has taken a frame (or, without a pipeline, finished it)
+        if (pipeline ? (captured.size() >= pipeline) : (captured.size() || processing)) {
+            capturewaiting = true;
+            return Service_Idle;
         }
+    }
+
+    UpdateLag((uint32_t)SUBZ((uint64_t)ADateTime(), due));
+
+    {
+        AThreadLock lock(capturelock);
+        IMAGE *img;
+
+        if ((cmd.Valid() || usehttpclient || stream) && ((img = Capture(due)) != NULL)) {
+            {
+                AThreadLock plock(pipelock);
+                captured.push_back(img);
+            }
 
-        Log(1, "Saving detection image in '%s'", filename.str());
-        if (!img->image.SaveJPEG(filename, tags)) {
-            Log(0, "Failed to save detection image in '%s'", filename.str());
+            // decoding and everything after it is done on the process stage's pool
+            scheduler->Wake(this, Service_Process);
         }
 
-        // mark as saved
-        img->saved = true;
+        captureactive = (!readingfromimagelist || (sourceimagelist.Count() > 0));
+    }
 
-        // update last saved image number
-        savedimagenumber = img->imagenumber;
+    due += delay;
+
+    CheckSettingsUpdate();
+
+    uint_t newsettingscount = settingschangecount;
+    if (newsettingscount != settingschange) {
+        // re-configure between frames, on the capture stage since pre-URL fetches block
+        AThreadLock lock1(capturelock);
+        AThreadLock lock2(processlock);
+
+        settingschange = newsettingscount;
+        Log(0, "Re-configuring");
+
+        TraceSpan span("configure", index);
+        Configure();
+
+        due = (uint64_t)ADateTime();
     }
+
+    return due;
 }
 
-void ImageDiffer::LogDetection(IMAGE *img)
+bool ImageDiffer::IsActive(uint_t stage)
 {
-    if (detlogfmt.Valid() && !img->logged) {
-        static AThreadLockObject tlock;
-        AString     filename = imagedir.CatPath(img->dt.DateFormat(detlogfmt));
-        AStdFile    fp;
-        AThreadLock lock(tlock);
+    if (stage == Service_Capture) return captureactive;
+
+    // processing finishes once capture has and every captured frame has been processed
+    AThreadLock lock(pipelock);
+    return (captureactive || captured.size());
+}
+
+void ImageDiffer::CalcBlockMeans(IMAGE *img)
+{
+    const AImage::PIXEL *pix = img->image.GetPixelData();
+    const uint_t w  = img->rect.w, h = img->rect.h, bs = coarseblock;
+    const uint_t bw = (w + bs - 1) / bs, bh = (h + bs - 1) / bs;
+    uint_t x, y, i;
 
-        CreateDirectory(filename.PathPart());
-        if (fp.open(filename, "a")) {
-            if (!lastdetectionlogged) fp.printf("\n");
+    UpdateMask(w, h);
 
-            fp.printf("%s %u %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le %0.16le '%s' '%s'\n",
-                      /*  1,2 */ img->dt.DateFormat("%Y-%M-%D %h:%m:%s.%S").str(),
-                      /*  3 */ index,
-                      /*  4 */ img->avg,
-                      /*  5 */ img->sd,
-                      /*  6 */ img->fastavg,
-                      /*  7 */ img->fastsd,
-                      /*  8 */ img->slowavg,
-                      /*  9 */ img->slowsd,
-                      /* 10 */ img->diff,
-                      /* 11 */ img->level,
-                      /* 12 */ img->rawlevel,
-                      /* 13 */ threshold,
-                      /* 14 */ logthreshold,
-                      /* 15 */ img->savefilename.str(),
-                      /* 16 */ img->savedetfilename.str());
-            fp.close();
+    // masked pixels are excluded so that partly masked blocks are not diluted
+    AssignBuffer(coarsesums, bw * bh * 3, 0U);
+    AssignBuffer(coarsecounts, bw * bh, 0U);
+    uint32_t *sums = &coarsesums[0];
+    for (y = 0; y < h; y++) {
+        const MASKSPAN *span = &maskspans[maskrows[y]], *end = &maskspans[maskrows[y + 1]];
+        const AImage::PIXEL *p = pix + y * w;
+        const uint_t row = (y / bs) * bw;
+
+        for (; span < end; span++) {
+            for (x = span->x1; x < span->x2;) {
+                const uint_t b  = row + x / bs;
+                const uint_t x2 = std::min(span->x2, (x / bs + 1) * bs);
+                uint32_t r = 0, g = 0, bl = 0;
+
+                coarsecounts[b] += x2 - x;
+                for (; x < x2; x++) {
+                    r  += p[x].r;
+                    g  += p[x].g;
+                    bl += p[x].b;
+                }
 
-            lastdetectionlogged = true;
-            img->logged = true;
+                sums[b * 3 + 0] += r;
+                sums[b * 3 + 1] += g;
+                sums[b * 3 + 2] += bl;
+            }
         }
     }
+
+    ResizeBuffer(img->blocks, bw * bh * 3);
+    for (i = 0; i < (bw * bh); i++) {
+        const float scale = coarsecounts[i] ? 1.f / (float)coarsecounts[i] : 0.f;
+
+        img->blocks[i * 3 + 0] = (float)sums[i * 3 + 0] * scale;
+        img->blocks[i * 3 + 1] = (float)sums[i * 3 + 1] * scale;
+        img->blocks[i * 3 + 2] = (float)sums[i * 3 + 2] * scale;
+    }
 }
 
-void *ImageDiffer::Run()
+bool ImageDiffer::CoarseDifference(const IMAGE *img1, const IMAGE *img2, double& avg, double& sd)
 {
-    uint64_t dt = (uint64_t)ADateTime();
+    // same as FindDifference() (without matrix or gain image) on the block means, each
+    // block standing in for the number of active pixels in it
+    const uint_t w  = img2->rect.w, h = img2->rect.h, bs = coarseblock;
+    const uint_t bw = (w + bs - 1) / bs, bh = (h + bs - 1) / bs;
+    const uint_t n  = bw * bh;
+    double maxdifference = 0.0;
+    uint_t bx, by, i;
+
+    if ((img1->rect != img2->rect) || (img1->blocks.size() != (n * 3)) || (img2->blocks.size() != (n * 3))) return false;
+
+    ResizeBuffer(coarsemags, n);
+    for (by = 0; by < bh; by++) {
+        const float *b1 = &img1->blocks[by * bw * 3];
+        const float *b2 = &img2->blocks[by * bw * 3];
+        const uint_t *counts = &coarsecounts[by * bw];
+        double sums[3] = {0.0, 0.0, 0.0};
+        uint_t count = 0;
+
+        // subtract average difference of the row of blocks (as for each line of pixels)
+        for (bx = 0; bx < bw; bx++) {
+            sums[0] += (double)(b1[bx * 3 + 0] - b2[bx * 3 + 0]) * counts[bx];
+            sums[1] += (double)(b1[bx * 3 + 1] - b2[bx * 3 + 1]) * counts[bx];
+            sums[2] += (double)(b1[bx * 3 + 2] - b2[bx * 3 + 2]) * counts[bx];
+            count   += counts[bx];
+        }
+
+        const double offset[3] = {
+            count ? sums[0] / (double)count : 0.0,
+            count ? sums[1] / (double)count : 0.0,
+            count ? sums[2] / (double)count : 0.0,
+        };
 
-    while (!quitthread &&
-           (!readingfromimagelist || (sourceimagelist.Count() > 0))) {
-        uint64_t newdt = (uint64_t)ADateTime();
-        uint32_t lag   = (uint32_t)SUBZ(newdt, dt), diff;
+        for (bx = 0; bx < bw; bx++) {
+            const double r = ((double)(b1[bx * 3 + 0] - b2[bx * 3 + 0]) - offset[0]) * redscale;
+            const double g = ((double)(b1[bx * 3 + 1] - b2[bx * 3 + 1]) - offset[1]) * grnscale;
+            const double b = ((double)(b1[bx * 3 + 2] - b2[bx * 3 + 2]) - offset[2]) * bluscale;
+            const float  val = counts[bx] ? (float)(sqrt(r * r + g * g + b * b) * diffgain) : 0.f;
 
-        if (lag >= (2 * delay)) {
-            Log(0, "Lag:%ums", lag);
+            coarsemags[by * bw + bx] = val;
+            maxdifference = std::max(maxdifference, (double)val);
         }
+    }
 
-        SetStat("lag", lag);
+    // average and SD of values above threshold (relative to the maximum)
+    double thres = diffthreshold * maxdifference, sum = 0.0, sum2 = 0.0, count = 0.0;
+    for (i = 0; i < n; i++) {
+        const double val = coarsemags[i];
+
+        if (coarsecounts[i] && (val >= thres)) {
+            sum   += val * coarsecounts[i];
+            sum2  += val * val * coarsecounts[i];
+            count += coarsecounts[i];
+        }
+    }
 
-        newdt = (uint64_t)ADateTime();
-        diff  = (uint32_t)SUBZ(dt, newdt);
-        if (diff) Sleep(diff);
+    if (count == 0.0) return false;
 
-        if (cmd.Valid()) Process(dt);
+    avg = sum / count;
+    sd  = sqrt(std::max(sum2 / count - avg * avg, 0.0));
 
-        dt += delay;
+    return true;
+}
 
-        CheckSettingsUpdate();
+void ImageDiffer::FilterLevels(double avg, double sd, double& _fastavg, double& _fastsd, double& _slowavg, double& _slowsd) const
+{
+    // attack/decay filters, slow values never exceed the fast ones
+    if (avg >= _fastavg) _fastavg += (avg - _fastavg) * fastattcoeff;
+    else                 _fastavg += (avg - _fastavg) * fastdeccoeff;
+    if (sd  >= _fastsd)  _fastsd  += (sd  - _fastsd)  * fastattcoeff;
+    else                 _fastsd  += (sd  - _fastsd)  * fastdeccoeff;
+    if (avg >= _slowavg) _slowavg += (avg - _slowavg) * slowattcoeff;
+    else                 _slowavg += (avg - _slowavg) * slowdeccoeff;
+    if (sd  >= _slowsd)  _slowsd  += (sd  - _slowsd)  * slowattcoeff;
+    else                 _slowsd  += (sd  - _slowsd)  * slowdeccoeff;
+    _slowavg = std::min(_slowavg, _fastavg);
+    _slowsd  = std::min(_slowsd,  _fastsd);
+}
 
-        uint_t newsettingscount = settingschangecount;
-        if (newsettingscount != settingschange) {
-            settingschange = newsettingscount;
-            Log(0, "Re-configuring");
-            Configure();
+bool ImageDiffer::BackgroundReady(const IMAGE *img) const
+{
+    return (background && bgframes && !(bgframe.rect != img->rect));
+}
 
-            dt = (uint64_t)ADateTime();
+void ImageDiffer::UpdateBackground(const IMAGE *img)
+{
+    // the model is kept at detection resolution as three planes (r, g, b) per row like weightdata:
+    // mean is 8.8 fixed point and var 12.4 fixed point (saturating at 4096 levels^2), both
+    // exponentially weighted with a rate of 1/2^bgshift
+    // the weights used against the model are weightdata scaled by noise / sd (up to unity)
+    const AImage::PIXEL *pix = img->image.GetPixelData();
+    const uint_t w = img->rect.w, h = img->rect.h;
+    uint_t y;
+
+    if (!pix) return;
+
+    UpdateMask(w, h);
+
+    if (!bgframes || (bgframe.rect != img->rect)) {
+        // (re)start model from this frame with a deviation that gives full weight
+        const uint16_t var = (uint16_t)std::min(bgnoise * bgnoise * 16.f, 65535.f);
+        uint_t x;
+
+        ResizeBuffer(bgmean, w * h * 3);
+        AssignBuffer(bgvar, w * h * 3, var);
+        ResizeBuffer(bgweightdata, w * h * 3);
+        if (weightdata.size()) bgweightdata = weightdata;
+        else                   bgweightdata.assign(w * h * 3, 255);
+
+        for (y = 0; y < h; y++) {
+            const AImage::PIXEL *p = pix + y * w;
+            uint16_t *mean = &bgmean[y * w * 3];
+
+            for (x = 0; x < w; x++) {
+                mean[x]         = (uint16_t)(p[x].r << 8);
+                mean[x + w]     = (uint16_t)(p[x].g << 8);
+                mean[x + w * 2] = (uint16_t)(p[x].b << 8);
+            }
         }
+
+        bgframe.image = img->image;
+        bgframe.rect  = img->rect;
+        bgframes      = 1;
+        return;
     }
 
-    differsrunning--;
+    AImage::PIXEL *bg = bgframe.image.GetPixelData();
 
-    return NULL;
+    // only active pixels are updated, the rest have zero weight
+    for (y = 0; y < h; y++) {
+        const MASKSPAN *span1 = &maskspans[maskrows[y]], *span2 = &maskspans[maskrows[y + 1]], *span;
+        const uint_t   row    = y * w * 3;
+
+        for (span = span1; span < span2; span++) {
+            kernels->RowBackground(pix + y * w + span->x1, span->x2 - span->x1, bgshift, bgnoise,
+                                   &bgmean[row + span->x1], &bgvar[row + span->x1],
+                                   weightdata.size() ? &weightdata[row + span->x1] : NULL,
+                                   &bgweightdata[row + span->x1], w,
+                                   bg + y * w + span->x1);
+        }
+    }
+
+    bgframes++;
 }
 
 void ImageDiffer::Compare(const char *file1, const char *file2, const char *outfile)
@@ -961,8 +2597,6 @@ void ImageDiffer::Compare(const char *file1, const char *file2, const char *outf
 
     if ((img1 = CreateImage(file1)) != NULL) {
         if ((img2 = CreateImage(file2)) != NULL) {
-            std::vector<double> difference;
-
             // find difference between images
             FindDifference(img1, img2, difference);
 
@@ -992,3 +2626,288 @@ void ImageDiffer::Compare(const char *file1, const char *file2, const char *outf
     }
     else debug("Failed to load image '%s'\n", file1);
 }
+
+bool ImageDiffer::Verify(const char *file1, const char *file2)
+{
+    // kernel results must match the double-precision reference to within this relative tolerance
+    static const double tolerance = 1.0e-4;
+    const DiffKernels *oldkernels = kernels;
+    IMAGE *img1, *img2;
+    bool  success = false;
+
+    if ((img1 = CreateImage(file1)) != NULL) {
+        if ((img2 = CreateImage(file2)) != NULL) {
+            std::vector<double> refdifference;
+            double avg, sd, rawlevel;
+            uint_t level, bestlevel = DiffKernels::Get().level;
+
+            FindDifferenceReference(img1, img2, refdifference);
+            avg      = img2->avg;
+            sd       = img2->sd;
+            rawlevel = img2->rawlevel;
+
+            printf("reference: avg = %0.9le, sd = %0.9le, rawlevel = %0.9le\n", avg, sd, rawlevel);
+
+            success = true;
+            for (level = DiffKernels::Level_Scalar; level <= bestlevel; level++) {
+                kernels = &DiffKernels::Get(level);
+
+                FindDifference(img1, img2, difference);
+
+                double err = std::max(std::max(fabs(img2->avg - avg) / std::max(fabs(avg), 1.0e-9),
+                                               fabs(img2->sd  - sd)  / std::max(fabs(sd),  1.0e-9)),
+                                      fabs(img2->rawlevel - rawlevel) / std::max(fabs(rawlevel), 1.0e-9));
+                bool   ok  = (err <= tolerance);
+
+                printf("%9s: avg = %0.9le, sd = %0.9le, rawlevel = %0.9le, max relative error %0.3le: %s\n",
+                       kernels->name, img2->avg, img2->sd, img2->rawlevel, err, ok ? "pass" : "FAIL");
+
+                success &= ok;
+            }
+
+            kernels = oldkernels;
+
+            delete img2;
+        }
+        else debug("Failed to load image '%s'\n", file2);
+
+        delete img1;
+    }
+    else debug("Failed to load image '%s'\n", file1);
+
+    return success;
+}
+
+bool ImageDiffer::Fetch(uint_t count)
+{
+    // fetch and decode count frames from the camera, reporting how long each took
+    uint_t i, nfetched = 0;
+
+    for (i = 0; i < count; i++) {
+        uint64_t t0 = (uint64_t)ADateTime();
+        bool     success;
+        AString  error;
+
+        if (stream) {
+            ADateTime dt;
+
+            // wait for next frame from stream
+            while (!(success = stream->GetFrame(capturedata, dt)) && (((uint64_t)ADateTime() - t0) < (timeout * 1000))) {
+                Sleep(10);
+            }
+            if (!success && !stream->GetError(error)) error = "timeout waiting for frame";
+        }
+        else if (usehttpclient) {
+            success = httpclient.Get(cameraurl, capturedata, timeout * 1000);
+            error   = httpclient.GetError();
+        }
+        else if ((success = (cmd.Valid() && (system(cmd) == 0) && JPEGCodec::ReadFile(tempfile, capturedata))) == false) {
+            error = "capture command failed";
+        }
+
+        uint64_t t1 = (uint64_t)ADateTime();
+        AImage   image;
+
+        if (success && !(success = JPEGCodec::Decode(capturedata, image, detectscale))) {
+            error = "failed to decode image";
+        }
+
+        uint64_t t2 = (uint64_t)ADateTime();
+
+        if (success) {
+            printf("%u: fetched %u bytes in %ums, decoded %dx%d in %ums (%u connections, %u frames dropped)\n",
+                   i, (uint_t)capturedata.size(), (uint_t)(t1 - t0), image.GetRect().w, image.GetRect().h, (uint_t)(t2 - t1),
+                   httpclient.GetConnections(), stream ? stream->GetDroppedCount() : 0);
+            nfetched++;
+        }
+        else printf("%u: failed after %ums: %s\n", i, (uint_t)(t2 - t0), error.str());
+    }
+
+    return (nfetched == count);
+}
+
+uint64_t ImageDiffer::GetMonotonicTimeNS()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void ImageDiffer::BenchFiles(const std::vector<AString>& files, const AString& savedir, std::vector<STAGETIMES>& times)
+{
+    const TAG tags[] = {
+        {AImage::TAG_JPEG_QUALITY, 95},
+        {TAG_DONE, 0},
+    };
+    IMAGE  *img1 = NULL;
+    size_t i;
+
+    for (i = 0; i < files.size(); i++) {
+        STAGETIMES stagetimes;
+        IMAGE      *img2;
+
+        // reading the file is not part of any stage
+        if (!JPEGCodec::ReadFile(files[i], capturedata)) {
+            fprintf(stderr, "Failed to read image '%s'\n", files[i].str());
+            continue;
+        }
+
+        const uint_t allocs = frameallocs;
+
+        memset(&stagetimes, 0, sizeof(stagetimes));
+        benchtimes = &stagetimes;
+
+        if ((img2 = CreateImage(capturedata, files[i], img1)) != NULL) {
+            if (img1 && (img1->rect == img2->rect)) {
+                FindDifference(img1, img2, difference);
+
+                uint64_t t = GetMonotonicTimeNS();
+
+                CalcLevel(img2, img2->avg, img2->sd, difference);
+                BenchStage(Stage_Stats, t);
+
+                // detection image is always created, only encoded and written if a directory was given
+                CreateDetectionImage(img1, img2, difference);
+                if (savedir.Valid()) {
+                    AString filename = savedir.CatPath(files[i].FilePart());
+
+                    if (!img2->detimage.SaveJPEG(filename, tags)) fprintf(stderr, "Failed to save detection image in '%s'\n", filename.str());
+                }
+                BenchStage(Stage_Encode, t);
+
+                stagetimes.allocs = frameallocs - allocs;
+                times.push_back(stagetimes);
+            }
+
+            if (img1) ReleaseImage(img1);
+            img1 = img2;
+        }
+
+        benchtimes = NULL;
+    }
+
+    if (img1) ReleaseImage(img1);
+}
+
+void *ImageDiffer::BenchWorker::Run()
+{
+    differ.BenchFiles(files, savedir, times);
+    done = true;
+
+    return NULL;
+}
+
+bool ImageDiffer::Bench(uint_t index, const AString& dir, uint_t nthreads, const AString& savedir)
+{
+    extern AQuitHandler quithandler;
+    static const char *stagenames[Stage_Count] = {
+        "decode",
+        "mask",
+        "diff",
+        "matrix",
+        "stats",
+        "encode",
+    };
+    std::vector<AString> files;
+    AList     list;
+    AListNode *node;
+    size_t    i;
+
+    CollectFiles(dir, "*.jpg", RECURSE_ALL_SUBDIRS, list, FILE_FLAG_IS_DIR, 0, &quithandler);
+    while ((node = list.Pop()) != NULL) {
+        AString *str = AString::Cast(node);
+
+        if (str) files.push_back(*str);
+
+        delete node;
+    }
+    std::sort(files.begin(), files.end());
+
+    if (files.size() < 2) {
+        fprintf(stderr, "Need at least two images in '%s', found %u\n", dir.str(), (uint_t)files.size());
+        return false;
+    }
+
+    // 0 threads = one per core, each thread needs at least a pair of images
+    if (!nthreads) nthreads = std::max(std::thread::hardware_concurrency(), 1U);
+    nthreads = std::max(std::min(nthreads, (uint_t)(files.size() / 2)), 1U);
+
+    printf("Replaying %u images from '%s' on %u thread(s)...\n", (uint_t)files.size(), dir.str(), nthreads);
+
+    // each thread takes a contiguous run of the images with its own copy of the differ
+    std::vector<ImageDiffer *> differs;
+    std::vector<BenchWorker *> workers;
+    for (i = 0; i < nthreads; i++) {
+        std::vector<AString> run(files.begin() + (i * files.size()) / nthreads,
+                                 files.begin() + ((i + 1) * files.size()) / nthreads);
+        ImageDiffer *differ = new ImageDiffer(index, true);
+
+        differs.push_back(differ);
+        workers.push_back(new BenchWorker(*differ, run, savedir));
+    }
+
+    uint64_t t0 = GetMonotonicTimeNS();
+
+    for (i = 0; i < workers.size(); i++) workers[i]->Start();
+    for (i = 0; i < workers.size(); i++) {
+        while (!workers[i]->IsDone()) Sleep(10);
+    }
+
+    uint64_t t1 = GetMonotonicTimeNS();
+
+    std::vector<uint64_t> stagetimes[Stage_Count], totals;
+    uint_t allocs = 0, steadyallocs = 0;
+    for (i = 0; i < workers.size(); i++) {
+        const std::vector<STAGETIMES>& times = workers[i]->GetTimes();
+        size_t j;
+        uint_t k;
+
+        for (j = 0; j < times.size(); j++) {
+            uint64_t total = 0;
+
+            // the first few frames of each run fill the image pool
+            allocs += times[j].allocs;
+            if (j >= 2) steadyallocs += times[j].allocs;
+
+            for (k = 0; k < Stage_Count; k++) {
+                stagetimes[k].push_back(times[j].t[k]);
+                total += times[j].t[k];
+            }
+
+            totals.push_back(total);
+        }
+
+        delete workers[i];
+        delete differs[i];
+    }
+
+    const size_t n = totals.size();
+    if (!n) {
+        fprintf(stderr, "No frames processed\n");
+        return false;
+    }
+
+    printf("%u frames in %0.3lfs: %0.1lf frames/s\n", (uint_t)n, (double)(t1 - t0) * 1.0e-9, (double)n * 1.0e9 / (double)(t1 - t0));
+    printf("%-8s %10s %10s %10s\n", "stage", "mean(us)", "p50(us)", "p99(us)");
+
+    uint_t k;
+    for (k = 0; k <= Stage_Count; k++) {
+        std::vector<uint64_t>& times = (k < Stage_Count) ? stagetimes[k] : totals;
+        uint64_t sum = 0;
+
+        for (i = 0; i < n; i++) sum += times[i];
+        std::sort(times.begin(), times.end());
+
+        printf("%-8s %10.1lf %10.1lf %10.1lf\n",
+               (k < Stage_Count) ? stagenames[k] : "total",
+               (double)sum * 1.0e-3 / (double)n,
+               (double)times[n / 2] * 1.0e-3,
+               (double)times[std::min((n * 99) / 100, n - 1)] * 1.0e-3);
+    }
+
+    printf("%u frame buffer allocations, %u after the first 3 frames of each thread\n", allocs, steadyallocs);
+
+    return true;
+}
@@ -2,6 +2,9 @@
 #define __IMAGE_DIFFER__
 
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <memory>
 
 #include <rdlib/strsup.h>
 #include <rdlib/DataList.h>
@@ -11,29 +14,91 @@
 #include <rdlib/Thread.h>
 #include <rdlib/ThreadLock.h>
 
-class ImageDiffer : public AThread {
+#include "DiffKernels.h"
+#include "JPEGCodec.h"
+#include "HTTPClient.h"
+#include "MJPEGStream.h"
+#include "ImageWriter.h"
+#include "StatsFlusher.h"
+#include "SettingsSnapshot.h"
+#include "LogWriter.h"
+#include "CommandRunner.h"
+
+class DifferScheduler;
+
+class ImageDiffer {
 public:
-    ImageDiffer(uint_t _index);
+    // a replay differ (used by -bench) only runs the detection stages on images it is
+    // given: it starts no streams or pre-URL fetches, registers no stats, does not log
+    // and leaves the live source's temporary file alone
+    ImageDiffer(uint_t _index, bool _replay = false);
     ~ImageDiffer();
 
     void Compare(const char *file1, const char *file2, const char *outfile);
+    bool Verify(const char *file1, const char *file2);
+    bool Fetch(uint_t count);
+
+    // replay JPEGs in dir through the detection stages (no delay, saving, logging or commands)
+    // on nthreads copies of differ <index> and report frame rate and per-stage times
+    static bool Bench(uint_t index, const AString& dir, uint_t nthreads = 1, const AString& savedir = "");
 
     static AString GetGlobalSetting(const AString& name, const AString& defval = "");
 
+    // watch the settings file for changes (using inotify) rather than polling it
+    static bool WatchSettings(bool enable);
+
+    // re-read settings file and publish a new snapshot for all sources
+    static void ReloadSettings();
+
     static void Delete(uptr_t item, void *context) {
         UNUSED(context);
         delete (ImageDiffer *)item;
     }
 
-    static uint_t DiffersRunning() {return differsrunning;}
+    // set scheduler to wake when new frames arrive from a stream
+    void SetScheduler(DifferScheduler *_scheduler) {scheduler = _scheduler;}
+
+    // a source runs as two stages so that capturing (fetching the JPEG data, which may block
+    // on the camera) the next frame overlaps processing (decoding, differencing, saving,
+    // commands) the last, frames are processed in the order they were captured and capture
+    // stops whilst the pipeline is full
+    enum {
+        Service_Capture = 0,
+        Service_Process,
+    };
+    static const uint64_t Service_Idle = ~(uint64_t)0;
+
+    // run one cycle of stage due at time due (ms), returns time next cycle is due
+    // (Service_Idle until woken by the scheduler)
+    uint64_t Service(uint_t stage, uint64_t due);
+
+    // false once stage has no more work to do (e.g. image list has been exhausted)
+    bool IsActive(uint_t stage);
 
 protected:
+    enum {
+        Matrix_None = 0,
+        Matrix_General,
+        Matrix_Separable,
+        Matrix_Box,
+    };
+
+    enum {
+        Save_Reencode = 0,      // re-encode decoded, masked image
+        Save_Original,          // write original JPEG data verbatim
+        Save_Masked,            // write original JPEG data with fully masked blocks blanked (losslessly)
+    };
+
     typedef struct {
         AString   filename;
         AString   savedetfilename;
         AString   savefilename;
-        AImage    image;
+        std::vector<uint8_t> jpeg;     // original JPEG data
+        AImage    image;               // decoded at 1/scale resolution and masked
+        uint_t    scale;
         AImage    detimage;
+        bool      detimagevalid;       // detimage is for this frame
+        std::vector<float> blocks;     // mean r, g, b of the active pixels of each block (coarse mode)
         ARect     rect;
         ADateTime dt;
         double    avg;
@@ -46,23 +111,175 @@ protected:
         double    slowavg;
         double    slowsd;
         uint_t    imagenumber;
+        bool      prescreened;         // not decoded, image holds the previous frame's pixels
         bool      saved;
         bool      logged;
+        std::atomic<uint_t> refs;      // image list and queued save jobs
+        ImageDiffer *owner;            // differ whose pool the image returns to, NULL to delete
     } IMAGE;
 
+    static void ReleaseImage(IMAGE *img) {
+        if (--img->refs == 0) {
+            if (img->owner) img->owner->RecycleImage(img);
+            else            delete img;
+        }
+    }
+
     static void __DeleteImage(uptr_t item, void *context) {
         UNUSED(context);
 
-        delete (IMAGE *)item;
+        ReleaseImage((IMAGE *)item);
     }
 
+    // copy of what is needed to log from threads other than the differ's
+    typedef struct {
+        AString logpath;
+        uint_t  index;
+        uint_t  verbose;
+        uint_t  verbose2;
+    } LOGTARGET;
+
+    // background save of an image (and its detection image)
+    class SaveJob : public ImageWriter::Job {
+    public:
+        SaveJob(ImageDiffer& _differ, IMAGE *_img);
+        virtual ~SaveJob();
+
+        virtual void Write(ImageWriter& writer);
+
+    protected:
+        ImageDiffer& differ;        // differs flush their jobs before being destroyed
+        IMAGE        *img;
+        LOGTARGET    logtarget;
+        std::shared_ptr<const AImage> mask;     // only needed if the full resolution image has to be decoded or masked
+        uint_t       savemode;
+        uint_t       quality;
+    };
+    friend class SaveJob;
+
+    // detection command run by the shared command runner (failures are logged)
+    class CommandJob : public CommandRunner::Job {
+    public:
+        CommandJob(const ImageDiffer& differ, const AString& _cmd, const char *_desc, bool _coalesce);
+        virtual ~CommandJob() {}
+
+        virtual void Finished(int status);
+
+    protected:
+        LOGTARGET  logtarget;
+        const char *desc;
+    };
+    friend class CommandJob;
+
+    void RunCommand(const AString& cmd, const char *desc, bool coalesce = false);
+
+    static void __FrameAvailable(void *context);
+
+    // stages timed by -bench
+    enum {
+        Stage_Decode = 0,
+        Stage_Mask,
+        Stage_Diff,
+        Stage_Matrix,
+        Stage_Stats,
+        Stage_Encode,
+
+        Stage_Count,
+    };
+
+    typedef struct {
+        uint64_t t[Stage_Count];    // ns
+        uint_t   allocs;            // frame buffers allocated
+    } STAGETIMES;
+
+    class BenchWorker : public AThread {
+    public:
+        BenchWorker(ImageDiffer& _differ, const std::vector<AString>& _files, const AString& _savedir) :
+            AThread(),
+            differ(_differ),
+            files(_files),
+            savedir(_savedir),
+            done(false) {}
+        virtual ~BenchWorker() {Stop();}
+
+        bool IsDone() const {return done;}
+        const std::vector<STAGETIMES>& GetTimes() const {return times;}
+
+    protected:
+        virtual void *Run();
+
+    protected:
+        ImageDiffer&            differ;
+        std::vector<AString>    files;
+        AString                 savedir;
+        std::vector<STAGETIMES> times;
+        volatile bool           done;
+    };
+    friend class BenchWorker;
+
+    static uint64_t GetMonotonicTimeNS();
+    void BenchStage(uint_t stage, uint64_t& t) {
+        uint64_t t1 = GetMonotonicTimeNS();
+        benchtimes->t[stage] += t1 - t;
+        t = t1;
+    }
+    void BenchFiles(const std::vector<AString>& files, const AString& savedir, std::vector<STAGETIMES>& times);
+
+    // run of active (unmasked) pixels x1 <= x < x2 on a row
+    typedef struct {
+        uint_t x1, x2;
+    } MASKSPAN;
+
+    static void ResampleImage(const AImage& src, AImage& dst, uint_t w, uint_t h);
+    void UpdateMask(uint_t w, uint_t h);
+    void ApplyMask(AImage& image);
+    // area levels are divided by (the whole frame unless levelsbyactivearea is set)
+    double GetLevelArea(uint_t w, uint_t h) const;
+    void ClearMaskGaps(float *dst, uint_t w, uint_t y) const;
+
+    void CountFrameAlloc() {SetStat(StatsBlock::Stat_FrameAllocs, ++frameallocs);}
+    // resize (or fill) a buffer used every frame, counting re-allocations
+    template<typename T>
+    void ResizeBuffer(std::vector<T>& buf, size_t n) {
+        if (n > buf.capacity()) CountFrameAlloc();
+        buf.resize(n);
+    }
+    template<typename T>
+    void AssignBuffer(std::vector<T>& buf, size_t n, const T& val) {
+        if (n > buf.capacity()) CountFrameAlloc();
+        buf.assign(n, val);
+    }
+
+    IMAGE *NewImage();
+    void RecycleImage(IMAGE *img);
+    bool PrescreenImage(const std::vector<uint8_t>& jpeg);
+    // take the frame's JPEG data only (on the capture stage), FinishImage() does the rest
+    IMAGE *CaptureImage(const char *filename);
+    IMAGE *CaptureImage(std::vector<uint8_t>& data, const char *filename);
+    // decode frame unless prescreened
+    bool DecodeImage(IMAGE *img);
+    // decode and mask frame or, if prescreened, take the pixels of img0 (the previous frame)
+    bool FinishImage(IMAGE *img, const IMAGE *img0);
     IMAGE *CreateImage(const char *filename, const IMAGE *img0 = NULL);
+    IMAGE *CreateImage(std::vector<uint8_t>& data, const char *filename, const IMAGE *img0 = NULL);
     void SaveImage(IMAGE *img);
     void LogDetection(IMAGE *img);
 
-    void FindDifference(const IMAGE *img1, IMAGE *img2, std::vector<double>& difference);
-    void CalcLevel(IMAGE *img2, double avg, double sd, std::vector<double>& difference);
-    void CreateDetectionImage(const IMAGE *img1, IMAGE *img2, const std::vector<double>& difference);
+    void UpdateWeightData(uint_t w, uint_t h);
+    void ScaleMatrix(uint_t scale);
+    void AnalyseMatrix();
+    void CalcInputRow(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t w, uint_t y);
+    void ApplyMatrixRow(uint_t w, uint_t h, uint_t y, float *dst);
+    void CalcMagnitudeRow(const AImage::PIXEL *pix1, const AImage::PIXEL *pix2, uint_t w, uint_t y, float *dst);
+    void FindDifference(const IMAGE *img1, IMAGE *img2, std::vector<float>& difference);
+    void FindDifferenceReference(const IMAGE *img1, IMAGE *img2, std::vector<double>& difference);
+    void CalcLevel(IMAGE *img2, double avg, double sd, std::vector<float>& difference);
+    void CreateDetectionImage(const IMAGE *img1, IMAGE *img2, const std::vector<float>& difference);
+    void CalcBlockMeans(IMAGE *img);
+    bool CoarseDifference(const IMAGE *img1, const IMAGE *img2, double& avg, double& sd);
+    void FilterLevels(double avg, double sd, double& _fastavg, double& _fastsd, double& _slowavg, double& _slowsd) const;
+    bool BackgroundReady(const IMAGE *img) const;
+    void UpdateBackground(const IMAGE *img);
 
     bool SettingExists(const AString& name) const;
     AString GetSetting(const AString& name, const AString& defval = "") const;
@@ -72,19 +289,25 @@ protected:
     template<typename T>
     void    GetStat(const AString& name, T& val) {val = (T)GetStat(name);}
 
-    void    SetStat(const AString& name, double val);
-    void    SetStat(const AString& name, uint_t val);
+    void    SetStat(uint_t stat, double val);
+    static void SetGlobalStat(const AString& name, uint_t val);
 
     void Configure();
 
     AString CreateWGetCommand(const AString& url);
     AString CreateCaptureCommand();
-    void Process(const ADateTime& dt);
+    IMAGE *Capture(const ADateTime& dt);
+    void ProcessImage(IMAGE *img);
+    void ProcessCaptured();
 
-    virtual void *Run();
+    void UpdateLag(uint32_t lag);
+    void UpdateDelay(double level);
 
     void Log(uint_t level, const char *fmt, ...);
     void Log(uint_t level, const char *fmt, va_list ap);
+    LOGTARGET GetLogTarget() const;
+    static void LogTo(const LOGTARGET& target, uint_t level, const char *fmt, ...);
+    static void LogTo(const LOGTARGET& target, uint_t level, const char *fmt, va_list ap);
 
     AString FindFile(const AString& filename) const;
 
@@ -103,13 +326,19 @@ protected:
     };
 
     static ProtectedSettings& GetSettings();
-    static ProtectedSettings& GetStats();
+    static SettingsSnapshot::PTR GetSnapshot();
+    static void __SettingsChanged(void *context);
 
 protected:
     uint_t                  index;
+    bool                    replay;
     ADataList               imglist;
     AString                 logpath;
-    uint_t                  delay;
+    std::atomic<uint_t>     delay;              // current capture interval (ms)
+    uint_t                  mindelay, maxdelay; // bounds of an adaptive capture interval (ms)
+    double                  speedupmargin;
+    double                  slowdownmargin;
+    double                  frameinterval;      // average interval between frames processed (ms)
     AString                 name;
     AString                 wgetargs;
     AString                 cameraurl;
@@ -118,6 +347,12 @@ protected:
     AString                 capturecmd;
     AString                 tempfile;
     AString                 cmd;
+    HTTPClient              httpclient;
+    std::vector<uint8_t>    capturedata;
+    bool                    usehttpclient;
+    AString                 streamurl;
+    MJPEGStream             *stream;
+    DifferScheduler         *scheduler;
     AString                 imagedir;
     AString                 imagefmt;
     AString                 detlogfmt;
@@ -125,13 +360,25 @@ protected:
     AString                 detimgfmt;
     AString                 detcmd;
     AString                 nodetcmd;
+    uint32_t                cmdtimeout;
     AString                 detstartcmd;
     AString                 detendcmd;
     AImage                  maskimage;
+    AImage                  detmaskimage;
+    std::vector<MASKSPAN>   maskspans;
+    std::vector<uint_t>     maskrows;
+    uint_t                  maskwid, maskhgt;
+    uint_t                  maskarea;
+    bool                    maskpartial;
+    bool                    levelsbyactivearea;
     AImage                  gainimage;
     AList                   sourceimagelist;
     bool                    readingfromimagelist;
-    std::vector<double>     gaindata;
+    std::vector<uint8_t>    weightdata;
+    std::vector<float>      difference;
+    std::vector<float>      magrows;
+    std::vector<float>      rowmax;
+    const DiffKernels       *kernels;
     double                  fastattcoeff;
     double                  fastdeccoeff;
     double                  slowattcoeff;
@@ -150,13 +397,72 @@ protected:
     double                  threshold;
     double                  logthreshold;
     std::vector<double>     matrix;
+    std::vector<double>     matrixrow;
+    std::vector<double>     matrixcol;
+    std::vector<double>     matrixacc;
+    std::vector<double>     matrixcolsum;
+    uint_t                  matrixtype;
     std::vector<double>     previouslevels;
     size_t                  previouslevelindex;
     uint_t                  predetectionimages;
     uint_t                  postdetectionimages;
     uint_t                  forcesavecount;
     uint_t                  detcount;
+    uint_t                  coarseblock;        // block size for coarse estimates, 0 to always do the full difference
+    double                  coarsemargin;
+    uint_t                  coarsecalibrate;
+    uint_t                  coarsecountdown;
+    double                  coarseavgratio;     // full / coarse avg and sd, measured on full frames
+    double                  coarsesdratio;
+    bool                    coarsecalibrated;
+    std::vector<uint_t>     coarsecounts;
+    std::vector<uint32_t>   coarsesums;
+    std::vector<float>      coarsemags;
+    uint_t                  coarseframes;
+    uint_t                  fullframes;
+    bool                    background;         // compare against a per-pixel background model rather than the previous frame
+    uint_t                  bgshift;            // model moves 1/2^bgshift of the way towards each frame
+    float                   bgnoise;            // deviation (levels) up to which pixels have full weight
+    uint_t                  bgframes;           // frames in the model, 0 to restart it
+    bool                    bgactive;           // FindDifference() is comparing against the model
+    std::vector<uint16_t>   bgmean;             // 8.8 fixed point, planes as weightdata
+    std::vector<uint16_t>   bgvar;              // 12.4 fixed point levels^2, planes as weightdata
+    std::vector<uint8_t>    bgweightdata;       // weightdata reduced where the model is noisy
+    IMAGE                   bgframe;            // rounded model mean
+    double                  prescreen;          // block level change below which decodes are skipped, 0 to disable
+    uint_t                  prescreencoefs;     // coefficients per block compared
+    uint_t                  prescreenmax;       // maximum consecutive skipped decodes
+    uint_t                  prescreencountdown;
+    std::vector<sint_t>     prescreenref;       // luma coefficients of the last decoded frame
+    std::vector<sint_t>     prescreennew;
+    std::vector<uint8_t>    prescreenactive;    // blocks not entirely masked
+    uint_t                  prescreenbw, prescreenbh;
+    double                  decodetime;         // average decode and mask time (ms)
+    double                  prescreensaved;     // net time saved (ms)
+    uint_t                  prescreenskipped;
+    AThreadLockObject       poollock;           // images are also released by the writer thread
+    std::vector<IMAGE *>    imagepool;          // released images with their buffers
+    uint_t                  poolsize;           // images kept in the pool, 0 to free released images
+    size_t                  capturecapacity;    // capacity of the buffer last handed back for capture
+    std::atomic<uint_t>     frameallocs;        // allocations of per-frame buffers (not libjpeg's or rdlib's working memory)
+    std::vector<uint8_t>    decodeline;         // decode scratch row
+    std::shared_ptr<const AImage> savemask;     // full resolution mask shared (read-only) by save jobs
+    AThreadLockObject       savelock;           // save jobs run on the writer thread or, on overflow, the caller's
+    AImage                  saveimage;          // full resolution decode for saving
+    std::vector<uint8_t>    savedata;           // masked original data for saving
+    std::vector<uint8_t>    saveline;
+    AThreadLockObject       capturelock;        // held by the capture stage, re-configuration holds capture off
+    AThreadLockObject       processlock;        // held whilst processing frames
+    AThreadLockObject       pipelock;
+    std::deque<IMAGE *>     captured;           // captured frames waiting to be processed, oldest first
+    uint_t                  pipeline;           // frames that can be captured ahead of processing, 0 to capture and process in turn
+    bool                    capturewaiting;     // capture stopped until the process stage takes (or, without a pipeline, finishes) a frame
+    bool                    processing;         // process stage has taken a frame it has not finished
+    std::atomic<bool>       captureactive;
+    std::atomic<bool>       indetection;        // detection (or post-detection saving) in progress
     uint_t                  matwid, mathgt;
+    uint_t                  detectscale;
+    uint_t                  savemode;
     uint_t                  settingschange;
     uint_t                  verbose;
     uint_t                  verbose2;
@@ -164,11 +470,22 @@ protected:
     uint_t                  imagenumber;
     uint_t                  savedimagenumber;
     uint_t                  seqno;
+    uint32_t                maxlag;
+    uint64_t                lagtotal;
+    uint_t                  lagcount;
+    uint64_t                lagreportdt;
     bool                    logdetections;
     bool                    lastdetectionlogged;
+    bool                    detlogtext;
+    bool                    detlogbinary;
+    STAGETIMES              *benchtimes;        // only set by -bench
+    StatsBlock              statsblock;
+
+    SettingsSnapshot::PTR   snapshot;
+    SourceSettings::PTR     sourcesettings;
 
-    static uint_t           settingschangecount;
-    static uint_t           differsrunning;
+    static std::atomic<uint_t> settingschangecount;
+    static bool             settingswatched;
 };
 
 #endif
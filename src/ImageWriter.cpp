@@ -0,0 +1,219 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <rdlib/DateTime.h>
+#include <rdlib/Recurse.h>
+
+#include "ImageWriter.h"
+#include "Tracer.h"
+
+ImageWriter::ImageWriter() : AThread(),
+                             busyowner(NULL),
+                             busy(false),
+                             quit(false),
+                             maxqueued(32),
+                             overflow(Overflow_Sync),
+                             running(false)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+ImageWriter::~ImageWriter()
+{
+    Stop();
+}
+
+ImageWriter& ImageWriter::Get()
+{
+    static ImageWriter writer;
+    return writer;
+}
+
+uint_t ImageWriter::ParseOverflow(const AString& str)
+{
+    if (stricmp(str, "block")      == 0) return Overflow_Block;
+    if (stricmp(str, "dropoldest") == 0) return Overflow_DropOldest;
+    if (stricmp(str, "dropnewest") == 0) return Overflow_DropNewest;
+    return Overflow_Sync;
+}
+
+void ImageWriter::Configure(uint_t _maxqueued, uint_t _overflow)
+{
+    std::lock_guard<std::mutex> lock(tlock);
+
+    maxqueued = std::max(_maxqueued, 1U);
+    overflow  = _overflow;
+}
+
+bool ImageWriter::Start()
+{
+    if (!running) {
+        quit    = false;
+        running = AThread::Start();
+    }
+    return running;
+}
+
+void ImageWriter::Stop()
+{
+    if (running) {
+        // write everything still queued before stopping
+        Flush(NULL);
+
+        {
+            std::lock_guard<std::mutex> lock(tlock);
+            quit = true;
+        }
+        cond.notify_all();
+
+        AThread::Stop();
+        running = false;
+    }
+}
+
+void ImageWriter::Complete(Job *job)
+{
+    uint32_t latency = (uint32_t)SUBZ((uint64_t)ADateTime(), job->queuedt);
+
+    delete job;
+
+    std::lock_guard<std::mutex> lock(tlock);
+    stats.written++;
+    stats.avglatency  = (stats.avglatency * 7 + latency) / 8;
+    stats.maxlatency  = std::max(stats.maxlatency, latency);
+}
+
+bool ImageWriter::Add(Job *job)
+{
+    bool success = true;
+
+    job->queuedt = (uint64_t)ADateTime();
+
+    if (running) {
+        std::unique_lock<std::mutex> lock(tlock);
+
+        // wait for space in the queue if blocking
+        while (running && (overflow == Overflow_Block) && (jobs.size() >= maxqueued)) cond.wait(lock);
+
+        if (jobs.size() >= maxqueued) {
+            switch (overflow) {
+                case Overflow_DropOldest:
+                    delete jobs.front();
+                    jobs.pop_front();
+                    stats.dropped++;
+                    success = false;
+                    break;
+
+                case Overflow_DropNewest:
+                    delete job;
+                    job = NULL;
+                    stats.dropped++;
+                    success = false;
+                    break;
+
+                default:
+                    // write on this thread
+                    stats.sync++;
+                    break;
+            }
+        }
+
+        if (job && (jobs.size() < maxqueued)) {
+            jobs.push_back(job);
+            stats.maxqueued = std::max(stats.maxqueued, (uint_t)jobs.size());
+            job = NULL;
+
+            cond.notify_all();
+        }
+    }
+
+    // writer not running or queue full: write synchronously
+    if (job) {
+        job->Write(*this);
+        Complete(job);
+    }
+
+    return success;
+}
+
+void ImageWriter::Flush(const void *owner)
+{
+    std::unique_lock<std::mutex> lock(tlock);
+
+    while (running) {
+        std::deque<Job *>::iterator it;
+
+        // owner of NULL waits for all jobs
+        for (it = jobs.begin(); (it != jobs.end()) && owner && ((*it)->owner != owner); ++it) ;
+
+        if ((it == jobs.end()) && (!busy || (owner && (busyowner != owner)))) break;
+
+        cond.wait(lock);
+    }
+}
+
+ImageWriter::STATS ImageWriter::GetStats()
+{
+    std::lock_guard<std::mutex> lock(tlock);
+    STATS _stats = stats;
+
+    _stats.queued = (uint_t)jobs.size();
+
+    return _stats;
+}
+
+bool ImageWriter::MakeDirectory(const AString& dir)
+{
+    AThreadLock lock(dirlock);
+    FILE_INFO   info;
+    bool        success = true;
+
+    if (dirs.find(dir) == dirs.end()) {
+        if ((success = (GetFileInfo(dir, &info) || CreateDirectory(dir))) == true) {
+            dirs.insert(dir);
+        }
+    }
+
+    return success;
+}
+
+void *ImageWriter::Run()
+{
+    Tracer::Get().SetThreadName("writer");
+
+    while (true) {
+        Job *job = NULL;
+
+        {
+            std::unique_lock<std::mutex> lock(tlock);
+
+            while (!quit && !jobs.size()) cond.wait(lock);
+
+            if (quit) break;
+
+            job = jobs.front();
+            jobs.pop_front();
+
+            // only the owner is kept, the job is deleted when completed
+            busyowner = job->owner;
+            busy      = true;
+        }
+        cond.notify_all();
+
+        job->Write(*this);
+        Complete(job);
+
+        {
+            std::lock_guard<std::mutex> lock(tlock);
+            busyowner = NULL;
+            busy      = false;
+        }
+        cond.notify_all();
+    }
+
+    return NULL;
+}
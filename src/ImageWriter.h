@@ -0,0 +1,108 @@
+#ifndef __IMAGE_WRITER__
+#define __IMAGE_WRITER__
+
+#include <deque>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+
+#include <rdlib/strsup.h>
+#include <rdlib/Thread.h>
+#include <rdlib/ThreadLock.h>
+
+/*--------------------------------------------------------------------------------
+ * Background writer shared by all ImageDiffer sources
+ *
+ * Encoding and writing detection images is moved off the capture/process path
+ * into a bounded queue serviced by a single thread, jobs are owned (and deleted)
+ * by the writer once added
+ *
+ * When the queue is full the overflow policy decides what happens:
+ *   block      - wait for space in the queue
+ *   dropoldest - discard the oldest queued job
+ *   dropnewest - discard the new job
+ *   sync       - write the new job on the caller's thread (the old behaviour)
+ *--------------------------------------------------------------------------------*/
+class ImageWriter : public AThread {
+public:
+    class Job {
+    public:
+        Job(const void *_owner) : owner(_owner),
+                                  queuedt(0) {}
+        virtual ~Job() {}
+
+        virtual void Write(ImageWriter& writer) = 0;
+
+    protected:
+        friend class ImageWriter;
+
+        const void *owner;
+        uint64_t   queuedt;
+    };
+
+    enum {
+        Overflow_Block = 0,
+        Overflow_DropOldest,
+        Overflow_DropNewest,
+        Overflow_Sync,
+    };
+
+    typedef struct {
+        uint_t   queued;        // jobs currently queued
+        uint_t   maxqueued;     // maximum queue length seen
+        uint_t   written;       // jobs completed
+        uint_t   dropped;       // jobs dropped due to overflow
+        uint_t   sync;          // jobs written on caller's thread due to overflow
+        uint32_t avglatency;    // average time from queueing to completion (ms) of recent jobs
+        uint32_t maxlatency;    // maximum time from queueing to completion (ms)
+    } STATS;
+
+    // shared writer
+    static ImageWriter& Get();
+
+    // convert overflow policy setting into an Overflow_xxx value
+    static uint_t ParseOverflow(const AString& str);
+
+    void Configure(uint_t _maxqueued, uint_t _overflow);
+
+    bool Start();
+    void Stop();
+
+    // queue job, ownership passes to the writer
+    // returns false if the job (or an older queued job) was dropped
+    bool Add(Job *job);
+
+    // wait until all jobs for owner have completed
+    void Flush(const void *owner);
+
+    STATS GetStats();
+
+    // create directory, remembering which ones exist to avoid repeated checks
+    bool MakeDirectory(const AString& dir);
+
+protected:
+    ImageWriter();
+    virtual ~ImageWriter();
+
+    virtual void *Run();
+
+    void Complete(Job *job);
+
+protected:
+    // signalled whenever a job is queued, taken or completed
+    std::mutex              tlock;
+    std::condition_variable cond;
+    std::deque<Job *>       jobs;
+    const void              *busyowner;     // owner of the job being written
+    bool                    busy;
+    bool                    quit;
+    uint_t                  maxqueued;
+    uint_t                  overflow;
+    volatile bool           running;
+    STATS                   stats;
+
+    AThreadLockObject dirlock;
+    std::set<AString> dirs;
+};
+
+#endif
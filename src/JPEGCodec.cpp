@@ -0,0 +1,353 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include <jpeglib.h>
+
+#include <rdlib/StdFile.h>
+
+#include "JPEGCodec.h"
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf               jmp;
+} JPEG_ERROR;
+
+// error handler that also owns a jpeg_mem_dest() buffer so that, being reached through
+// cinfo->err rather than held in locals, the buffer can be freed after a longjmp()
+typedef struct {
+    JPEG_ERROR    jerr;
+    unsigned char *outbuf;
+    unsigned long outsize;
+} JPEG_DEST_ERROR;
+
+static void __ErrorExit(j_common_ptr cinfo)
+{
+    // return control to the caller rather than letting libjpeg call exit()
+    longjmp(((JPEG_ERROR *)cinfo->err)->jmp, 1);
+}
+
+static void __OutputMessage(j_common_ptr cinfo)
+{
+    UNUSED(cinfo);
+}
+
+bool JPEGCodec::ReadFile(const AString& filename, std::vector<uint8_t>& data)
+{
+    AStdFile fp;
+    bool     success = false;
+
+    data.resize(0);
+
+    if (fp.open(filename, "rb")) {
+        static const size_t blocksize = 65536;
+        struct stat st;
+        size_t  pos = 0;
+        slong_t n;
+
+        // reserve enough for the whole file so that it is read without re-allocating
+        if (stat(filename, &st) == 0) data.reserve((size_t)st.st_size + blocksize);
+
+        do {
+            data.resize(pos + blocksize);
+            if ((n = fp.readbytes(&data[pos], blocksize)) > 0) pos += n;
+        }
+        while (n == (slong_t)blocksize);
+
+        data.resize(pos);
+        fp.close();
+
+        success = (pos > 0);
+    }
+
+    return success;
+}
+
+bool JPEGCodec::WriteFile(const AString& filename, const std::vector<uint8_t>& data)
+{
+    AStdFile fp;
+    bool     success = false;
+
+    if (fp.open(filename, "wb")) {
+        success = (!data.size() || (fp.writebytes(&data[0], data.size()) == (slong_t)data.size()));
+        fp.close();
+    }
+
+    return success;
+}
+
+bool JPEGCodec::Decode(const std::vector<uint8_t>& data, AImage& image, uint_t scaledenom)
+{
+    std::vector<uint8_t> line;
+
+    return Decode(data, image, scaledenom, line);
+}
+
+bool JPEGCodec::Decode(const std::vector<uint8_t>& data, AImage& image, uint_t scaledenom, std::vector<uint8_t>& line)
+{
+    struct jpeg_decompress_struct cinfo;
+    JPEG_ERROR          jerr;
+    bool                success = false;
+
+    if (!data.size()) return false;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit     = &__ErrorExit;
+    jerr.pub.output_message = &__OutputMessage;
+
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)&data[0], (unsigned long)data.size());
+
+    if (jpeg_read_header(&cinfo, TRUE) == JPEG_HEADER_OK) {
+        cinfo.out_color_space = JCS_RGB;
+        cinfo.scale_num       = 1;
+        cinfo.scale_denom     = scaledenom;
+        cinfo.dct_method      = JDCT_ISLOW;
+
+        jpeg_start_decompress(&cinfo);
+
+        const uint_t w = cinfo.output_width, h = cinfo.output_height;
+
+        // only re-create image if the size has changed
+        if (((uint_t)image.GetRect().w == w) && ((uint_t)image.GetRect().h == h) && image.GetPixelData()) success = true;
+        else success = image.Create(w, h);
+
+        if (success) {
+            AImage::PIXEL *pixel = image.GetPixelData();
+
+            line.resize(w * cinfo.output_components);
+
+            while (cinfo.output_scanline < cinfo.output_height) {
+                JSAMPROW row = (JSAMPROW)&line[0];
+                const JSAMPLE *p = row;
+                uint_t x;
+
+                jpeg_read_scanlines(&cinfo, &row, 1);
+
+                for (x = 0; x < w; x++, p += 3, pixel++) {
+                    pixel->r = p[0];
+                    pixel->g = p[1];
+                    pixel->b = p[2];
+                    pixel->a = 0;
+                }
+            }
+
+            jpeg_finish_decompress(&cinfo);
+        }
+        else jpeg_abort_decompress(&cinfo);
+    }
+
+    jpeg_destroy_decompress(&cinfo);
+
+    return success;
+}
+
+bool JPEGCodec::MaskBlocks(const std::vector<uint8_t>& src, const AImage& mask, std::vector<uint8_t>& dst)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct   cinfo;
+    JPEG_DEST_ERROR      err;
+    std::vector<uint8_t> cells;
+    bool                 success  = false;
+    const AImage::PIXEL  *maskptr = mask.GetPixelData();
+    const uint_t         maskwid  = mask.GetRect().w;
+    const uint_t         maskhgt  = mask.GetRect().h;
+
+    if (!src.size() || !maskptr) return false;
+
+    err.outbuf  = NULL;
+    err.outsize = 0;
+
+    dinfo.err = cinfo.err = jpeg_std_error(&err.jerr.pub);
+    err.jerr.pub.error_exit     = &__ErrorExit;
+    err.jerr.pub.output_message = &__OutputMessage;
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+
+    if (setjmp(err.jerr.jmp)) {
+        JPEG_DEST_ERROR *perr = (JPEG_DEST_ERROR *)cinfo.err;
+
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        if (perr->outbuf) free(perr->outbuf);
+        return false;
+    }
+
+    jpeg_mem_src(&dinfo, (unsigned char *)&src[0], (unsigned long)src.size());
+
+    // keep comments and application markers (e.g. EXIF) other than JFIF and Adobe
+    // which libjpeg writes itself
+    uint_t m;
+    jpeg_save_markers(&dinfo, JPEG_COM, 0xffff);
+    for (m = 1; m < 16; m++) {
+        if (m != 14) jpeg_save_markers(&dinfo, JPEG_APP0 + m, 0xffff);
+    }
+
+    if ((jpeg_read_header(&dinfo, TRUE) == JPEG_HEADER_OK) &&
+        (((dinfo.jpeg_color_space == JCS_YCbCr) && (dinfo.num_components == 3)) ||
+         ((dinfo.jpeg_color_space == JCS_GRAYSCALE) && (dinfo.num_components == 1)))) {
+        jvirt_barray_ptr *coefs = jpeg_read_coefficients(&dinfo);
+        const uint_t w = dinfo.image_width, h = dinfo.image_height;
+        const uint_t cellswid = (w + 7) / 8, cellshgt = (h + 7) / 8;
+        uint_t cx, cy, x, y, ci;
+
+        // find 8x8 pixel cells that are entirely masked out
+        cells.resize(cellswid * cellshgt);
+        for (cy = 0; cy < cellshgt; cy++) {
+            for (cx = 0; cx < cellswid; cx++) {
+                const uint_t x1 = cx * 8, x2 = std::min(x1 + 8, w);
+                const uint_t y1 = cy * 8, y2 = std::min(y1 + 8, h);
+                bool masked = true;
+
+                for (y = y1; masked && (y < y2); y++) {
+                    const AImage::PIXEL *row = maskptr + std::min((y * maskhgt + h / 2) / h, maskhgt - 1) * maskwid;
+
+                    for (x = x1; masked && (x < x2); x++) {
+                        const AImage::PIXEL& pixel = row[std::min((x * maskwid + w / 2) / w, maskwid - 1)];
+                        masked = !(pixel.r | pixel.g | pixel.b);
+                    }
+                }
+
+                cells[cx + cy * cellswid] = masked;
+            }
+        }
+
+        // blank blocks of each component whose cells are all masked
+        for (ci = 0; ci < (uint_t)dinfo.num_components; ci++) {
+            const jpeg_component_info *comp = dinfo.comp_info + ci;
+            const uint_t fx = dinfo.max_h_samp_factor / comp->h_samp_factor;
+            const uint_t fy = dinfo.max_v_samp_factor / comp->v_samp_factor;
+            // black is Y = 0 (level shifted to -128) and neutral chroma
+            const int    q  = dinfo.quant_tbl_ptrs[comp->quant_tbl_no]->quantval[0];
+            const JCOEF  dc = (ci == 0) ? (JCOEF)-((1024 + q / 2) / q) : 0;
+            uint_t bx, by;
+
+            for (by = 0; by < comp->height_in_blocks; by++) {
+                JBLOCKARRAY rows = (*dinfo.mem->access_virt_barray)((j_common_ptr)&dinfo, coefs[ci], by, 1, TRUE);
+
+                for (bx = 0; bx < comp->width_in_blocks; bx++) {
+                    const uint_t cx1 = bx * fx, cx2 = std::min(cx1 + fx, cellswid);
+                    const uint_t cy1 = by * fy, cy2 = std::min(cy1 + fy, cellshgt);
+                    bool masked = ((cx1 < cx2) && (cy1 < cy2));
+
+                    for (cy = cy1; masked && (cy < cy2); cy++) {
+                        for (cx = cx1; masked && (cx < cx2); cx++) masked = cells[cx + cy * cellswid];
+                    }
+
+                    if (masked) {
+                        memset(rows[0][bx], 0, sizeof(JBLOCK));
+                        rows[0][bx][0] = dc;
+                    }
+                }
+            }
+        }
+
+        jpeg_mem_dest(&cinfo, &err.outbuf, &err.outsize);
+        jpeg_copy_critical_parameters(&dinfo, &cinfo);
+        jpeg_write_coefficients(&cinfo, coefs);
+
+        jpeg_saved_marker_ptr marker;
+        for (marker = dinfo.marker_list; marker; marker = marker->next) {
+            jpeg_write_marker(&cinfo, marker->marker, marker->data, marker->data_length);
+        }
+
+        jpeg_finish_compress(&cinfo);
+        jpeg_finish_decompress(&dinfo);
+
+        dst.assign(err.outbuf, err.outbuf + err.outsize);
+        success = true;
+    }
+
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+    if (err.outbuf) free(err.outbuf);
+
+    return success;
+}
+
+bool JPEGCodec::ReadLumaCoefficients(const std::vector<uint8_t>& data, uint_t ncoefs, std::vector<sint_t>& coefs, uint_t& bw, uint_t& bh)
+{
+    // DC, then (in libjpeg's natural order) the first horizontal and first vertical AC coefficients
+    static const uint_t order[] = {0, 1, 8};
+    struct jpeg_decompress_struct cinfo;
+    JPEG_ERROR jerr;
+    bool       success = false;
+
+    if (!data.size()) return false;
+
+    ncoefs = std::min(std::max(ncoefs, 1U), (uint_t)NUMBEROF(order));
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit     = &__ErrorExit;
+    jerr.pub.output_message = &__OutputMessage;
+
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)&data[0], (unsigned long)data.size());
+
+    if ((jpeg_read_header(&cinfo, TRUE) == JPEG_HEADER_OK) &&
+        (cinfo.comp_info[0].h_samp_factor == cinfo.max_h_samp_factor) &&
+        (cinfo.comp_info[0].v_samp_factor == cinfo.max_v_samp_factor)) {
+        // entropy decoding only: no IDCT, upsampling or colour conversion
+        jvirt_barray_ptr          *vcoefs = jpeg_read_coefficients(&cinfo);
+        const jpeg_component_info *comp   = cinfo.comp_info;
+        const UINT16              *quant  = cinfo.quant_tbl_ptrs[comp->quant_tbl_no]->quantval;
+        uint_t x, y, i;
+
+        bw = comp->width_in_blocks;
+        bh = comp->height_in_blocks;
+        coefs.resize(bw * bh * ncoefs);
+
+        sint_t *p = coefs.size() ? &coefs[0] : NULL;
+        for (y = 0; y < bh; y++) {
+            JBLOCKARRAY rows = (*cinfo.mem->access_virt_barray)((j_common_ptr)&cinfo, vcoefs[0], y, 1, FALSE);
+
+            for (x = 0; x < bw; x++) {
+                for (i = 0; i < ncoefs; i++) *p++ = (sint_t)rows[0][x][order[i]] * (sint_t)quant[order[i]];
+            }
+        }
+
+        jpeg_finish_decompress(&cinfo);
+        success = true;
+    }
+
+    jpeg_destroy_decompress(&cinfo);
+
+    return success;
+}
+
+uint_t JPEGCodec::ParseScale(const AString& str)
+{
+    double val;
+    int    p;
+
+    if ((p = str.Pos("/")) >= 0) {
+        double num = (double)str.Left(p), den = (double)str.Mid(p + 1);
+        val = (num > 0.0) ? den / num : 1.0;
+    }
+    else {
+        val = (double)str;
+        if ((val > 0.0) && (val < 1.0)) val = 1.0 / val;
+    }
+
+    // libjpeg can scale by 1/1, 1/2, 1/4 or 1/8
+    if      (val >= 8.0) return 8;
+    else if (val >= 4.0) return 4;
+    else if (val >= 2.0) return 2;
+    return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef __JPEG_CODEC__
+#define __JPEG_CODEC__
+
+#include <vector>
+
+#include <rdlib/strsup.h>
+#include <rdlib/BMPImage.h>
+
+/*--------------------------------------------------------------------------------
+ * Direct libjpeg access for ImageDiffer
+ *
+ * Unlike AImage::LoadJPEG() these work on JPEG data held in memory and can use
+ * libjpeg's DCT scaling to decode at 1/2, 1/4 or 1/8 size for a fraction of the cost
+ *--------------------------------------------------------------------------------*/
+class JPEGCodec {
+public:
+    // read entire file into data (data is resized but its capacity is kept between calls)
+    static bool ReadFile(const AString& filename, std::vector<uint8_t>& data);
+
+    // write data verbatim to file
+    static bool WriteFile(const AString& filename, const std::vector<uint8_t>& data);
+
+    // decode JPEG data into image at 1/scaledenom size (scaledenom = 1, 2, 4 or 8)
+    // image is only re-created if its size changes, line is scratch space for one row
+    // (kept by the caller to avoid an allocation per decode)
+    static bool Decode(const std::vector<uint8_t>& data, AImage& image, uint_t scaledenom = 1);
+    static bool Decode(const std::vector<uint8_t>& data, AImage& image, uint_t scaledenom, std::vector<uint8_t>& line);
+
+    // losslessly blank every 8x8 block of src that is entirely black in mask (mask is stretched
+    // to the image size) by rewriting DCT coefficients, no other blocks are re-quantised
+    // only YCbCr and greyscale JPEGs are supported
+    static bool MaskBlocks(const std::vector<uint8_t>& src, const AImage& mask, std::vector<uint8_t>& dst);
+
+    // read the first ncoefs (1 = DC only, 3 = DC plus the lowest horizontal and vertical AC)
+    // dequantised coefficients of every luma (or greyscale) block without decoding any pixels,
+    // coefs receives bw * bh * ncoefs values in raster block order
+    // fails if luma is not at full resolution
+    static bool ReadLumaCoefficients(const std::vector<uint8_t>& data, uint_t ncoefs, std::vector<sint_t>& coefs, uint_t& bw, uint_t& bh);
+
+    // convert detectscale setting ("1", "1/2", "1/4", "1/8", "0.25", "4", etc) into a denominator
+    static uint_t ParseScale(const AString& str);
+};
+
+#endif
@@ -0,0 +1,191 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <rdlib/DateTime.h>
+#include <rdlib/Recurse.h>
+
+#include "LogWriter.h"
+
+LogWriter::LogWriter() : AThread(),
+                         pending(NULL),
+                         queued(0),
+                         dropped(0),
+                         maxqueued(1024 * 1024),
+                         reporteddropped(0),
+                         running(false)
+{
+}
+
+LogWriter::~LogWriter()
+{
+    Stop();
+}
+
+LogWriter& LogWriter::Get()
+{
+    static LogWriter writer;
+    return writer;
+}
+
+void LogWriter::Configure(size_t _maxqueued)
+{
+    maxqueued = std::max(_maxqueued, (size_t)1024);
+}
+
+bool LogWriter::Start()
+{
+    if (!running) running = AThread::Start();
+    return running;
+}
+
+void LogWriter::Stop()
+{
+    if (running) {
+        AThread::Stop();
+        running = false;
+    }
+
+    // write anything left and close files
+    Drain();
+    CloseFiles();
+}
+
+bool LogWriter::Add(const AString& logpath, const AString& line)
+{
+    if (!running) {
+        Write(logpath, line);
+        return true;
+    }
+
+    const size_t size = sizeof(ENTRY) + line.len();
+
+    // reserve space in the queue, dropping the line if it would exceed the cap
+    if ((queued.fetch_add(size, std::memory_order_relaxed) + size) > maxqueued) {
+        queued.fetch_sub(size, std::memory_order_relaxed);
+        dropped++;
+        return false;
+    }
+
+    ENTRY *entry = new ENTRY;
+    entry->logpath = logpath;
+    entry->line    = line;
+
+    // push onto the front of the list
+    entry->next = pending.load(std::memory_order_relaxed);
+    while (!pending.compare_exchange_weak(entry->next, entry, std::memory_order_release, std::memory_order_relaxed)) ;
+
+    return true;
+}
+
+bool LogWriter::Drain()
+{
+    // take the whole list in one go, it is newest first so reverse it
+    ENTRY *entry = pending.exchange(NULL, std::memory_order_acquire), *list = NULL;
+
+    while (entry) {
+        ENTRY *next = entry->next;
+        entry->next = list;
+        list        = entry;
+        entry       = next;
+    }
+
+    if (!list) return false;
+
+    AString logpath;
+    while (list) {
+        entry = list;
+        list  = list->next;
+
+        Write(entry->logpath, entry->line);
+        queued.fetch_sub(sizeof(ENTRY) + entry->line.len(), std::memory_order_relaxed);
+
+        logpath = entry->logpath;
+        delete entry;
+    }
+
+    // report drops once there is room again
+    uint_t ndropped = dropped;
+    if (ndropped != reporteddropped) {
+        ADateTime dt;
+        AString   str;
+
+        str.printf("%s[0]: Log queue full, %u lines dropped", dt.DateFormat("%Y-%M-%D %h:%m:%s").str(), ndropped - reporteddropped);
+        Write(logpath, str);
+
+        reporteddropped = ndropped;
+    }
+
+    // make lines visible to readers of the file
+    AThreadLock lock(filelock);
+    std::map<AString, LOGFILE>::iterator it;
+    for (it = files.begin(); it != files.end(); ++it) {
+        if (it->second.fp) it->second.fp->flush();
+    }
+
+    return true;
+}
+
+void LogWriter::Write(const AString& logpath, const AString& line)
+{
+    AThreadLock lock(filelock);
+    // file name from the date at the start of the line, the file changes at midnight
+    AString  filename = logpath.CatPath(AString("imagediff-%;.txt").Arg(line.Left(10)));
+    LOGFILE& file     = files[logpath];
+
+    if (file.fp && (file.filename != filename)) {
+        file.fp->close();
+        delete file.fp;
+        file.fp = NULL;
+    }
+
+    if (!file.fp) {
+        CreateDirectory(filename.PathPart());
+
+        if ((file.fp = new AStdFile) != NULL) {
+            if (file.fp->open(filename, "a")) file.filename = filename;
+            else {
+                delete file.fp;
+                file.fp = NULL;
+            }
+        }
+    }
+
+    if (file.fp) {
+        file.fp->printf("%s\n", line.str());
+
+        // not running: nothing else will write or close the file
+        if (!running) {
+            file.fp->close();
+            delete file.fp;
+            file.fp = NULL;
+        }
+    }
+}
+
+void LogWriter::CloseFiles()
+{
+    AThreadLock lock(filelock);
+    std::map<AString, LOGFILE>::iterator it;
+
+    for (it = files.begin(); it != files.end(); ++it) {
+        if (it->second.fp) {
+            it->second.fp->close();
+            delete it->second.fp;
+        }
+    }
+
+    files.clear();
+}
+
+void *LogWriter::Run()
+{
+    while (!quitthread) {
+        if (!Drain()) Sleep(20);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef __LOG_WRITER__
+#define __LOG_WRITER__
+
+#include <atomic>
+#include <map>
+
+#include <rdlib/strsup.h>
+#include <rdlib/StdFile.h>
+#include <rdlib/Thread.h>
+#include <rdlib/ThreadLock.h>
+
+/*--------------------------------------------------------------------------------
+ * Background writer for the daily log files
+ *
+ * Lines are pushed onto a lock-free list by any thread and written by a single
+ * thread which keeps each log file open until the date changes
+ *
+ * The memory used by queued lines is capped, lines that would exceed it are
+ * dropped and counted (and the count logged once the queue has drained)
+ *
+ * Lines must start with the date ('YYYY-MM-DD ...'), it decides the file name
+ *--------------------------------------------------------------------------------*/
+class LogWriter : public AThread {
+public:
+    static LogWriter& Get();
+
+    void Configure(size_t _maxqueued);
+
+    bool Start();
+    void Stop();
+
+    // queue line for imagediff-<date>.txt in logpath
+    // (written immediately if the writer is not running)
+    bool Add(const AString& logpath, const AString& line);
+
+    uint_t GetDropped() const {return dropped;}
+
+protected:
+    LogWriter();
+    virtual ~LogWriter();
+
+    virtual void *Run();
+
+    typedef struct _ENTRY {
+        struct _ENTRY *next;
+        AString       logpath;
+        AString       line;
+    } ENTRY;
+
+    typedef struct {
+        AString  filename;
+        AStdFile *fp;
+    } LOGFILE;
+
+    // write queued lines, oldest first, returns false if there was nothing to write
+    bool Drain();
+    void Write(const AString& logpath, const AString& line);
+    void CloseFiles();
+
+protected:
+    std::atomic<ENTRY *>           pending;
+    std::atomic<size_t>            queued;
+    std::atomic<uint_t>            dropped;
+    size_t                         maxqueued;
+    uint_t                         reporteddropped;
+    volatile bool                  running;
+
+    AThreadLockObject              filelock;
+    std::map<AString, LOGFILE>     files;
+};
+
+#endif
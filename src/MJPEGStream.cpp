@@ -0,0 +1,184 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "MJPEGStream.h"
+#include "Tracer.h"
+
+MJPEGStream::MJPEGStream(const AString& _url, uint32_t _timeout, NOTIFYFUNC _notify, void *_context) :
+    AThread(),
+    url(_url),
+    timeout(_timeout),
+    notify(_notify),
+    context(_context),
+    sstage(StreamStage_LookingForBoundary),
+    contentlength(0),
+    frameready(false),
+    newerror(false),
+    framecount(0),
+    droppedcount(0)
+{
+}
+
+MJPEGStream::~MJPEGStream()
+{
+    // tell the thread to quit before waking it from any blocking read or connect so
+    // that it cannot go round again and reconnect
+    quitthread = true;
+    client.Abort();
+    Stop();
+}
+
+void MJPEGStream::SetError(const AString& err)
+{
+    AThreadLock lock(tlock);
+
+    // only report changes so that a persistently failing camera does not flood the log
+    if (err != error) {
+        error    = err;
+        newerror = error.Valid();
+    }
+}
+
+bool MJPEGStream::GetError(AString& err)
+{
+    AThreadLock lock(tlock);
+    bool success = newerror;
+
+    if (newerror) {
+        err      = error;
+        newerror = false;
+    }
+
+    return success;
+}
+
+bool MJPEGStream::GetFrame(std::vector<uint8_t>& data, ADateTime& dt)
+{
+    AThreadLock lock(tlock);
+    bool success = frameready;
+
+    if (frameready) {
+        // swap buffers so neither side needs to copy or re-allocate
+        data.swap(frame);
+        dt         = framedt;
+        frameready = false;
+    }
+
+    return success;
+}
+
+void MJPEGStream::ProcessContent()
+{
+    {
+        AThreadLock lock(tlock);
+
+        // previous frame not collected: it is now stale so drop it
+        if (frameready) droppedcount++;
+
+        frame.swap(content);
+        framedt    = contentdt;
+        frameready = true;
+        framecount++;
+
+        // stream is working again
+        error = "";
+    }
+
+    if (notify) (*notify)(context);
+}
+
+bool MJPEGStream::ReadStream()
+{
+    AString contenttype, delimiter, line;
+
+    if (!client.OpenStream(url, timeout, contenttype)) {
+        SetError(client.GetError());
+        return false;
+    }
+
+    // find boundary from content type, e.g. 'multipart/x-mixed-replace; boundary=myboundary'
+    boundary = "";
+    uint_t i, n = contenttype.CountLines(";");
+    for (i = 0; i < n; i++) {
+        AString param = contenttype.Line(i, ";").Words(0);
+
+        if (param.PosNoCase("boundary=") == 0) {
+            boundary = param.Mid(9).SearchAndReplace("\"", "");
+        }
+    }
+
+    if (boundary.Empty()) {
+        SetError(AString("No boundary in content type '%'").Arg(contenttype));
+        return false;
+    }
+
+    // some cameras include the leading '--' in the boundary specification, so accept either
+    delimiter = "--" + boundary;
+    sstage    = StreamStage_LookingForBoundary;
+
+    while (!quitthread) {
+        if (sstage == StreamStage_ReadingData) {
+            content.resize(0);
+            if (!client.ReadStreamData(content, contentlength, timeout)) break;
+
+            ProcessContent();
+
+            sstage = StreamStage_LookingForBoundary;
+        }
+        else if (!client.ReadStreamLine(line, timeout)) break;
+        else if (sstage == StreamStage_LookingForBoundary) {
+            if ((line == delimiter) || (line == boundary)) {
+                contentdt.TimeStamp();
+                contentlength = 0;
+                sstage++;
+            }
+            else if ((line == (delimiter + "--")) || (line == (boundary + "--"))) {
+                SetError("Stream ended");
+                return false;
+            }
+        }
+        else if (line.PosNoCase("Content-Length:") == 0) {
+            contentlength = (uint_t)line.Mid(15).Words(0);
+        }
+        else if (line.Empty()) {
+            if (contentlength) sstage++;
+            else {
+                SetError("Stream part without Content-Length, skipping");
+                sstage = StreamStage_LookingForBoundary;
+            }
+        }
+    }
+
+    if (!quitthread) SetError(client.GetError());
+
+    return false;
+}
+
+void *MJPEGStream::Run()
+{
+    uint32_t retrydelay = 1000;
+
+    Tracer::Get().SetThreadName("stream");
+
+    while (!quitthread) {
+        uint_t frames = framecount;
+
+        // only returns when the stream fails
+        ReadStream();
+        client.Close();
+
+        // retry quickly if the stream was working, otherwise back off
+        if (framecount != frames) retrydelay = 1000;
+
+        uint64_t retrydt = (uint64_t)ADateTime() + retrydelay;
+        while (!quitthread && ((uint64_t)ADateTime() < retrydt)) Sleep(100);
+
+        retrydelay = std::min(retrydelay * 2, (uint32_t)30000);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef __MJPEG_STREAM__
+#define __MJPEG_STREAM__
+
+#include <vector>
+
+#include <rdlib/strsup.h>
+#include <rdlib/DateTime.h>
+#include <rdlib/Thread.h>
+#include <rdlib/ThreadLock.h>
+
+#include "HTTPClient.h"
+
+/*--------------------------------------------------------------------------------
+ * Reader for multipart MJPEG (multipart/x-mixed-replace) camera streams
+ *
+ * Based on the stream parser in attic/CameraStream but using HTTPClient on its
+ * own thread, one long-lived connection per camera
+ *
+ * Only the latest frame is kept: if the consumer does not collect a frame before
+ * the next one arrives, the older frame is dropped
+ *--------------------------------------------------------------------------------*/
+class MJPEGStream : public AThread {
+public:
+    typedef void (*NOTIFYFUNC)(void *context);
+
+    // notify (if not NULL) is called from the stream thread whenever a new frame is available
+    MJPEGStream(const AString& _url, uint32_t _timeout, NOTIFYFUNC _notify = NULL, void *_context = NULL);
+    virtual ~MJPEGStream();
+
+    const AString& GetURL()     const {return url;}
+    uint32_t       GetTimeout() const {return timeout;}
+
+    // swap latest frame into data (if one is available since the last call)
+    bool GetFrame(std::vector<uint8_t>& data, ADateTime& dt);
+
+    // returns true if the stream has had a new error since the last call
+    bool GetError(AString& err);
+
+    uint_t GetFrameCount()   const {return framecount;}
+    uint_t GetDroppedCount() const {return droppedcount;}
+
+protected:
+    virtual void *Run();
+
+    bool ReadStream();
+    void ProcessContent();
+    void SetError(const AString& err);
+
+    enum {
+        StreamStage_LookingForBoundary = 0,
+        StreamStage_LookingForContent,
+        StreamStage_ReadingData,
+    };
+
+protected:
+    AString              url;
+    uint32_t             timeout;
+    NOTIFYFUNC           notify;
+    void                 *context;
+    HTTPClient           client;
+    AString              boundary;
+    uint_t               sstage;
+    uint_t               contentlength;
+    ADateTime            contentdt;
+    std::vector<uint8_t> content;
+
+    AThreadLockObject    tlock;
+    std::vector<uint8_t> frame;
+    ADateTime            framedt;
+    bool                 frameready;
+    AString              error;
+    bool                 newerror;
+    volatile uint_t      framecount;
+    volatile uint_t      droppedcount;
+};
+
+#endif
@@ -0,0 +1,226 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#ifdef __LINUX__
+#include <sys/inotify.h>
+#endif
+
+#include "SettingsSnapshot.h"
+
+static SettingsSnapshot::PTR current;
+
+SettingsSnapshot::SettingsSnapshot(const ASettingsHandler& settings, uint_t _generation) :
+    filename(settings.GetFilename()),
+    generation(_generation)
+{
+    FILE *fp;
+
+    // the handler has no way to list its settings so find the names from the file ('name=value' lines)
+    // and take the values from the handler
+    if ((fp = fopen(filename, "r")) != NULL) {
+        char   *line = NULL;
+        size_t len   = 0;
+
+        while (getline(&line, &len, fp) >= 0) {
+            AString str = line;
+            int     p;
+
+            if ((p = str.Pos("=")) > 0) {
+                AString name = str.Left(p).Words(0);
+
+                if (name.Valid() && (name.str()[0] != '#') && settings.Exists(name)) {
+                    values[name] = settings.Get(name);
+                }
+            }
+        }
+
+        free(line);
+        fclose(fp);
+    }
+}
+
+SettingsSnapshot::PTR SettingsSnapshot::GetCurrent()
+{
+    return std::atomic_load(&current);
+}
+
+void SettingsSnapshot::Publish(const PTR& snapshot)
+{
+    std::atomic_store(&current, snapshot);
+}
+
+bool SettingsSnapshot::Exists(const AString& name) const
+{
+    return (values.find(name) != values.end());
+}
+
+AString SettingsSnapshot::GetValue(const AString& name, const AString& defval) const
+{
+    std::map<AString, AString>::const_iterator it = values.find(name);
+
+    return (it != values.end()) ? it->second : defval;
+}
+
+SourceSettings::PTR SettingsSnapshot::Resolve(uint_t index) const
+{
+    return SourceSettings::PTR(new SourceSettings(*this, index));
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+SourceSettings::SourceSettings(const SettingsSnapshot& snapshot, uint_t _index) :
+    index(_index)
+{
+    std::map<AString, AString> raw = snapshot.values;
+    std::map<AString, AString>::const_iterator it;
+
+    // '<name>:<index>' overrides '<name>' for this source
+    if (index) {
+        const AString suffix = AString(":%").Arg(index);
+
+        for (it = snapshot.values.begin(); it != snapshot.values.end(); ++it) {
+            const AString& name = it->first;
+            int p = name.len() - suffix.len();
+
+            if ((p > 0) && (name.Mid(p) == suffix)) raw[name.Left(p)] = it->second;
+        }
+    }
+
+    for (it = raw.begin(); it != raw.end(); ++it) Resolve(raw, it->first, 0);
+}
+
+const AString *SourceSettings::Resolve(const std::map<AString, AString>& raw, const AString& name, uint_t depth)
+{
+    // limit on nested references, stops self-referencing settings recursing forever
+    static const uint_t maxdepth = 16;
+    std::map<AString, AString>::const_iterator it;
+
+    if ((it = values.find(name)) != values.end()) return &it->second;
+    if (((it = raw.find(name)) == raw.end()) || (depth >= maxdepth)) return NULL;
+
+    AString val = Expand(it->second, [&](const AString& name1) {return Resolve(raw, name1, depth + 1);});
+
+    return &(values[name] = val);
+}
+
+AString SourceSettings::Expand(const AString& val, const LOOKUP& lookup)
+{
+    AString str = val;
+    int p = 0, p1, p2;
+
+    while (((p1 = str.Pos("{", p)) >= 0) && ((p2 = str.Pos("}", p1 + 1)) >= 0)) {
+        const AString *val1 = lookup(str.Mid(p1 + 1, p2 - p1 - 1));
+
+        if (val1) {
+            AString str3 = str.Mid(p2 + 1);
+
+            str  = str.Left(p1) + *val1;
+            p    = str.len();
+            str += str3;
+        }
+        else p = p2 + 1;
+    }
+
+    return str;
+}
+
+bool SourceSettings::Exists(const AString& name) const
+{
+    return (values.find(name) != values.end());
+}
+
+AString SourceSettings::Get(const AString& name, const AString& defval) const
+{
+    std::map<AString, AString>::const_iterator it;
+
+    if ((it = values.find(name)) != values.end()) return it->second;
+
+    // all values are already resolved so references in the default need only a search
+    return Expand(defval, [this](const AString& name1) -> const AString * {
+            std::map<AString, AString>::const_iterator it1 = values.find(name1);
+            return (it1 != values.end()) ? &it1->second : NULL;
+        });
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+SettingsWatcher::SettingsWatcher(const AString& _filename, NOTIFYFUNC _notify, void *_context) :
+    AThread(),
+    filename(_filename),
+    notify(_notify),
+    context(_context),
+    fd(-1)
+{
+}
+
+SettingsWatcher::~SettingsWatcher()
+{
+    Stop();
+
+    if (fd >= 0) close(fd);
+}
+
+bool SettingsWatcher::Start()
+{
+#ifdef __LINUX__
+    if (fd < 0) {
+        // watch the directory rather than the file so that files replaced by editors
+        // (written elsewhere and renamed) are still seen
+        AString dir = filename.PathPart();
+
+        if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) return false;
+
+        if ((inotify_add_watch(fd, dir.Valid() ? dir.str() : ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) ||
+            !AThread::Start()) {
+            close(fd);
+            fd = -1;
+        }
+    }
+#endif
+
+    return (fd >= 0);
+}
+
+void *SettingsWatcher::Run()
+{
+#ifdef __LINUX__
+    const AString name = filename.FilePart();
+    // room for at least one event with a maximum length name
+    static const size_t buflen = sizeof(struct inotify_event) + 256;
+    uint8_t buf[16 * buflen] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!quitthread) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        bool changed = false;
+        ssize_t n;
+
+        // short timeout so that the thread can be stopped
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            ssize_t i;
+
+            for (i = 0; i < n;) {
+                const struct inotify_event *event = (const struct inotify_event *)(buf + i);
+
+                changed |= (event->len && (name == event->name));
+                i += sizeof(*event) + event->len;
+            }
+        }
+
+        // let a burst of writes settle before re-reading
+        if (changed) {
+            Sleep(100);
+            while (read(fd, buf, sizeof(buf)) > 0) ;
+
+            if (notify) (*notify)(context);
+        }
+    }
+#endif
+
+    return NULL;
+}
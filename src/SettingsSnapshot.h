@@ -0,0 +1,106 @@
+#ifndef __SETTINGS_SNAPSHOT__
+#define __SETTINGS_SNAPSHOT__
+
+#include <map>
+#include <memory>
+#include <functional>
+
+#include <rdlib/strsup.h>
+#include <rdlib/Thread.h>
+#include <rdlib/SettingsHandler.h>
+
+/*--------------------------------------------------------------------------------
+ * Immutable copy of the settings
+ *
+ * Built once each time the settings file is (re)read and published by swapping
+ * a shared pointer, sources hold on to the snapshot they were configured from so
+ * lookups never need a lock and an old snapshot is freed when its last user lets
+ * go of it
+ *--------------------------------------------------------------------------------*/
+class SourceSettings;
+class SettingsSnapshot {
+public:
+    typedef std::shared_ptr<const SettingsSnapshot> PTR;
+
+    // copy all settings named in settings' file (the handler provides the values)
+    SettingsSnapshot(const ASettingsHandler& settings, uint_t _generation);
+
+    // current snapshot (NULL before the first is published)
+    static PTR  GetCurrent();
+    static void Publish(const PTR& snapshot);
+
+    uint_t         GetGeneration() const {return generation;}
+    const AString& GetFilename()   const {return filename;}
+
+    // global settings, '<name>' as is
+    bool    Exists(const AString& name) const;
+    AString GetValue(const AString& name, const AString& defval = "") const;
+
+    // settings as seen by source index, resolved once
+    std::shared_ptr<const SourceSettings> Resolve(uint_t index) const;
+
+protected:
+    friend class SourceSettings;
+    std::map<AString, AString> values;
+    AString                    filename;
+    uint_t                     generation;
+};
+
+/*--------------------------------------------------------------------------------
+ * One source's view of a snapshot
+ *
+ * '<name>:<index>' overrides are applied and '{name}' references expanded when
+ * the source is (re)configured so each lookup is a single map search
+ *--------------------------------------------------------------------------------*/
+class SourceSettings {
+public:
+    typedef std::shared_ptr<const SourceSettings> PTR;
+
+    SourceSettings(const SettingsSnapshot& snapshot, uint_t _index);
+
+    uint_t  GetIndex() const {return index;}
+
+    bool    Exists(const AString& name) const;
+
+    // defval is expanded as the values are
+    AString Get(const AString& name, const AString& defval = "") const;
+
+protected:
+    typedef std::function<const AString *(const AString& name)> LOOKUP;
+
+    static AString Expand(const AString& val, const LOOKUP& lookup);
+
+    const AString *Resolve(const std::map<AString, AString>& raw, const AString& name, uint_t depth);
+
+protected:
+    std::map<AString, AString> values;
+    uint_t                     index;
+};
+
+/*--------------------------------------------------------------------------------
+ * Watches a file using inotify and calls notify (on the watcher's thread) when
+ * it has been written or replaced
+ *
+ * Start() fails if inotify is not available, callers should then poll
+ *--------------------------------------------------------------------------------*/
+class SettingsWatcher : public AThread {
+public:
+    typedef void (*NOTIFYFUNC)(void *context);
+
+    SettingsWatcher(const AString& _filename, NOTIFYFUNC _notify, void *_context = NULL);
+    virtual ~SettingsWatcher();
+
+    bool Start();
+    bool IsRunning() const {return (fd >= 0);}
+
+protected:
+    virtual void *Run();
+
+protected:
+    AString    filename;
+    NOTIFYFUNC notify;
+    void       *context;
+    int        fd;
+};
+
+#endif
@@ -0,0 +1,220 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <rdlib/DateTime.h>
+
+#include "StatsFlusher.h"
+
+StatsBlock::StatsBlock() : writing(false),
+                           seq(0),
+                           changed(0)
+{
+    uint_t i;
+
+    for (i = 0; i < Stat_Count; i++) values[i].store(0.0, std::memory_order_relaxed);
+}
+
+const char *StatsBlock::GetName(uint_t stat)
+{
+    static const char *names[Stat_Count] = {
+        "fastavg",
+        "fastsd",
+        "slowavg",
+        "slowsd",
+        "level",
+        "seqno",
+        "lag",
+        "maxlag",
+        "streamframes",
+        "streamdropped",
+        "coarseframes",
+        "fullframes",
+        "prescreenskipped",
+        "prescreensaved",
+        "frameallocs",
+        "fps",
+    };
+
+    return (stat < Stat_Count) ? names[stat] : "";
+}
+
+bool StatsBlock::IsInteger(uint_t stat)
+{
+    // time saved by prescreening (ms, may be negative) and the frame rate are fractional
+    return ((stat >= Stat_SeqNo) && (stat != Stat_PrescreenSaved) && (stat != Stat_FPS));
+}
+
+void StatsBlock::Set(uint_t stat, double val)
+{
+    // a source's capture and process stages and the image writer can all set stats,
+    // writers are serialised so that the sequence number stays a proper sequence lock
+    while (writing.exchange(true, std::memory_order_acquire)) std::this_thread::yield();
+
+    // odd sequence number marks an update in progress
+    const uint32_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    values[stat].store(val, std::memory_order_relaxed);
+
+    seq.store(s + 2, std::memory_order_release);
+
+    writing.store(false, std::memory_order_release);
+
+    changed.fetch_or(1U << stat, std::memory_order_release);
+}
+
+uint32_t StatsBlock::Read(double vals[Stat_Count])
+{
+    const uint32_t mask = changed.exchange(0, std::memory_order_acquire);
+    uint32_t s1, s2;
+    uint_t   i;
+
+    if (mask) {
+        do {
+            // wait for any update in progress to finish, yielding in case the writer has
+            // been preempted mid-update
+            while ((s1 = seq.load(std::memory_order_acquire)) & 1) std::this_thread::yield();
+
+            for (i = 0; i < Stat_Count; i++) vals[i] = values[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s2 = seq.load(std::memory_order_relaxed);
+        }
+        while (s1 != s2);
+    }
+
+    return mask;
+}
+
+/*----------------------------------------------------------------------------------------------------*/
+
+StatsFlusher::StatsFlusher() : AThread(),
+                               stats("imagediff-stats", true, 5000),
+                               interval(1000),
+                               running(false)
+{
+}
+
+StatsFlusher::~StatsFlusher()
+{
+    Stop();
+}
+
+StatsFlusher& StatsFlusher::Get()
+{
+    static StatsFlusher flusher;
+    return flusher;
+}
+
+void StatsFlusher::Configure(uint32_t _interval)
+{
+    interval = std::max(_interval, (uint32_t)10);
+}
+
+bool StatsFlusher::Start()
+{
+    if (!running) running = AThread::Start();
+    return running;
+}
+
+void StatsFlusher::Stop()
+{
+    if (running) {
+        AThread::Stop();
+        running = false;
+    }
+
+    Flush();
+}
+
+void StatsFlusher::Register(StatsBlock *block, uint_t index)
+{
+    AThreadLock lock(tlock);
+    ENTRY entry = {block, index};
+
+    entries.push_back(entry);
+}
+
+void StatsFlusher::Unregister(StatsBlock *block)
+{
+    AThreadLock lock(tlock);
+    std::vector<ENTRY>::iterator it;
+
+    for (it = entries.begin(); it != entries.end(); ++it) {
+        if (it->block == block) {
+            FlushEntry(*it);
+            entries.erase(it);
+            break;
+        }
+    }
+
+    stats.CheckWrite();
+}
+
+void StatsFlusher::FlushEntry(const ENTRY& entry)
+{
+    // called with tlock held
+    double   vals[StatsBlock::Stat_Count];
+    uint32_t mask = entry.block->Read(vals);
+    uint_t   i;
+
+    for (i = 0; mask; i++, mask >>= 1) {
+        if (mask & 1) {
+            AString name = AString("%:%").Arg(StatsBlock::GetName(i)).Arg(entry.index);
+
+            if (StatsBlock::IsInteger(i)) stats.Set(name, AString("%").Arg((uint_t)vals[i]));
+            else                          stats.Set(name, AString("%0.16e").Arg(vals[i]));
+        }
+    }
+}
+
+void StatsFlusher::Flush()
+{
+    AThreadLock lock(tlock);
+    size_t i;
+
+    for (i = 0; i < entries.size(); i++) FlushEntry(entries[i]);
+
+    stats.CheckWrite();
+}
+
+AString StatsFlusher::GetStat(const AString& name)
+{
+    AThreadLock lock(tlock);
+    size_t i;
+
+    for (i = 0; i < entries.size(); i++) FlushEntry(entries[i]);
+
+    return stats.Get(name);
+}
+
+void StatsFlusher::SetStat(const AString& name, const AString& val)
+{
+    AThreadLock lock(tlock);
+
+    stats.Set(name, val);
+}
+
+void *StatsFlusher::Run()
+{
+    uint64_t flushdt = (uint64_t)ADateTime() + interval;
+
+    while (!quitthread) {
+        uint64_t now = (uint64_t)ADateTime();
+
+        if (now >= flushdt) {
+            Flush();
+            flushdt = now + interval;
+        }
+
+        Sleep(std::min((uint32_t)(flushdt - now), (uint32_t)100));
+    }
+
+    return NULL;
+}
@@ -0,0 +1,115 @@
+#ifndef __STATS_FLUSHER__
+#define __STATS_FLUSHER__
+
+#include <atomic>
+#include <vector>
+
+#include <rdlib/strsup.h>
+#include <rdlib/Thread.h>
+#include <rdlib/ThreadLock.h>
+#include <rdlib/SettingsHandler.h>
+
+/*--------------------------------------------------------------------------------
+ * Per-source statistics block
+ *
+ * Written by the source's stages and the image writer (serialised by a small
+ * spin lock) under a sequence lock, read by the flusher without blocking the
+ * writers: the flusher retries if it catches an update in progress
+ *--------------------------------------------------------------------------------*/
+class StatsBlock {
+public:
+    StatsBlock();
+
+    enum {
+        Stat_FastAvg = 0,
+        Stat_FastSD,
+        Stat_SlowAvg,
+        Stat_SlowSD,
+        Stat_Level,
+        Stat_SeqNo,
+        Stat_Lag,
+        Stat_MaxLag,
+        Stat_StreamFrames,
+        Stat_StreamDropped,
+        Stat_CoarseFrames,
+        Stat_FullFrames,
+        Stat_PrescreenSkipped,
+        Stat_PrescreenSaved,
+        Stat_FrameAllocs,
+        Stat_FPS,
+
+        Stat_Count,
+    };
+
+    // name in the stats file (without the ':<index>' suffix)
+    static const char *GetName(uint_t stat);
+    // integer stats are written as such, others as '%0.16e'
+    static bool IsInteger(uint_t stat);
+
+    void Set(uint_t stat, double val);
+
+    // take a copy of all values which no write was in progress over, returns mask of
+    // stats set since the last call
+    uint32_t Read(double vals[Stat_Count]);
+
+protected:
+    // padding keeps the block off cache lines shared with other data
+    uint8_t               pad1[64];
+    std::atomic<bool>     writing;
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> changed;
+    std::atomic<double>   values[Stat_Count];
+    uint8_t               pad2[64];
+};
+
+/*--------------------------------------------------------------------------------
+ * Shared stats flusher
+ *
+ * Copies changed values from every registered StatsBlock into the stats file
+ * ('imagediff-stats', '<name>:<index>' as before) at a fixed interval on its own
+ * thread so that the sources never take the stats lock or format values
+ *--------------------------------------------------------------------------------*/
+class StatsFlusher : public AThread {
+public:
+    static StatsFlusher& Get();
+
+    void Configure(uint32_t _interval);
+
+    bool Start();
+    void Stop();
+
+    void Register(StatsBlock *block, uint_t index);
+    // flushes the block before removing it
+    void Unregister(StatsBlock *block);
+
+    // read stat from the stats file (pending values are flushed first)
+    AString GetStat(const AString& name);
+
+    // write a stat directly (for infrequently updated stats)
+    void SetStat(const AString& name, const AString& val);
+
+    // copy all pending values into the stats file
+    void Flush();
+
+protected:
+    StatsFlusher();
+    virtual ~StatsFlusher();
+
+    virtual void *Run();
+
+    typedef struct {
+        StatsBlock *block;
+        uint_t     index;
+    } ENTRY;
+
+    void FlushEntry(const ENTRY& entry);
+
+protected:
+    AThreadLockObject  tlock;
+    ASettingsHandler   stats;
+    std::vector<ENTRY> entries;
+    uint32_t           interval;
+    volatile bool      running;
+};
+
+#endif
@@ -0,0 +1,143 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __LINUX__
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+
+#include <rdlib/StdFile.h>
+#include <rdlib/Recurse.h>
+
+#include "Tracer.h"
+
+static __thread void *threadring = NULL;
+
+Tracer::Tracer() : enabled(false),
+                   ringsize(65536)
+{
+}
+
+Tracer::~Tracer()
+{
+    size_t i;
+
+    for (i = 0; i < rings.size(); i++) delete rings[i];
+}
+
+Tracer& Tracer::Get()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+void Tracer::Configure(uint_t _ringsize)
+{
+    ringsize = std::max(_ringsize, 16U);
+}
+
+uint64_t Tracer::GetTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+Tracer::RING *Tracer::GetRing()
+{
+    RING *ring = (RING *)threadring;
+
+    if (!ring && ((ring = new RING) != NULL)) {
+#ifdef __LINUX__
+        ring->tid  = (uint_t)syscall(SYS_gettid);
+#else
+        ring->tid  = 0;
+#endif
+        ring->name = NULL;
+        ring->events.resize(ringsize);
+        ring->head = 0;
+
+        // rings are kept (for the dump) after their thread exits
+        AThreadLock lock(tlock);
+        rings.push_back(ring);
+        threadring = ring;
+    }
+
+    return ring;
+}
+
+void Tracer::Add(const char *name, uint_t index, uint64_t start, uint64_t end)
+{
+    RING *ring;
+
+    if ((ring = GetRing()) != NULL) {
+        // only this thread writes to the ring
+        const uint64_t head  = ring->head.load(std::memory_order_relaxed);
+        EVENT&         event = ring->events[head % ring->events.size()];
+
+        event.name  = name;
+        event.start = start;
+        event.end   = end;
+        event.index = index;
+
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+}
+
+void Tracer::SetThreadName(const char *name)
+{
+    RING *ring;
+
+    if (IsEnabled() && ((ring = GetRing()) != NULL)) ring->name = name;
+}
+
+bool Tracer::Dump(const AString& filename)
+{
+    AThreadLock lock(tlock);
+    AStdFile    fp;
+    uint_t      pid = (uint_t)getpid();
+    size_t      i;
+    bool        first = true;
+
+    CreateDirectory(filename.PathPart());
+    if (!fp.open(filename, "w")) return false;
+
+    fp.printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (i = 0; i < rings.size(); i++) {
+        RING& ring = *rings[i];
+        const uint64_t size = ring.events.size();
+        // copy the ring, events overwritten during the copy are discarded
+        const uint64_t head1 = ring.head.load(std::memory_order_acquire);
+        std::vector<EVENT> events(ring.events);
+        const uint64_t head2 = ring.head.load(std::memory_order_acquire);
+        uint64_t n;
+
+        if (ring.name) {
+            fp.printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                      first ? "" : ",\n", pid, ring.tid, ring.name);
+            first = false;
+        }
+
+        for (n = (head2 > size) ? (head2 - size) : 0; n < head1; n++) {
+            const EVENT& event = events[n % size];
+
+            fp.printf("%s{\"name\":\"%s\",\"cat\":\"imagediff\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%0.3lf,\"dur\":%0.3lf,\"args\":{\"source\":%u}}",
+                      first ? "" : ",\n", event.name, pid, ring.tid,
+                      (double)event.start * 1.0e-3, (double)(event.end - event.start) * 1.0e-3, event.index);
+            first = false;
+        }
+    }
+
+    fp.printf("\n]}\n");
+    fp.close();
+
+    return true;
+}
@@ -0,0 +1,94 @@
+#ifndef __TRACER__
+#define __TRACER__
+
+#include <atomic>
+#include <vector>
+
+#include <rdlib/strsup.h>
+#include <rdlib/ThreadLock.h>
+
+/*--------------------------------------------------------------------------------
+ * Low overhead tracing of timed spans
+ *
+ * Each thread records into its own ring buffer (no locks after the first span on
+ * a thread), when the ring is full the oldest spans are overwritten
+ *
+ * Dump() writes every ring as Chrome trace-event JSON (chrome://tracing or
+ * ui.perfetto.dev), times are CLOCK_MONOTONIC so they line up with
+ * 'perf record -k CLOCK_MONOTONIC'
+ *
+ * When tracing is disabled a span costs a single relaxed load
+ *--------------------------------------------------------------------------------*/
+class Tracer {
+public:
+    static Tracer& Get();
+
+    // events kept per thread (takes effect for threads that have not traced yet)
+    void Configure(uint_t _ringsize);
+
+    void Enable(bool enable) {enabled.store(enable, std::memory_order_relaxed);}
+    static bool IsEnabled() {return Get().enabled.load(std::memory_order_relaxed);}
+
+    // ns
+    static uint64_t GetTime();
+
+    // record span on the calling thread, name must be a static string
+    void Add(const char *name, uint_t index, uint64_t start, uint64_t end);
+
+    // name the calling thread in the trace
+    void SetThreadName(const char *name);
+
+    // write all recorded spans
+    bool Dump(const AString& filename);
+
+protected:
+    Tracer();
+    ~Tracer();
+
+    typedef struct {
+        const char *name;
+        uint64_t   start;
+        uint64_t   end;
+        uint_t     index;
+    } EVENT;
+
+    typedef struct {
+        uint_t                tid;
+        const char            *name;
+        std::vector<EVENT>    events;
+        std::atomic<uint64_t> head;     // number of events ever written
+    } RING;
+
+    RING *GetRing();
+
+protected:
+    AThreadLockObject   tlock;
+    std::vector<RING *> rings;
+    std::atomic<bool>   enabled;
+    uint_t              ringsize;
+};
+
+/*--------------------------------------------------------------------------------
+ * Span from construction until End() or destruction
+ *--------------------------------------------------------------------------------*/
+class TraceSpan {
+public:
+    TraceSpan(const char *_name, uint_t _index = 0) : name(_name),
+                                                      index(_index),
+                                                      start(Tracer::IsEnabled() ? Tracer::GetTime() : 0) {}
+    ~TraceSpan() {End();}
+
+    void End() {
+        if (start) {
+            Tracer::Get().Add(name, index, start, Tracer::GetTime());
+            start = 0;
+        }
+    }
+
+protected:
+    const char *name;
+    uint_t     index;
+    uint64_t   start;
+};
+
+#endif
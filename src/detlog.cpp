@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <rdlib/strsup.h>
+#include <rdlib/DateTime.h>
+
+#include "DetectionLog.h"
+
+int main(int argc, char *argv[])
+{
+    uint64_t from = 0, to = ~(uint64_t)0;
+    AString  outfile;
+    bool     count = false;
+    int      i, rc = 0;
+
+    for (i = 1; (i < argc) && (argv[i][0] == '-'); i++) {
+        if      ((strcmp(argv[i], "-from") == 0) && ((i + 1) < argc)) {ADateTime dt; dt.StrToDate(argv[++i]); from = (uint64_t)dt;}
+        else if ((strcmp(argv[i], "-to")   == 0) && ((i + 1) < argc)) {ADateTime dt; dt.StrToDate(argv[++i]); to   = (uint64_t)dt;}
+        else if ((strcmp(argv[i], "-o")    == 0) && ((i + 1) < argc)) outfile = argv[++i];
+        else if  (strcmp(argv[i], "-count") == 0) count = true;
+        else {
+            fprintf(stderr, "Unrecognized option '%s'\n", argv[i]);
+            i = argc;
+            break;
+        }
+    }
+
+    if (i >= argc) {
+        fprintf(stderr, "Usage: detlog [-from <date>] [-to <date>] [-o <text-file>] [-count] <binary-log> ...\n");
+        fprintf(stderr, "Writes detections between the dates (inclusive) from imagediff binary detection logs in the text detection log format\n");
+        exit(-1);
+    }
+
+    FILE *fp = stdout;
+    if (!count && outfile.Valid() && ((fp = fopen(outfile, "w")) == NULL)) {
+        fprintf(stderr, "Failed to open file '%s' for writing\n", outfile.str());
+        exit(-3);
+    }
+
+    uint64_t total = 0;
+    for (; i < argc; i++) {
+        std::vector<DetectionLog::RECORD> records;
+
+        if (DetectionLog::Read(argv[i], from, to, records)) {
+            size_t j;
+
+            total += records.size();
+
+            if (count) continue;
+
+            for (j = 0; j < records.size(); j++) {
+                AString str = DetectionLog::Format(records[j]);
+
+                if (records[j].flags & DetectionLog::Flag_NewSequence) fprintf(fp, "\n");
+                fprintf(fp, "%s\n", str.str());
+            }
+        }
+        else {
+            fprintf(stderr, "Failed to read detection log '%s'\n", argv[i]);
+            rc = -2;
+        }
+    }
+
+    if (count) printf("%llu\n", (unsigned long long)total);
+
+    if (fp != stdout) fclose(fp);
+
+    return rc;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <thread>
+#include <vector>
+
+#include "HTTPClient.h"
+
+/*--------------------------------------------------------------------------------
+ * Checks HTTPClient against a local stand-in server: keep-alive re-use,
+ * chunked bodies, re-connecting after the server closes an idle connection
+ * and reporting the status of responses the client cannot handle
+ *
+ * Exits with 0 if all checks pass
+ *--------------------------------------------------------------------------------*/
+
+typedef struct {
+    const char *response;       // sent verbatim (headers and body)
+    bool       close;           // close the connection after sending (without saying so)
+} REPLY;
+
+class StandInServer {
+public:
+    StandInServer() : sock(-1),
+                      port(0),
+                      connections(0),
+                      requests(0) {}
+    ~StandInServer() {
+        // wakes the server from accept() if a failed check left replies unsent
+        if (sock >= 0) shutdown(sock, SHUT_RDWR);
+        if (thread.joinable()) thread.join();
+        if (sock >= 0) close(sock);
+    }
+
+    bool Start(const std::vector<REPLY>& _replies) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int one = 1;
+
+        replies = _replies;
+
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) return false;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        // any free port on the loopback interface
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port        = 0;
+
+        if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+            (listen(sock, 4) < 0) ||
+            (getsockname(sock, (struct sockaddr *)&addr, &len) < 0)) return false;
+
+        port   = ntohs(addr.sin_port);
+        thread = std::thread(&StandInServer::Run, this);
+
+        return true;
+    }
+
+    AString GetURL() const {return AString("http://127.0.0.1:%/snapshot.jpg").Arg(port);}
+    uint_t  GetConnections() const {return connections;}
+    uint_t  GetRequests() const {return requests;}
+
+protected:
+    void Run() {
+        size_t i = 0;
+
+        // one connection at a time, each serving replies until one closes it
+        while (i < replies.size()) {
+            int conn;
+
+            if ((conn = accept(sock, NULL, NULL)) < 0) break;
+            connections++;
+
+            while (i < replies.size()) {
+                AString request;
+                char    buf[1024];
+                ssize_t n;
+
+                while ((request.Pos("\r\n\r\n") < 0) && ((n = recv(conn, buf, sizeof(buf) - 1, 0)) > 0)) {
+                    buf[n] = 0;
+                    request += buf;
+                }
+                if (request.Pos("\r\n\r\n") < 0) break;
+
+                requests++;
+
+                const REPLY& reply = replies[i++];
+                send(conn, reply.response, strlen(reply.response), MSG_NOSIGNAL);
+                if (reply.close) break;
+            }
+
+            close(conn);
+        }
+    }
+
+protected:
+    std::vector<REPLY> replies;
+    std::thread        thread;
+    int                sock;
+    uint_t             port;
+    volatile uint_t    connections;
+    volatile uint_t    requests;
+};
+
+static const uint32_t timeout = 2000;
+static uint_t failures = 0;
+
+static void Check(const char *name, bool success, const AString& detail = "")
+{
+    printf("%s: %s%s%s\n", name, success ? "pass" : "FAIL", detail.Valid() ? " - " : "", detail.str());
+    if (!success) failures++;
+}
+
+static bool BodyIs(const std::vector<uint8_t>& body, const char *str)
+{
+    return ((body.size() == strlen(str)) && (memcmp(&body[0], str, body.size()) == 0));
+}
+
+int main(void)
+{
+    static const char *ok = "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: 5\r\n\r\nframe";
+    std::vector<uint8_t> body;
+
+    {
+        // keep-alive: both requests on one connection
+        StandInServer server;
+        HTTPClient    client;
+        std::vector<REPLY> replies = {{ok, false}, {ok, true}};
+        bool success;
+
+        if (server.Start(replies)) {
+            success  = client.Get(server.GetURL(), body, timeout) && BodyIs(body, "frame");
+            success &= client.Get(server.GetURL(), body, timeout) && BodyIs(body, "frame");
+            Check("keep-alive", success && (client.GetConnections() == 1),
+                  AString("% connection(s) ").Arg(client.GetConnections()) + client.GetError());
+        }
+        else Check("keep-alive", false, "failed to start server");
+    }
+
+    {
+        // chunked body, including chunk extensions and a trailer
+        StandInServer server;
+        HTTPClient    client;
+        std::vector<REPLY> replies = {{"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                       "4\r\nfram\r\n6;ext=1\r\ne-data\r\n0\r\nX-Trailer: 1\r\n\r\n", false},
+                                      {ok, true}};
+        bool success;
+
+        if (server.Start(replies)) {
+            success  = client.Get(server.GetURL(), body, timeout) && BodyIs(body, "frame-data");
+            // the connection must be left at the start of the next response
+            success &= client.Get(server.GetURL(), body, timeout) && BodyIs(body, "frame");
+            Check("chunked", success && (client.GetConnections() == 1), client.GetError());
+        }
+        else Check("chunked", false, "failed to start server");
+    }
+
+    {
+        // server closes the connection while idle: the next request re-connects and succeeds
+        StandInServer server;
+        HTTPClient    client;
+        std::vector<REPLY> replies = {{ok, true}, {ok, true}};
+        bool success;
+
+        if (server.Start(replies)) {
+            success = client.Get(server.GetURL(), body, timeout) && BodyIs(body, "frame");
+            usleep(100000);
+            success &= client.Get(server.GetURL(), body, timeout) && BodyIs(body, "frame");
+            Check("idle close retry", success && (client.GetConnections() == 2) && (server.GetRequests() == 2),
+                  AString("% connection(s) ").Arg(client.GetConnections()) + client.GetError());
+        }
+        else Check("idle close retry", false, "failed to start server");
+    }
+
+    {
+        // responses the client cannot handle fail with their status so callers can fall back
+        StandInServer server;
+        HTTPClient    client;
+        std::vector<REPLY> replies = {{"HTTP/1.1 401 Unauthorized\r\nWWW-Authenticate: Digest realm=\"cam\"\r\nContent-Length: 0\r\n\r\n", false},
+                                      {"HTTP/1.1 302 Found\r\nLocation: /other.jpg\r\nContent-Length: 0\r\n\r\n", true}};
+        bool success;
+
+        if (server.Start(replies)) {
+            success  = !client.Get(server.GetURL(), body, timeout) && (client.GetStatus() == 401);
+            success &= !client.Get(server.GetURL(), body, timeout) && (client.GetStatus() == 302);
+            Check("unsupported status", success, client.GetError());
+        }
+        else Check("unsupported status", false, "failed to start server");
+    }
+
+    return failures ? 1 : 0;
+}
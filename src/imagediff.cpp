@@ -13,18 +13,40 @@
 #include "imagediff_private.h"
 
 #include "ImageDiffer.h"
+#include "DifferScheduler.h"
+#include "ImageWriter.h"
+#include "StatsFlusher.h"
+#include "LogWriter.h"
+#include "DetectionLog.h"
+#include "Tracer.h"
+#include "CommandRunner.h"
 
 AQuitHandler quithandler;
 
 volatile bool hupdetected = false;
+volatile bool tracedumprequested = false;
 
 #ifdef __LINUX__
 static void detecthup(int sig)
 {
     hupdetected |= (sig == SIGHUP);
 }
+
+static void detectusr1(int sig)
+{
+    tracedumprequested |= (sig == SIGUSR1);
+}
 #endif
 
+static void dumptrace()
+{
+    AString filename = ImageDiffer::GetGlobalSetting("tracefile", "{loglocation}/imagediff-trace-%Y-%M-%D-%h-%m-%s.json");
+
+    filename = ADateTime().DateFormat(filename.SearchAndReplace("{loglocation}", ImageDiffer::GetGlobalSetting("loglocation", "/var/log/imagediff")));
+    if (Tracer::Get().Dump(filename)) fprintf(stderr, "Trace written to '%s'\n", filename.str());
+    else                              fprintf(stderr, "Failed to write trace to '%s'\n", filename.str());
+}
+
 int main(int argc, char *argv[])
 {
     int  i;
@@ -32,6 +54,7 @@ int main(int argc, char *argv[])
 
 #ifdef __LINUX__
     signal(SIGHUP, &detecthup);
+    signal(SIGUSR1, &detectusr1);
 #endif
 
     for (i = 1; i < argc; i++) {
@@ -41,6 +64,9 @@ int main(int argc, char *argv[])
             printf("Where <options> is one or more of:\n");
             printf("  -h or -help\t\thelp text (this)\n");
             printf("  -cmp <index> <jpeg-1> <jpeg-2> <det-jpeg>\tRun single round of differ <index> on pictures <jpeg-1> and <jpeg-2> and save the detection data to <det-jpeg>n");
+            printf("  -verify <index> <jpeg-1> <jpeg-2>\tCompare difference kernels of differ <index> against the double-precision reference on pictures <jpeg-1> and <jpeg-2>\n");
+            printf("  -fetch <index> <count>\tFetch and decode <count> frames using the capture settings of differ <index>\n");
+            printf("  -bench <dir> [-index <index>] [-threads <n>] [-save <det-dir>]\tReplay the JPEGs in <dir> through differ <index> (default 1) as fast as possible on <n> threads (0 = one per core) and report frames/s and per-stage times, optionally saving detection images to <det-dir>\n");
             run = false;
         }
         else if (stricmp(argv[i], "-cmp") == 0) {
@@ -52,28 +78,119 @@ int main(int argc, char *argv[])
             differ.Compare(file1, file2, file3);
             run = false;
         }
+        else if (stricmp(argv[i], "-verify") == 0) {
+            ImageDiffer differ(atoi(argv[++i]));
+            const char  *file1 = argv[++i];
+            const char  *file2 = argv[++i];
+
+            if (!differ.Verify(file1, file2)) return 1;
+            run = false;
+        }
+        else if (stricmp(argv[i], "-fetch") == 0) {
+            ImageDiffer differ(atoi(argv[++i]));
+            uint_t      count = (uint_t)atoi(argv[++i]);
+
+            if (!differ.Fetch(count)) return 1;
+            run = false;
+        }
+        else if (stricmp(argv[i], "-bench") == 0) {
+            AString dir = argv[++i];
+            AString savedir;
+            uint_t  index = 1, nthreads = 1;
+
+            while ((i + 2) < argc) {
+                if      (stricmp(argv[i + 1], "-index")   == 0) index    = (uint_t)atoi(argv[i += 2]);
+                else if (stricmp(argv[i + 1], "-threads") == 0) nthreads = (uint_t)atoi(argv[i += 2]);
+                else if (stricmp(argv[i + 1], "-save")    == 0) savedir  = argv[i += 2];
+                else break;
+            }
+
+            if (!ImageDiffer::Bench(index, dir, nthreads, savedir)) return 1;
+            run = false;
+        }
     }
 
     if (run) {
-        ADataList differs;
+        ADataList       differs;
+        DifferScheduler scheduler;
+        ImageWriter&    writer = ImageWriter::Get();
+        StatsFlusher&   flusher = StatsFlusher::Get();
+        LogWriter&      logger  = LogWriter::Get();
+        DetectionLog&   detlog  = DetectionLog::Get();
+        Tracer&         tracer  = Tracer::Get();
+        CommandRunner&  runner  = CommandRunner::Get();
 
         differs.SetDestructor(&ImageDiffer::Delete);
 
+        // log lines are written by a background thread with a cap on queued memory
+        logger.Configure((size_t)(uint_t)ImageDiffer::GetGlobalSetting("logqueuesize", "1048576"));
+        logger.Start();
+
+        // spans of each stage of every source are recorded per thread and dumped on SIGUSR1 and at exit
+        tracer.Configure((uint_t)ImageDiffer::GetGlobalSetting("tracebuffer", "65536"));
+        tracer.Enable((uint_t)ImageDiffer::GetGlobalSetting("trace", "0") != 0);
+
+        // detection images are encoded and written by a shared background writer
+        writer.Configure((uint_t)ImageDiffer::GetGlobalSetting("writerqueue", "32"),
+                         ImageWriter::ParseOverflow(ImageDiffer::GetGlobalSetting("writeroverflow", "sync")));
+        writer.Start();
+
+        // detection commands are run on a separate thread so they never hold up capture
+        runner.Configure((uint_t)ImageDiffer::GetGlobalSetting("commandconcurrency", "4"),
+                         (uint_t)ImageDiffer::GetGlobalSetting("commandqueue", "64"));
+        runner.Start();
+
+        // settings changes are picked up using inotify where possible (otherwise source 1 polls the file)
+        ImageDiffer::WatchSettings(true);
+
+        // stats are published lock-free by each source and written to the stats file periodically
+        flusher.Configure((uint32_t)ImageDiffer::GetGlobalSetting("statsinterval", "1000"));
+        flusher.Start();
+
+        // binary detection log records are batched and appended periodically
+        detlog.Configure((uint32_t)ImageDiffer::GetGlobalSetting("detloginterval", "1000"));
+        detlog.Start();
+
         uint_t i, ndiffers = (uint_t)ImageDiffer::GetGlobalSetting("sources", "1");
         for (i = 0; i < ndiffers; i++) {
             ImageDiffer *differ;
 
             if ((differ = new ImageDiffer(1 + i)) != NULL) {
                 differs.Add((uptr_t)differ);
-                differ->Start();
+                scheduler.Add(differ);
             }
         }
 
-        while (!quithandler.HasQuit() && !hupdetected && (ImageDiffer::DiffersRunning() > 0)) {
+        // frames are decoded and processed on a pool of worker threads (default one per core),
+        // capture (which only fetches the JPEG data but blocks on the cameras) has its own
+        // pool (default one thread per source)
+        scheduler.Start((uint_t)ImageDiffer::GetGlobalSetting("threads", "0"),
+                        (uint_t)ImageDiffer::GetGlobalSetting("capturethreads", "0"));
+
+        while (!quithandler.HasQuit() && !hupdetected && (scheduler.SourcesRunning() > 0)) {
             Sleep(100);
+
+            if (tracedumprequested) {
+                tracedumprequested = false;
+                if (Tracer::IsEnabled()) dumptrace();
+                else fprintf(stderr, "Tracing not enabled (set 'trace=1')\n");
+            }
         }
 
+        scheduler.Stop();
+
         differs.DeleteList();
+
+        writer.Stop();
+        runner.Stop();
+        detlog.Stop();
+        flusher.Stop();
+
+        ImageDiffer::WatchSettings(false);
+
+        if (Tracer::IsEnabled()) dumptrace();
+
+        logger.Stop();
     }
 
     return 0;